@@ -0,0 +1,141 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+/**
+ * Measure the CPU fill and readback bandwidth of the DMA buffers
+ * for each of the cache modes selectable with `KNACS_SET_ALLOC_FLAGS`.
+ * For the cached mode, the time to sync the cache (which the driver does
+ * on `KNACS_DMA_SUBMIT` and the user needs to do before reading data from the hardware)
+ * is reported separately.
+ *
+ * Usage: knacs-cache-bench [size in KiB] [repeat]
+ */
+
+#include <knacs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static double rate(size_t sz, unsigned repeat, double t)
+{
+    return (double)sz * repeat / t / (1024 * 1024);
+}
+
+static int sync_buff(int fd, void *p, size_t sz, uint32_t dir)
+{
+    knacs_dma_sync_t sync = {
+        .addr = (uintptr_t)p,
+        .len = sz,
+        .dir = dir,
+    };
+    return ioctl(fd, KNACS_DMA_SYNC, &sync);
+}
+
+static int bench_mode(int fd, const char *name, uint32_t mode, size_t sz, unsigned repeat)
+{
+    uint32_t flags = mode;
+    if (ioctl(fd, KNACS_SET_ALLOC_FLAGS, &flags) < 0) {
+        fprintf(stderr, "%s: KNACS_SET_ALLOC_FLAGS failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    uint64_t *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       KNACS_MMAP_DMA_BUFF * sysconf(_SC_PAGESIZE));
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    size_t n = sz / sizeof(uint64_t);
+
+    double t0 = get_time();
+    for (unsigned r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < n; i++)
+            p[i] = i + r;
+    }
+    double t_fill = get_time() - t0;
+
+    t0 = get_time();
+    volatile uint64_t sum = 0;
+    for (unsigned r = 0; r < repeat; r++) {
+        uint64_t s = 0;
+        for (size_t i = 0; i < n; i++)
+            s += p[i];
+        sum += s;
+    }
+    double t_read = get_time() - t0;
+
+    double t_sync = 0;
+    if (mode == KNACS_ALLOC_CACHED) {
+        t0 = get_time();
+        for (unsigned r = 0; r < repeat; r++) {
+            if (sync_buff(fd, p, sz, KNACS_SYNC_FOR_DEVICE) < 0 ||
+                sync_buff(fd, p, sz, KNACS_SYNC_FOR_CPU) < 0) {
+                fprintf(stderr, "%s: KNACS_DMA_SYNC failed: %s\n", name, strerror(errno));
+                t_sync = -1;
+                break;
+            }
+        }
+        if (t_sync == 0)
+            t_sync = get_time() - t0;
+    }
+
+    printf("%-16s fill: %10.1f MiB/s   read: %10.1f MiB/s", name,
+           rate(sz, repeat, t_fill), rate(sz, repeat, t_read));
+    if (t_sync > 0)
+        printf("   sync: %8.1f us", t_sync / repeat * 1e6);
+    printf("\n");
+    munmap(p, sz);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t sz = (argc > 1 ? strtoul(argv[1], NULL, 0) : 4096) * 1024;
+    unsigned repeat = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+    if (sz == 0 || repeat == 0) {
+        fprintf(stderr, "Usage: %s [size in KiB] [repeat]\n", argv[0]);
+        return 1;
+    }
+    int fd = open("/dev/knacs", O_RDWR);
+    if (fd < 0) {
+        perror("Unable to open /dev/knacs");
+        return 1;
+    }
+    printf("Buffer size: %zu KiB, %u repeats\n", sz / 1024, repeat);
+    int ret = 0;
+    ret |= bench_mode(fd, "cached", KNACS_ALLOC_CACHED, sz, repeat);
+    ret |= bench_mode(fd, "write-combined", KNACS_ALLOC_WRITECOMBINE, sz, repeat);
+    ret |= bench_mode(fd, "uncached", KNACS_ALLOC_UNCACHED, sz, repeat);
+    close(fd);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+/**
+ * Compare buffers mapped with normal pages and with huge pages (`KNACS_ALLOC_HUGE`).
+ *
+ * For each mode, a buffer is created with `KNACS_BUFF_CREATE` and filled
+ * sequentially and with a page sized stride (which needs a new TLB entry for every
+ * access with normal pages). The first fill includes the page faults and is reported
+ * separately. The data TLB misses are counted with `perf_event_open`
+ * when the CPU supports the event.
+ *
+ * Usage: knacs-huge-bench [size in KiB] [repeat]
+ */
+
+#include <knacs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static double rate(size_t sz, unsigned repeat, double t)
+{
+    return (double)sz * repeat / t / (1024 * 1024);
+}
+
+// Returns -1 if the data TLB miss event isn't available.
+static int open_tlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Not all CPUs count the write misses separately, use the read ones if not.
+    static const uint64_t ops[] = { PERF_COUNT_HW_CACHE_OP_WRITE, PERF_COUNT_HW_CACHE_OP_READ };
+    for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (ops[i] << 8) |
+            ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0)
+            return fd;
+    }
+    return -1;
+}
+
+static void counter_start(int fd)
+{
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static long long counter_stop(int fd)
+{
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+static void print_result(const char *name, const char *test, size_t sz, unsigned repeat,
+                         double t, long long misses)
+{
+    printf("%-8s %-10s %10.1f MiB/s", name, test, rate(sz, repeat, t));
+    if (misses >= 0)
+        printf("   dTLB misses: %12lld", misses / repeat);
+    printf("\n");
+}
+
+static int bench_mode(int fd, int tlb_fd, const char *name, uint32_t flags, size_t sz,
+                      unsigned repeat)
+{
+    knacs_buff_create_t create = {
+        .size = sz,
+        // Make sure a small buffer doesn't end up in the OCM.
+        .flags = flags | KNACS_ALLOC_TIER_BULK,
+    };
+    if (ioctl(fd, KNACS_BUFF_CREATE, &create) < 0) {
+        fprintf(stderr, "%s: KNACS_BUFF_CREATE failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    uint64_t *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, create.offset);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", name, strerror(errno));
+        ioctl(fd, KNACS_BUFF_FREE, &create.handle);
+        return -1;
+    }
+    size_t n = sz / sizeof(uint64_t);
+    size_t stride = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+
+    counter_start(tlb_fd);
+    double t0 = get_time();
+    for (size_t i = 0; i < n; i++)
+        p[i] = i;
+    double t = get_time() - t0;
+    print_result(name, "first", sz, 1, t, counter_stop(tlb_fd));
+
+    counter_start(tlb_fd);
+    t0 = get_time();
+    for (unsigned r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < n; i++)
+            p[i] = i + r;
+    }
+    t = get_time() - t0;
+    print_result(name, "sequential", sz, repeat, t, counter_stop(tlb_fd));
+
+    counter_start(tlb_fd);
+    t0 = get_time();
+    for (unsigned r = 0; r < repeat; r++) {
+        for (size_t j = 0; j < stride; j++) {
+            for (size_t i = j; i < n; i += stride)
+                p[i] = i + r;
+        }
+    }
+    t = get_time() - t0;
+    print_result(name, "strided", sz, repeat, t, counter_stop(tlb_fd));
+
+    munmap(p, sz);
+    ioctl(fd, KNACS_BUFF_FREE, &create.handle);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t sz = (argc > 1 ? strtoul(argv[1], NULL, 0) : 16384) * 1024;
+    unsigned repeat = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+    if (sz == 0 || repeat == 0) {
+        fprintf(stderr, "Usage: %s [size in KiB] [repeat]\n", argv[0]);
+        return 1;
+    }
+    int fd = open("/dev/knacs", O_RDWR);
+    if (fd < 0) {
+        perror("Unable to open /dev/knacs");
+        return 1;
+    }
+    int tlb_fd = open_tlb_counter();
+    if (tlb_fd < 0)
+        printf("dTLB miss counter not available\n");
+    printf("Buffer size: %zu KiB, %u repeats\n", sz / 1024, repeat);
+    int ret = 0;
+    ret |= bench_mode(fd, tlb_fd, "normal", 0, sz, repeat);
+    ret |= bench_mode(fd, tlb_fd, "huge", KNACS_ALLOC_HUGE, sz, repeat);
+    if (tlb_fd >= 0)
+        close(tlb_fd);
+    close(fd);
+    return ret ? 1 : 0;
+}
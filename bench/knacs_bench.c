@@ -0,0 +1,222 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+/**
+ * Micro-benchmarks for the allocation and mapping paths of `/dev/knacs`.
+ *
+ * * `mmap`/`munmap` latency and throughput of the OCM (page offset 1) and
+ *   the DMA buffers (page offset 2) for different buffer sizes and thread counts.
+ * * Splitting and duplicating a buffer mapping, which goes through the reference
+ *   counting in the `open`/`close` VMA callbacks (`mprotect` of a page in the middle
+ *   and `fork`).
+ * * Round trip latency of a register read on the pulse controller page,
+ *   both directly and through `KNACS_REG_BATCH`.
+ *
+ * Without the hardware, load the module with `pulse_ctl_mock=1 ocm_mock_size=<bytes>`
+ * to run everything against the mock devices.
+ *
+ * Usage: knacs-bench [iterations]
+ */
+
+#include <knacs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int knacs_fd = -1;
+static size_t page_size;
+static unsigned iters = 1000;
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void *map_buff(int pgoff, size_t sz)
+{
+    void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, knacs_fd, pgoff * page_size);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+struct mmap_arg {
+    int pgoff;
+    size_t sz;
+    uint64_t map_ns;
+    uint64_t unmap_ns;
+    unsigned failed;
+};
+
+static void *mmap_thread(void *_arg)
+{
+    struct mmap_arg *arg = _arg;
+    for (unsigned i = 0; i < iters; i++) {
+        uint64_t t0 = get_time_ns();
+        volatile char *p = map_buff(arg->pgoff, arg->sz);
+        uint64_t t1 = get_time_ns();
+        if (!p) {
+            arg->failed++;
+            continue;
+        }
+        p[0] = 1;
+        uint64_t t2 = get_time_ns();
+        munmap((void*)p, arg->sz);
+        uint64_t t3 = get_time_ns();
+        arg->map_ns += t1 - t0;
+        arg->unmap_ns += t3 - t2;
+    }
+    return NULL;
+}
+
+static void bench_mmap(const char *name, int pgoff, size_t sz, unsigned nthreads)
+{
+    struct mmap_arg args[nthreads];
+    pthread_t threads[nthreads];
+    memset(args, 0, sizeof(args));
+    uint64_t t0 = get_time_ns();
+    for (unsigned i = 0; i < nthreads; i++) {
+        args[i].pgoff = pgoff;
+        args[i].sz = sz;
+        pthread_create(&threads[i], NULL, mmap_thread, &args[i]);
+    }
+    uint64_t map_ns = 0, unmap_ns = 0;
+    unsigned failed = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        map_ns += args[i].map_ns;
+        unmap_ns += args[i].unmap_ns;
+        failed += args[i].failed;
+    }
+    double total = (double)(get_time_ns() - t0) * 1e-9;
+    unsigned nok = iters * nthreads - failed;
+    if (!nok) {
+        printf("%-8s %8zu KiB %2u threads: failed\n", name, sz / 1024, nthreads);
+        return;
+    }
+    printf("%-8s %8zu KiB %2u threads: mmap %9.2f us, munmap %9.2f us, %10.1f ops/s",
+           name, sz / 1024, nthreads, map_ns / 1e3 / nok, unmap_ns / 1e3 / nok, nok / total);
+    if (failed)
+        printf(" (%u failed)", failed);
+    printf("\n");
+}
+
+static void bench_split(void)
+{
+    size_t sz = 16 * page_size;
+    char *p = map_buff(KNACS_MMAP_DMA_BUFF, sz);
+    if (!p) {
+        printf("split: mmap failed: %s\n", strerror(errno));
+        return;
+    }
+    // Changing the protection of a page in the middle splits the VMA in 3
+    // and changing it back merges them again.
+    uint64_t t0 = get_time_ns();
+    for (unsigned i = 0; i < iters; i++) {
+        if (mprotect(p + 8 * page_size, page_size, PROT_READ) ||
+            mprotect(p + 8 * page_size, page_size, PROT_READ | PROT_WRITE)) {
+            printf("split: mprotect failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+    printf("VMA split+merge: %9.2f us\n", (get_time_ns() - t0) / 1e3 / iters);
+
+    unsigned nfork = iters < 100 ? iters : 100;
+    t0 = get_time_ns();
+    for (unsigned i = 0; i < nfork; i++) {
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(0);
+        if (pid < 0) {
+            printf("fork failed: %s\n", strerror(errno));
+            break;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    printf("fork+exit with mapped buffer: %9.2f us\n", (get_time_ns() - t0) / 1e3 / nfork);
+    munmap(p, sz);
+}
+
+static void bench_reg(void)
+{
+    volatile uint32_t *regs = map_buff(KNACS_MMAP_PULSE_CTL, page_size);
+    if (!regs) {
+        printf("register: mmap failed: %s\n", strerror(errno));
+        return;
+    }
+    uint32_t sum = 0;
+    uint64_t t0 = get_time_ns();
+    for (unsigned i = 0; i < iters; i++)
+        sum += regs[0];
+    printf("register read (mmap): %9.3f us\n", (get_time_ns() - t0) / 1e3 / iters);
+    munmap((void*)regs, page_size);
+
+    knacs_reg_op_t op = { .op = KNACS_REG_READ, .offset = 0 };
+    knacs_reg_batch_t batch = { .ops = (uintptr_t)&op, .nops = 1 };
+    t0 = get_time_ns();
+    for (unsigned i = 0; i < iters; i++) {
+        if (ioctl(knacs_fd, KNACS_REG_BATCH, &batch) < 0) {
+            printf("register read (ioctl): failed: %s\n", strerror(errno));
+            return;
+        }
+        sum += op.val;
+    }
+    printf("register read (ioctl): %9.3f us\n", (get_time_ns() - t0) / 1e3 / iters);
+    (void)sum;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        iters = strtoul(argv[1], NULL, 0);
+    if (iters == 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    knacs_fd = open("/dev/knacs", O_RDWR);
+    if (knacs_fd < 0) {
+        perror("Unable to open /dev/knacs");
+        return 1;
+    }
+    static const size_t sizes[] = { 4096, 65536, 262144, 1048576, 4194304 };
+    static const unsigned nthreads[] = { 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(nthreads) / sizeof(nthreads[0]); j++) {
+            // The OCM is small, don't bother with the large sizes.
+            if (sizes[i] <= 65536)
+                bench_mmap("OCM", KNACS_MMAP_OCM, sizes[i], nthreads[j]);
+            bench_mmap("DMA", KNACS_MMAP_DMA_BUFF, sizes[i], nthreads[j]);
+        }
+    }
+    bench_split();
+    bench_reg();
+    close(knacs_fd);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+/**
+ * Stream a buffer of commands into the pulse controller FIFO (or the simulated one
+ * when the module is loaded with `pulse_stream_sim=1`) and report the achieved rate
+ * and the number of underflows.
+ *
+ * Usage: knacs-stream-bench [number of words]
+ */
+
+#include <knacs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+    size_t nwords = argc > 1 ? strtoul(argv[1], NULL, 0) : 16 * 1024 * 1024;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t sz = (nwords * 4 + page_size - 1) / page_size * page_size;
+    if (nwords == 0) {
+        fprintf(stderr, "Usage: %s [number of words]\n", argv[0]);
+        return 1;
+    }
+    int fd = open("/dev/knacs", O_RDWR);
+    if (fd < 0) {
+        perror("Unable to open /dev/knacs");
+        return 1;
+    }
+    int ret = 1;
+    uint32_t *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       KNACS_MMAP_DMA_BUFF * page_size);
+    if (p == MAP_FAILED) {
+        perror("mmap failed");
+        goto out;
+    }
+    for (size_t i = 0; i < nwords; i++)
+        p[i] = (uint32_t)i;
+
+    uint32_t mask = 1u << KNACS_EVENT_STREAM;
+    if (ioctl(fd, KNACS_SET_EVENT_MASK, &mask) < 0) {
+        perror("KNACS_SET_EVENT_MASK failed");
+        goto out_unmap;
+    }
+    knacs_stream_start_t start = {
+        .addr = (uintptr_t)p,
+        .len = nwords * 4,
+    };
+    if (ioctl(fd, KNACS_STREAM_START, &start) < 0) {
+        perror("KNACS_STREAM_START failed");
+        goto out_unmap;
+    }
+    for (;;) {
+        knacs_event_t ev;
+        if (read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+            perror("read failed");
+            goto out_unmap;
+        }
+        if (ev.type == KNACS_EVENT_STREAM && ev.status != -EPIPE) {
+            if (ev.status)
+                fprintf(stderr, "Stream failed: %s\n", strerror(-ev.status));
+            break;
+        }
+    }
+    knacs_stream_stats_t stats;
+    if (ioctl(fd, KNACS_STREAM_GET_STATS, &stats) < 0) {
+        perror("KNACS_STREAM_GET_STATS failed");
+        goto out_unmap;
+    }
+    printf("Sent %llu/%llu words in %.3f ms (%llu fills)\n",
+           (unsigned long long)stats.words_sent, (unsigned long long)stats.words_total,
+           stats.elapsed_ns / 1e6, (unsigned long long)stats.fills);
+    printf("Rate: %.3f Mwords/s, underflows: %llu\n", stats.rate / 1e6,
+           (unsigned long long)stats.underflows);
+    ret = 0;
+out_unmap:
+    munmap(p, sz);
+out:
+    close(fd);
+    return ret;
+}
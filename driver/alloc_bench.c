@@ -0,0 +1,154 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (alloc-bench): " fmt
+
+/**
+ * Micro-benchmark for the DMA buffer allocator.
+ *
+ * This runs at load time when `alloc_bench_iters` is set and compares
+ * the DMA page cache with the gen_pool based allocation used previously
+ * (and still used for the OCM). Each iteration allocates a few buffers of the same size
+ * before freeing all of them so that the gen_pool has to search past the allocated ones.
+ */
+
+#include "alloc_bench.h"
+
+#include "dma_page.h"
+
+#include <linux/genalloc.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+static unsigned int alloc_bench_iters = 0;
+module_param(alloc_bench_iters, uint, 0444);
+MODULE_PARM_DESC(alloc_bench_iters, "Run the allocator benchmark with this many iterations");
+
+// Number of buffers alive at the same time.
+#define BENCH_DEPTH 8
+// Never used as the ID of a file.
+#define BENCH_OWNER U64_MAX
+#define BENCH_MAX_PAGES 64
+#define BENCH_POOL_CHUNKS (BENCH_DEPTH * BENCH_MAX_PAGES >> KNACS_DMA_MAX_ORDER)
+
+static const unsigned int bench_sizes[] = {1, 4, 16, 64};
+
+static struct page *pool_pages[BENCH_POOL_CHUNKS];
+
+static void bench_pool_destroy(struct gen_pool *pool)
+{
+    if (pool)
+        gen_pool_destroy(pool);
+    for (unsigned int i = 0; i < BENCH_POOL_CHUNKS; i++) {
+        if (pool_pages[i])
+            __free_pages(pool_pages[i], KNACS_DMA_MAX_ORDER);
+        pool_pages[i] = NULL;
+    }
+}
+
+// Same setup as the DMA buffer pool used to be, just large enough to hold all the buffers.
+static struct gen_pool *bench_pool_create(void)
+{
+    struct gen_pool *pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
+    if (!pool)
+        return NULL;
+    for (unsigned int i = 0; i < BENCH_POOL_CHUNKS; i++) {
+        struct page *page = alloc_pages(GFP_KERNEL | __GFP_NOWARN, KNACS_DMA_MAX_ORDER);
+        if (!page)
+            goto failed;
+        pool_pages[i] = page;
+        if (gen_pool_add_virt(pool, (unsigned long)page_address(page), page_to_phys(page),
+                              PAGE_SIZE << KNACS_DMA_MAX_ORDER, -1) < 0)
+            goto failed;
+    }
+    return pool;
+
+failed:
+    bench_pool_destroy(pool);
+    return NULL;
+}
+
+// Returns the total time in ns or 0 if any allocation failed.
+static u64 bench_cache(size_t sz, unsigned int iters)
+{
+    struct knacs_dma_block *blocks[BENCH_DEPTH];
+    bool failed = false;
+    u64 t0 = ktime_get_ns();
+    for (unsigned int i = 0; i < iters; i++) {
+        for (unsigned int j = 0; j < BENCH_DEPTH; j++)
+            blocks[j] = knacs_dma_block_alloc(sz, BENCH_OWNER, false, false);
+        for (unsigned int j = 0; j < BENCH_DEPTH; j++) {
+            if (blocks[j])
+                knacs_dma_block_free(blocks[j]);
+            else
+                failed = true;
+        }
+    }
+    return failed ? 0 : ktime_get_ns() - t0;
+}
+
+static u64 bench_pool(struct gen_pool *pool, size_t sz, unsigned int iters)
+{
+    void *bufs[BENCH_DEPTH];
+    bool failed = false;
+    u64 t0 = ktime_get_ns();
+    for (unsigned int i = 0; i < iters; i++) {
+        for (unsigned int j = 0; j < BENCH_DEPTH; j++) {
+            dma_addr_t dma_addr;
+            bufs[j] = gen_pool_dma_alloc_align(pool, sz, &dma_addr, PAGE_SIZE);
+        }
+        for (unsigned int j = 0; j < BENCH_DEPTH; j++) {
+            if (bufs[j])
+                gen_pool_free(pool, (unsigned long)bufs[j], sz);
+            else
+                failed = true;
+        }
+    }
+    return failed ? 0 : ktime_get_ns() - t0;
+}
+
+void knacs_alloc_bench(void)
+{
+    if (!alloc_bench_iters)
+        return;
+    struct gen_pool *pool = bench_pool_create();
+    if (!pool) {
+        pr_alert("Unable to create gen_pool for benchmark\n");
+        return;
+    }
+    u64 nops = (u64)alloc_bench_iters * BENCH_DEPTH;
+    for (unsigned int i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+        size_t sz = (size_t)bench_sizes[i] << PAGE_SHIFT;
+        // Warm up the cache.
+        bench_cache(sz, 1);
+        u64 t_cache = bench_cache(sz, alloc_bench_iters);
+        cond_resched();
+        u64 t_pool = bench_pool(pool, sz, alloc_bench_iters);
+        cond_resched();
+        if (!t_cache || !t_pool) {
+            pr_alert("Allocation failed for %u pages\n", bench_sizes[i]);
+            continue;
+        }
+        pr_info("%2u pages: page cache %llu ns, gen_pool %llu ns per alloc/free\n",
+                bench_sizes[i], div64_u64(t_cache, nops), div64_u64(t_pool, nops));
+    }
+    bench_pool_destroy(pool);
+}
@@ -0,0 +1,426 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (axi-dma): " fmt
+
+/**
+ * Driver for the AXI DMA IP (PG021) in scatter-gather mode.
+ * The MM2S channel runs the write transfers submitted by the user and the (optional)
+ * S2MM channel, enabled when the second interrupt is present, fills the receive ring.
+ *
+ * We program the registers directly instead of going through the Xilinx DMA engine driver
+ * (see Design.md). Since that driver claims the standard compatible string,
+ * the device tree node for the engine used by us should use `nacs,axi-dma` instead.
+ */
+
+#include "axi_dma.h"
+
+#include "completion.h"
+#include "dma_engine.h"
+#include "dma_rx.h"
+#include "instance.h"
+
+#include <linux/bitfield.h>
+#include <linux/dma-mapping.h>
+#include <linux/interrupt.h>
+#include <linux/io.h>
+#include <linux/iopoll.h>
+#include <linux/of_platform.h>
+
+#define AXI_DMA_MM2S_DMACR 0x00
+#define AXI_DMA_MM2S_DMASR 0x04
+#define AXI_DMA_MM2S_CURDESC 0x08
+#define AXI_DMA_MM2S_CURDESC_MSB 0x0c
+#define AXI_DMA_MM2S_TAILDESC 0x10
+#define AXI_DMA_MM2S_TAILDESC_MSB 0x14
+#define AXI_DMA_S2MM_DMACR 0x30
+#define AXI_DMA_S2MM_DMASR 0x34
+#define AXI_DMA_S2MM_CURDESC 0x38
+#define AXI_DMA_S2MM_CURDESC_MSB 0x3c
+#define AXI_DMA_S2MM_TAILDESC 0x40
+#define AXI_DMA_S2MM_TAILDESC_MSB 0x44
+
+#define AXI_DMA_CR_RUNSTOP BIT(0)
+#define AXI_DMA_CR_RESET BIT(2)
+#define AXI_DMA_CR_IOC_IRQ BIT(12)
+#define AXI_DMA_CR_DLY_IRQ BIT(13)
+#define AXI_DMA_CR_ERR_IRQ BIT(14)
+#define AXI_DMA_CR_IRQ_THRESHOLD GENMASK(23, 16)
+#define AXI_DMA_CR_IRQ_DELAY GENMASK(31, 24)
+
+#define AXI_DMA_SR_HALTED BIT(0)
+#define AXI_DMA_SR_IOC_IRQ BIT(12)
+#define AXI_DMA_SR_DLY_IRQ BIT(13)
+#define AXI_DMA_SR_ERR_IRQ BIT(14)
+#define AXI_DMA_SR_IRQ_MASK (AXI_DMA_SR_IOC_IRQ | AXI_DMA_SR_DLY_IRQ | AXI_DMA_SR_ERR_IRQ)
+
+// Default width of the buffer length register
+#define AXI_DMA_DEFAULT_LEN_WIDTH 14
+
+// Interrupt coalescing for the receive channel. The delay timer (in units of
+// 125 stream clock cycles) makes sure a partially filled batch is still reported.
+#define AXI_DMA_RX_IRQ_THRESHOLD 8
+#define AXI_DMA_RX_IRQ_DELAY 16
+
+struct knacs_axi_dma {
+    struct knacs_dma_chan chan;
+    struct knacs_instance *inst;
+    void __iomem *regs;
+    int irq;
+    // Resetting either channel resets the whole core.
+    spinlock_t reset_lock;
+    struct knacs_rx_ring *rx;
+    int rx_irq;
+    // The status bits acknowledged by the interrupt handlers
+    // and not handled by the completion work yet.
+    atomic_t pending_sr;
+    atomic_t rx_pending_sr;
+    atomic64_t irq_ns; // Time of the last write channel interrupt not handled yet
+    struct kthread_work work;
+    struct kthread_work rx_work;
+};
+
+static inline u32 axi_dma_read(struct knacs_axi_dma *dma, u32 reg)
+{
+    return ioread32(dma->regs + reg);
+}
+
+static inline void axi_dma_write(struct knacs_axi_dma *dma, u32 reg, u32 val)
+{
+    iowrite32(val, dma->regs + reg);
+}
+
+static int axi_dma_reset(struct knacs_axi_dma *dma)
+{
+    axi_dma_write(dma, AXI_DMA_MM2S_DMACR, AXI_DMA_CR_RESET);
+    u32 cr;
+    return readl_poll_timeout_atomic(dma->regs + AXI_DMA_MM2S_DMACR, cr,
+                                     !(cr & AXI_DMA_CR_RESET), 1, 1000);
+}
+
+// Reset the core after an error on either channel and restart whatever was running.
+static void axi_dma_recover(struct knacs_axi_dma *dma)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&dma->reset_lock, flags);
+    if (axi_dma_reset(dma))
+        pr_alert("Timeout resetting the DMA engine\n");
+    // The transfer running on the write channel (if any) is lost,
+    // the ones chained after it are restarted.
+    knacs_dma_chan_done(&dma->chan, false, ktime_get());
+    if (dma->rx)
+        knacs_rx_ring_start(dma->rx);
+    spin_unlock_irqrestore(&dma->reset_lock, flags);
+}
+
+static void axi_dma_start(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer)
+{
+    struct knacs_axi_dma *dma = container_of(chan, struct knacs_axi_dma, chan);
+    dma_addr_t head = xfer->desc_addrs[0];
+    dma_addr_t tail = xfer->desc_addrs[xfer->ndescs - 1];
+
+    // Make sure the descriptors are visible to the engine.
+    dma_wmb();
+    // The channel is either halted or idle here so it's safe to update the current descriptor.
+    axi_dma_write(dma, AXI_DMA_MM2S_CURDESC_MSB, upper_32_bits(head));
+    axi_dma_write(dma, AXI_DMA_MM2S_CURDESC, lower_32_bits(head));
+    // We only set EOF on the last descriptor of the transfer so one interrupt per transfer.
+    u32 cr = axi_dma_read(dma, AXI_DMA_MM2S_DMACR);
+    cr &= ~AXI_DMA_CR_IRQ_THRESHOLD;
+    cr |= FIELD_PREP(AXI_DMA_CR_IRQ_THRESHOLD, 1) | AXI_DMA_CR_IOC_IRQ |
+        AXI_DMA_CR_ERR_IRQ | AXI_DMA_CR_RUNSTOP;
+    axi_dma_write(dma, AXI_DMA_MM2S_DMACR, cr);
+    u32 sr;
+    if (readl_poll_timeout_atomic(dma->regs + AXI_DMA_MM2S_DMASR, sr,
+                                  !(sr & AXI_DMA_SR_HALTED), 1, 1000))
+        pr_alert("Timeout waiting for the channel to start\n");
+    // Writing the LSB of the tail descriptor starts the transfer.
+    axi_dma_write(dma, AXI_DMA_MM2S_TAILDESC_MSB, upper_32_bits(tail));
+    axi_dma_write(dma, AXI_DMA_MM2S_TAILDESC, lower_32_bits(tail));
+}
+
+static void axi_dma_append(struct knacs_dma_chan *chan, struct knacs_dma_xfer *prev,
+                           struct knacs_dma_xfer *xfer)
+{
+    struct knacs_axi_dma *dma = container_of(chan, struct knacs_axi_dma, chan);
+    struct knacs_axi_desc *last = prev->descs[prev->ndescs - 1];
+    dma_addr_t head = xfer->desc_addrs[0];
+    dma_addr_t tail = xfer->desc_addrs[xfer->ndescs - 1];
+
+    // The engine doesn't fetch past the tail descriptor so it's safe to relink it.
+    WRITE_ONCE(last->next_desc_msb, upper_32_bits(head));
+    WRITE_ONCE(last->next_desc, lower_32_bits(head));
+    dma_wmb();
+    // Same as the receive ring, moving the tail pointer lets the channel continue
+    // into the new chain, even if it has already gone idle at the old tail.
+    axi_dma_write(dma, AXI_DMA_MM2S_TAILDESC_MSB, upper_32_bits(tail));
+    axi_dma_write(dma, AXI_DMA_MM2S_TAILDESC, lower_32_bits(tail));
+}
+
+static const struct knacs_dma_engine_ops axi_dma_ops = {
+    .start = axi_dma_start,
+    .append = axi_dma_append,
+};
+
+static void axi_dma_rx_start(struct knacs_rx_ring *ring, u32 head, u32 end)
+{
+    struct knacs_axi_dma *dma = ring->priv;
+    dma_addr_t cur = knacs_rx_ring_desc_addr(ring, head);
+    dma_addr_t tail = knacs_rx_ring_desc_addr(ring, end - 1);
+
+    axi_dma_write(dma, AXI_DMA_S2MM_CURDESC_MSB, upper_32_bits(cur));
+    axi_dma_write(dma, AXI_DMA_S2MM_CURDESC, lower_32_bits(cur));
+    u32 cr = axi_dma_read(dma, AXI_DMA_S2MM_DMACR);
+    cr &= ~(AXI_DMA_CR_IRQ_THRESHOLD | AXI_DMA_CR_IRQ_DELAY);
+    cr |= FIELD_PREP(AXI_DMA_CR_IRQ_THRESHOLD,
+                     min_t(u32, AXI_DMA_RX_IRQ_THRESHOLD, ring->min_armed)) |
+        FIELD_PREP(AXI_DMA_CR_IRQ_DELAY, AXI_DMA_RX_IRQ_DELAY) |
+        AXI_DMA_CR_IOC_IRQ | AXI_DMA_CR_DLY_IRQ | AXI_DMA_CR_ERR_IRQ | AXI_DMA_CR_RUNSTOP;
+    axi_dma_write(dma, AXI_DMA_S2MM_DMACR, cr);
+    u32 sr;
+    if (readl_poll_timeout_atomic(dma->regs + AXI_DMA_S2MM_DMASR, sr,
+                                  !(sr & AXI_DMA_SR_HALTED), 1, 1000))
+        pr_alert("Timeout waiting for the receive channel to start\n");
+    axi_dma_write(dma, AXI_DMA_S2MM_TAILDESC_MSB, upper_32_bits(tail));
+    axi_dma_write(dma, AXI_DMA_S2MM_TAILDESC, lower_32_bits(tail));
+}
+
+static void axi_dma_rx_arm(struct knacs_rx_ring *ring, u32 end)
+{
+    struct knacs_axi_dma *dma = ring->priv;
+    dma_addr_t tail = knacs_rx_ring_desc_addr(ring, end - 1);
+    // Moving the tail pointer lets the running channel continue into the new slots.
+    axi_dma_write(dma, AXI_DMA_S2MM_TAILDESC_MSB, upper_32_bits(tail));
+    axi_dma_write(dma, AXI_DMA_S2MM_TAILDESC, lower_32_bits(tail));
+}
+
+static const struct knacs_rx_ring_ops axi_dma_rx_ops = {
+    .start = axi_dma_rx_start,
+    .arm = axi_dma_rx_arm,
+};
+
+static void axi_dma_work_func(struct kthread_work *work)
+{
+    struct knacs_axi_dma *dma = container_of(work, struct knacs_axi_dma, work);
+    // The completions of multiple chained transfers may be coalesced here.
+    // The engine core finds all the finished ones from the descriptors.
+    u32 sr = atomic_xchg(&dma->pending_sr, 0);
+    u64 irq_ns = atomic64_xchg(&dma->irq_ns, 0);
+    if (sr & AXI_DMA_SR_ERR_IRQ) {
+        pr_alert("DMA error, status 0x%x\n", sr);
+        // The engine halts on error, reset it so that the next transfer can run.
+        axi_dma_recover(dma);
+    } else if (sr & AXI_DMA_SR_IOC_IRQ) {
+        knacs_dma_chan_done(&dma->chan, true, irq_ns ? ns_to_ktime(irq_ns) : ktime_get());
+    }
+}
+
+static irqreturn_t axi_dma_irq_handler(int irq, void *data)
+{
+    struct knacs_axi_dma *dma = data;
+    u32 sr = axi_dma_read(dma, AXI_DMA_MM2S_DMASR);
+    if (!(sr & AXI_DMA_SR_IRQ_MASK))
+        return IRQ_NONE;
+    axi_dma_write(dma, AXI_DMA_MM2S_DMASR, sr & AXI_DMA_SR_IRQ_MASK);
+    atomic64_set(&dma->irq_ns, ktime_get_ns());
+    atomic_or(sr & AXI_DMA_SR_IRQ_MASK, &dma->pending_sr);
+    knacs_completion_queue(&dma->work);
+    return IRQ_HANDLED;
+}
+
+static void axi_dma_rx_work_func(struct kthread_work *work)
+{
+    struct knacs_axi_dma *dma = container_of(work, struct knacs_axi_dma, rx_work);
+    u32 sr = atomic_xchg(&dma->rx_pending_sr, 0);
+    // Collect whatever has been received before the error as well.
+    knacs_rx_ring_process(dma->rx);
+    if (sr & AXI_DMA_SR_ERR_IRQ) {
+        pr_alert("DMA receive error, status 0x%x\n", sr);
+        axi_dma_recover(dma);
+    }
+}
+
+static irqreturn_t axi_dma_rx_irq_handler(int irq, void *data)
+{
+    struct knacs_axi_dma *dma = data;
+    u32 sr = axi_dma_read(dma, AXI_DMA_S2MM_DMASR);
+    if (!(sr & AXI_DMA_SR_IRQ_MASK))
+        return IRQ_NONE;
+    axi_dma_write(dma, AXI_DMA_S2MM_DMASR, sr & AXI_DMA_SR_IRQ_MASK);
+    atomic_or(sr & AXI_DMA_SR_IRQ_MASK, &dma->rx_pending_sr);
+    knacs_completion_queue(&dma->rx_work);
+    return IRQ_HANDLED;
+}
+
+static int axi_dma_rx_init(struct knacs_axi_dma *dma, struct device *dev, u32 max_seg_len)
+{
+    dma->rx = knacs_rx_ring_create(dev, &axi_dma_rx_ops, max_seg_len, DMA_FROM_DEVICE);
+    if (IS_ERR(dma->rx)) {
+        int err = PTR_ERR(dma->rx);
+        dma->rx = NULL;
+        return err;
+    }
+    dma->rx->priv = dma;
+    int err = devm_request_irq(dev, dma->rx_irq, axi_dma_rx_irq_handler, 0,
+                               "knacs-axi-dma-rx", dma);
+    if (err) {
+        pr_alert("Failed to request IRQ %d\n", dma->rx_irq);
+        goto failed;
+    }
+    if ((err = knacs_rx_register(dma->inst, dma->rx))) {
+        devm_free_irq(dev, dma->rx_irq, dma);
+        knacs_completion_cancel(&dma->rx_work);
+        goto failed;
+    }
+    knacs_completion_add_irq(dma->rx_irq);
+    knacs_rx_ring_start(dma->rx);
+    return 0;
+
+failed:
+    knacs_rx_ring_put(dma->rx);
+    dma->rx = NULL;
+    return err;
+}
+
+static int knacs_axi_dma_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    struct knacs_axi_dma *dma = devm_kzalloc(dev, sizeof(struct knacs_axi_dma), GFP_KERNEL);
+    if (!dma)
+        return -ENOMEM;
+    dma->inst = knacs_instance_of(dev);
+    if (!dma->inst)
+        return -EINVAL;
+
+    dma->regs = devm_platform_ioremap_resource(pdev, 0);
+    if (IS_ERR(dma->regs)) {
+        pr_alert("Failed to map DMA registers\n");
+        return PTR_ERR(dma->regs);
+    }
+    dma->irq = platform_get_irq(pdev, 0);
+    if (dma->irq < 0)
+        return dma->irq;
+    // The receive channel is optional.
+    dma->rx_irq = platform_get_irq_optional(pdev, 1);
+    if (dma->rx_irq == -EPROBE_DEFER)
+        return dma->rx_irq;
+    spin_lock_init(&dma->reset_lock);
+    atomic_set(&dma->pending_sr, 0);
+    atomic_set(&dma->rx_pending_sr, 0);
+    atomic64_set(&dma->irq_ns, 0);
+    kthread_init_work(&dma->work, axi_dma_work_func);
+    kthread_init_work(&dma->rx_work, axi_dma_rx_work_func);
+
+    u32 len_width = AXI_DMA_DEFAULT_LEN_WIDTH;
+    of_property_read_u32(dev->of_node, "xlnx,sg-length-width", &len_width);
+    if (len_width < 8 || len_width > 26) {
+        pr_alert("Invalid buffer length width %u\n", len_width);
+        return -EINVAL;
+    }
+
+    int err = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    if (err)
+        return err;
+    if ((err = axi_dma_reset(dma))) {
+        pr_alert("Failed to reset DMA channel\n");
+        return err;
+    }
+
+    // Keep each segment aligned so that the next one starts on an aligned address.
+    u32 max_seg_len = round_down((1u << len_width) - 1, 64);
+    if ((err = knacs_dma_chan_init(&dma->chan, dev, &axi_dma_ops, max_seg_len)))
+        return err;
+    err = devm_request_irq(dev, dma->irq, axi_dma_irq_handler, 0, "knacs-axi-dma", dma);
+    if (err) {
+        pr_alert("Failed to request IRQ %d\n", dma->irq);
+        goto failed;
+    }
+    if ((err = knacs_dma_register(dma->inst, &dma->chan)))
+        goto free_irq;
+    if (dma->rx_irq > 0 && (err = axi_dma_rx_init(dma, dev, max_seg_len))) {
+        knacs_dma_unregister(dma->inst, &dma->chan);
+        axi_dma_reset(dma);
+        goto free_irq;
+    }
+    knacs_completion_add_irq(dma->irq);
+    platform_set_drvdata(pdev, dma);
+
+    pr_info("AXI DMA probe (instance %u)\n", dma->inst->idx);
+    pr_info("    max segment length %u\n", max_seg_len);
+    pr_info("    receive channel %s\n", dma->rx ? "enabled" : "disabled");
+    return 0;
+
+free_irq:
+    devm_free_irq(dev, dma->irq, dma);
+    knacs_completion_cancel(&dma->work);
+failed:
+    knacs_dma_chan_destroy(&dma->chan);
+    return err;
+}
+
+static int knacs_axi_dma_remove(struct platform_device *pdev)
+{
+    struct knacs_axi_dma *dma = platform_get_drvdata(pdev);
+    knacs_dma_unregister(dma->inst, &dma->chan);
+    if (dma->rx)
+        knacs_rx_unregister(dma->inst, dma->rx);
+    axi_dma_reset(dma);
+    knacs_completion_remove_irq(dma->irq);
+    devm_free_irq(&pdev->dev, dma->irq, dma);
+    if (dma->rx) {
+        knacs_completion_remove_irq(dma->rx_irq);
+        devm_free_irq(&pdev->dev, dma->rx_irq, dma);
+    }
+    knacs_completion_cancel(&dma->work);
+    knacs_completion_cancel(&dma->rx_work);
+    knacs_dma_chan_destroy(&dma->chan);
+    if (dma->rx) {
+        // The pages may still be mapped by the user.
+        knacs_rx_ring_put(dma->rx);
+    }
+    return 0;
+}
+
+static const struct of_device_id knacs_axi_dma_of_ids[] = {
+    { .compatible = "nacs,axi-dma",},
+    {}
+};
+
+static struct platform_driver knacs_axi_dma_driver = {
+    .driver = {
+        .name = "knacs_axi_dma",
+        .owner = THIS_MODULE,
+        .of_match_table = knacs_axi_dma_of_ids,
+    },
+    .probe = knacs_axi_dma_probe,
+    .remove = knacs_axi_dma_remove,
+};
+
+int __init knacs_axi_dma_init(void)
+{
+    int err = platform_driver_register(&knacs_axi_dma_driver);
+    if (err)
+        pr_alert("Failed to register AXI DMA driver\n");
+    return err;
+}
+
+void knacs_axi_dma_exit(void)
+{
+    platform_driver_unregister(&knacs_axi_dma_driver);
+}
@@ -21,14 +21,50 @@
 
 #include "buff_alloc.h"
 
+#include "dma_engine.h"
+#include "dma_page.h"
+#include "dma_pin.h"
+#include "knacs.h"
+#include "knacs_trace.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
 
-struct vm_buf {
-    struct gen_pool *pool;
-    void *virt_addr;
-    size_t sz;
-    refcount_t refcnt;
-};
+// The handles with `KNACS_ALLOC_MIGRATE` that aren't in their preferred pool yet.
+// These are retried whenever some memory is freed back to a pool.
+static LIST_HEAD(buff_migrate_list);
+static DEFINE_MUTEX(buff_migrate_lock);
+static unsigned long buff_migrate_gen = 0;
+static void buff_migrate_work_func(struct work_struct*);
+static DECLARE_WORK(buff_migrate_work, buff_migrate_work_func);
+
+static void vm_buf_put(struct vm_buf *vm_buf)
+{
+    // Release the chain of parents of a grown buffer in a loop instead of recursively.
+    while (vm_buf && refcount_dec_and_test(&vm_buf->refcnt)) {
+        struct vm_buf *parent = vm_buf->parent;
+        trace_knacs_buff_free(vm_buf->sz, vm_buf->segs[0].dma_addr);
+        if (vm_buf->pool) {
+            gen_pool_free(vm_buf->pool, (unsigned long)vm_buf->segs[0].virt_addr, vm_buf->sz);
+            if (!list_empty(&buff_migrate_list))
+                schedule_work(&buff_migrate_work);
+        }
+        if (vm_buf->block)
+            knacs_dma_block_free(vm_buf->block);
+        if (vm_buf->pin)
+            knacs_dma_pin_release(vm_buf->pin);
+        kfree(vm_buf);
+        vm_buf = parent;
+    }
+}
 
 // Open and close implementation borrowed from `drivers/char/mspec.c`
 static void buff_vm_open(struct vm_area_struct *vma)
@@ -39,12 +75,8 @@ static void buff_vm_open(struct vm_area_struct *vma)
 
 static void buff_vm_close(struct vm_area_struct *vma)
 {
-    struct vm_buf *vm_buf = vma->vm_private_data;
-    if (!refcount_dec_and_test(&vm_buf->refcnt))
-        return;
-
-    gen_pool_free(vm_buf->pool, (unsigned long)vm_buf->virt_addr, vm_buf->sz);
-    kfree(vm_buf);
+    trace_knacs_buff_unmap(vma->vm_start, vma->vm_end, vma->vm_pgoff);
+    vm_buf_put(vma->vm_private_data);
 }
 
 static const struct vm_operations_struct buff_vm_ops = {
@@ -52,51 +84,685 @@ static const struct vm_operations_struct buff_vm_ops = {
     .close = buff_vm_close,
 };
 
-int knacs_buff_alloc_mmap(struct gen_pool *pool, struct vm_area_struct *vma, const char *name)
-{
-    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
-        return -EINVAL;
-
-    unsigned long sz = vma->vm_end - vma->vm_start;
-    if (sz == 0)
-        return -EINVAL;
+// For the mappings of the exported buffers (through the dma-buf),
+// which always start at page offset 0.
+static const struct vm_operations_struct buff_export_vm_ops = {
+    .open = buff_vm_open,
+    .close = buff_vm_close,
+};
 
+// Allocate a buffer of `size` bytes from `pool` in a single piece.
+static struct vm_buf *vm_buf_pool_alloc(struct gen_pool *pool, size_t size, const char *name)
+{
     // Allocation logic modified from `arch/arm/mach-zynq/pm.c`
-    dma_addr_t dma_addr = 0;
-    void *virt_addr = gen_pool_dma_alloc_align(pool, sz, &dma_addr, PAGE_SIZE);
+    void *virt_addr = (void*)knacs_gen_pool_alloc(pool, size, PAGE_SIZE);
     if (!virt_addr) {
         pr_debug("Unable to allocate %s buffer\n", name);
-        return -ENOMEM;
+        return NULL;
     }
+    dma_addr_t dma_addr = gen_pool_virt_to_phys(pool, (unsigned long)virt_addr);
 
-    int ret = -ENOMEM;
     if (dma_addr == (dma_addr_t)-1) {
         pr_alert("Unable to find physical address of %s buffer\n", name);
         goto failed;
     }
 
-    struct vm_buf *vm_buf = kzalloc(sizeof(struct vm_buf), GFP_KERNEL);
+    struct vm_buf *vm_buf = kzalloc(struct_size(vm_buf, segs, 1), GFP_KERNEL);
     if (!vm_buf) {
         pr_alert("kalloc failed for vm_buf\n");
         goto failed;
     }
+    vm_buf->sz = size;
+    refcount_set(&vm_buf->refcnt, 1);
+    vm_buf->nsegs = 1;
     vm_buf->pool = pool;
-    vm_buf->virt_addr = virt_addr;
-    vm_buf->sz = sz;
+    // The pool is shared with other users so we don't know if the memory is clean.
+    // This is the on-chip memory and is small anyway.
+    memset(virt_addr, 0, size);
+    vm_buf->segs[0].virt_addr = virt_addr;
+    vm_buf->segs[0].dma_addr = dma_addr;
+    vm_buf->segs[0].len = size;
+    return vm_buf;
+
+failed:
+    gen_pool_free(pool, (unsigned long)virt_addr, size);
+    return NULL;
+}
+
+// Allocate a buffer of `size` bytes from the DMA page cache.
+// If `parent` is not `NULL`, the new buffer starts with the memory of `parent`
+// (and holds a reference to it) and only the rest of the memory is allocated.
+// `KNACS_ALLOC_HUGE` in `flags` is only used for the handle based buffers
+// that are mapped on fault.
+static struct vm_buf *vm_buf_block_alloc(size_t size, u64 owner, u32 flags,
+                                         struct vm_buf *parent)
+{
+    bool huge = IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) && (flags & KNACS_ALLOC_HUGE);
+    size_t base = parent ? parent->sz : 0;
+    unsigned int base_nsegs = parent ? parent->nsegs : 0;
+    struct knacs_dma_block *block = knacs_dma_block_alloc(size - base, owner,
+                                                          !(flags & KNACS_ALLOC_NO_ZERO), huge);
+    if (!block)
+        return NULL;
+    struct vm_buf *vm_buf = kzalloc(struct_size(vm_buf, segs, base_nsegs + block->npages),
+                                    GFP_KERNEL);
+    if (!vm_buf) {
+        pr_alert("kalloc failed for vm_buf\n");
+        knacs_dma_block_free(block);
+        return NULL;
+    }
+    vm_buf->sz = size;
     refcount_set(&vm_buf->refcnt, 1);
+    vm_buf->nsegs = base_nsegs + block->npages;
+    vm_buf->block = block;
+    vm_buf->cache_mode = flags & KNACS_ALLOC_CACHE_MASK;
+    if (parent) {
+        memcpy(vm_buf->segs, parent->segs, base_nsegs * sizeof(struct knacs_buf_seg));
+        refcount_inc(&parent->refcnt);
+        vm_buf->parent = parent;
+    }
+    struct knacs_dma_page *dp;
+    unsigned int i = base_nsegs;
+    list_for_each_entry(dp, &block->pages, node) {
+        vm_buf->segs[i].virt_addr = dp->data;
+        vm_buf->segs[i].dma_addr = dp->dma_addr;
+        vm_buf->segs[i].len = dp->size;
+        i++;
+    }
+    return vm_buf;
+}
 
+// The memory was zeroed through the cached kernel mapping, make sure nothing is left
+// in the cache for `[offset, offset + len)` before the user bypasses it.
+static int vm_buf_flush(struct vm_buf *vm_buf, struct device *dev, size_t offset, size_t len)
+{
+    if (vm_buf->cache_mode == KNACS_ALLOC_CACHED)
+        return 0;
+    return knacs_buff_sync(vm_buf, dev, offset, len, true, DMA_BIDIRECTIONAL);
+}
+
+static void vm_buf_set_prot(struct vm_buf *vm_buf, struct vm_area_struct *vma)
+{
+    if (vm_buf->cache_mode == KNACS_ALLOC_WRITECOMBINE) {
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    } else if (vm_buf->cache_mode == KNACS_ALLOC_UNCACHED) {
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    }
+}
+
+// Map the part of the buffer starting at `offset` to the whole `vma`.
+static int vm_buf_remap(struct vm_buf *vm_buf, struct vm_area_struct *vma, size_t offset)
+{
     // mapping implementation borrowed from `drivers/char/mem.c`
+    unsigned long addr = vma->vm_start;
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < vm_buf->nsegs && addr < vma->vm_end;
+         seg_start += vm_buf->segs[i].len, i++) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        if (offset >= seg_start + seg->len)
+            continue;
+        size_t skip = offset > seg_start ? offset - seg_start : 0;
+        size_t len = min_t(size_t, seg->len - skip, vma->vm_end - addr);
+        int ret = remap_pfn_range(vma, addr, (seg->dma_addr + skip) >> PAGE_SHIFT,
+                                  len, vma->vm_page_prot);
+        if (ret)
+            return ret;
+        addr += len;
+    }
+    return 0;
+}
+
+// Map the buffer to the user. Takes over the reference to `vm_buf`,
+// which is released if the mapping fails. `t0` is the time the allocation started.
+// `dev` is used to flush the cache for non-cached buffers.
+static int vm_buf_map(struct vm_buf *vm_buf, struct vm_area_struct *vma, const char *name,
+                      struct device *dev, u64 t0)
+{
+    int ret = vm_buf_flush(vm_buf, dev, 0, vm_buf->sz);
+    if (ret) {
+        vm_buf_put(vm_buf);
+        return ret;
+    }
+    vm_buf_set_prot(vm_buf, vma);
+    if ((ret = vm_buf_remap(vm_buf, vma, 0))) {
+        // The close callback won't be called if the mmap fails.
+        vm_buf_put(vm_buf);
+        return ret;
+    }
     vma->vm_private_data = vm_buf;
     vma->vm_ops = &buff_vm_ops;
-    memset(virt_addr, 0, sz);
+    trace_knacs_buff_map(vma->vm_start, vma->vm_end, vma->vm_pgoff);
+    trace_knacs_buff_alloc(name, vm_buf->sz, vm_buf->nsegs, vm_buf->segs[0].dma_addr,
+                           ktime_get_ns() - t0);
+
+    pr_debug("Allocated %s buffer of size %lu in %u segments @ 0x%lx\n",
+             name, (unsigned long)vm_buf->sz, vm_buf->nsegs,
+             (unsigned long)vm_buf->segs[0].dma_addr);
+    return 0;
+}
 
-    pr_debug("Allocated %s buffer of size %lu @ 0x%lx\n",
-             name, (unsigned long)sz, (unsigned long)dma_addr);
+int knacs_buff_alloc_mmap(struct gen_pool *pool, struct vm_area_struct *vma, const char *name)
+{
+    u64 t0 = ktime_get_ns();
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
 
-    return remap_pfn_range(vma, vma->vm_start, dma_addr >> PAGE_SHIFT,
-                           sz, vma->vm_page_prot);
+    unsigned long sz = vma->vm_end - vma->vm_start;
+    if (sz == 0)
+        return -EINVAL;
 
-failed:
-    gen_pool_free(pool, (unsigned long)virt_addr, sz);
+    struct vm_buf *vm_buf = vm_buf_pool_alloc(pool, sz, name);
+    if (!vm_buf)
+        return -ENOMEM;
+    vm_buf->pgoff = vma->vm_pgoff;
+    return vm_buf_map(vm_buf, vma, name, NULL, t0);
+}
+
+int knacs_buff_block_mmap(struct vm_area_struct *vma, const char *name, u64 owner, u32 flags,
+                          struct device *dev)
+{
+    u64 t0 = ktime_get_ns();
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+
+    unsigned long sz = vma->vm_end - vma->vm_start;
+    if (sz == 0)
+        return -EINVAL;
+
+    struct vm_buf *vm_buf = vm_buf_block_alloc(sz, owner, flags & ~KNACS_ALLOC_HUGE, NULL);
+    if (!vm_buf) {
+        pr_debug("Unable to allocate %s buffer\n", name);
+        return -ENOMEM;
+    }
+    vm_buf->pgoff = vma->vm_pgoff;
+    return vm_buf_map(vm_buf, vma, name, dev, t0);
+}
+
+struct vm_buf *knacs_buff_alloc(size_t size, u64 owner, u32 flags, struct gen_pool *pool)
+{
+    u64 t0 = ktime_get_ns();
+    if (size == 0 || !PAGE_ALIGNED(size))
+        return NULL;
+    struct vm_buf *vm_buf = pool ? vm_buf_pool_alloc(pool, size, "OCM") : NULL;
+    if (vm_buf) {
+        vm_buf->cache_mode = flags & KNACS_ALLOC_CACHE_MASK;
+    } else {
+        vm_buf = vm_buf_block_alloc(size, owner, flags & ~KNACS_ALLOC_HUGE, NULL);
+    }
+    if (!vm_buf)
+        return NULL;
+    trace_knacs_buff_alloc(vm_buf->pool ? "OCM Kernel" : "DMA Kernel", size, vm_buf->nsegs,
+                           vm_buf->segs[0].dma_addr, ktime_get_ns() - t0);
+    return vm_buf;
+}
+
+static bool vm_buf_in_pool(struct vm_buf *vm_buf, struct gen_pool *pool)
+{
+    return pool && vm_buf->pool == pool && !vm_buf->parent;
+}
+
+// Whether the memory is only used by the buffer (and the buffers grown from it).
+static bool vm_buf_exclusive(struct vm_buf *vm_buf)
+{
+    for (; vm_buf; vm_buf = vm_buf->parent)
+        if (refcount_read(&vm_buf->refcnt) != 1)
+            return false;
+    return true;
+}
+
+// Add the handle to or remove it from the migration list according to where it is now.
+// Called with the handle lock held.
+static void buff_handle_update_migrate(struct knacs_buff_handle *handle)
+{
+    bool want = (handle->flags & KNACS_ALLOC_MIGRATE) && handle->pool &&
+        !vm_buf_in_pool(handle->buf, handle->pool);
+    mutex_lock(&buff_migrate_lock);
+    if (!want) {
+        list_del_init(&handle->migrate_node);
+    } else if (list_empty(&handle->migrate_node)) {
+        list_add_tail(&handle->migrate_node, &buff_migrate_list);
+    }
+    mutex_unlock(&buff_migrate_lock);
+}
+
+struct knacs_buff_handle *knacs_buff_handle_create(size_t size, u64 owner, u32 flags,
+                                                   struct device *dev, struct gen_pool *pool,
+                                                   unsigned long pgoff)
+{
+    u64 t0 = ktime_get_ns();
+    if (size == 0 || !PAGE_ALIGNED(size))
+        return ERR_PTR(-EINVAL);
+    struct knacs_buff_handle *handle = kzalloc(sizeof(struct knacs_buff_handle), GFP_KERNEL);
+    if (!handle)
+        return ERR_PTR(-ENOMEM);
+    struct vm_buf *vm_buf = pool ? vm_buf_pool_alloc(pool, size, "OCM") : NULL;
+    if (vm_buf) {
+        vm_buf->cache_mode = flags & KNACS_ALLOC_CACHE_MASK;
+    } else {
+        vm_buf = vm_buf_block_alloc(size, owner, flags, NULL);
+    }
+    if (!vm_buf) {
+        pr_debug("Unable to allocate DMA buffer for handle\n");
+        kfree(handle);
+        return ERR_PTR(-ENOMEM);
+    }
+    vm_buf->pgoff = pgoff;
+    int ret = vm_buf_flush(vm_buf, dev, 0, size);
+    if (ret) {
+        vm_buf_put(vm_buf);
+        kfree(handle);
+        return ERR_PTR(ret);
+    }
+    refcount_set(&handle->refcnt, 1);
+    mutex_init(&handle->lock);
+    handle->buf = vm_buf;
+    handle->owner = owner;
+    handle->flags = flags;
+    handle->dev = dev;
+    handle->pgoff = pgoff;
+    handle->pool = pool;
+    INIT_LIST_HEAD(&handle->migrate_node);
+    buff_handle_update_migrate(handle);
+    trace_knacs_buff_alloc(vm_buf->pool ? "OCM Handle" : "DMA Handle", size, vm_buf->nsegs,
+                           vm_buf->segs[0].dma_addr, ktime_get_ns() - t0);
+    return handle;
+}
+
+void knacs_buff_handle_put(struct knacs_buff_handle *handle)
+{
+    if (!refcount_dec_and_test(&handle->refcnt))
+        return;
+    mutex_lock(&buff_migrate_lock);
+    list_del(&handle->migrate_node);
+    mutex_unlock(&buff_migrate_lock);
+    vm_buf_put(handle->buf);
+    mutex_destroy(&handle->lock);
+    kfree(handle);
+}
+
+int knacs_buff_handle_resize(struct knacs_buff_handle *handle, size_t size)
+{
+    if (!PAGE_ALIGNED(size))
+        return -EINVAL;
+    int ret = 0;
+    mutex_lock(&handle->lock);
+    struct vm_buf *old = handle->buf;
+    if (size < old->sz) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (size == old->sz)
+        goto out;
+    // The existing memory (and the mappings of it) are kept.
+    // The new buffer only needs to allocate the memory for the part being added.
+    struct vm_buf *vm_buf = vm_buf_block_alloc(size, handle->owner, handle->flags, old);
+    if (!vm_buf) {
+        pr_debug("Unable to grow DMA buffer\n");
+        ret = -ENOMEM;
+        goto out;
+    }
+    vm_buf->pgoff = handle->pgoff;
+    if ((ret = vm_buf_flush(vm_buf, handle->dev, old->sz, size - old->sz))) {
+        vm_buf_put(vm_buf);
+        goto out;
+    }
+    handle->buf = vm_buf;
+    // The new buffer holds its own reference to the old one.
+    vm_buf_put(old);
+    buff_handle_update_migrate(handle);
+out:
+    mutex_unlock(&handle->lock);
+    return ret;
+}
+
+bool knacs_buff_handle_in_pool(struct knacs_buff_handle *handle)
+{
+    mutex_lock(&handle->lock);
+    bool res = vm_buf_in_pool(handle->buf, handle->pool);
+    mutex_unlock(&handle->lock);
+    return res;
+}
+
+int knacs_buff_handle_migrate(struct knacs_buff_handle *handle, struct gen_pool *pool)
+{
+    if (!pool)
+        return -ENOMEM;
+    u64 t0 = ktime_get_ns();
+    int ret = 0;
+    mutex_lock(&handle->lock);
+    struct vm_buf *old = handle->buf;
+    if (vm_buf_in_pool(old, pool))
+        goto out;
+    // We can't move the memory under a transfer or a dma-buf.
+    // No new reference can be taken from the user mappings while we hold the lock.
+    if (!vm_buf_exclusive(old)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    struct vm_buf *vm_buf = vm_buf_pool_alloc(pool, old->sz, "OCM");
+    if (!vm_buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    vm_buf->pgoff = handle->pgoff;
+    vm_buf->cache_mode = old->cache_mode;
+    // Zap the user mappings so that any access during the copy faults
+    // and waits for the lock. This also catches the mappings of the same handle number
+    // from other files on the same device, which simply fault the pages in again.
+    if (handle->mapping)
+        unmap_mapping_range(handle->mapping, (loff_t)handle->pgoff << PAGE_SHIFT, old->sz, 1);
+    // Drop anything the kernel mapping may have cached for the memory written
+    // through the non-cached user mappings.
+    if (old->cache_mode != KNACS_ALLOC_CACHED &&
+        (ret = knacs_buff_sync(old, handle->dev, 0, old->sz, false, DMA_FROM_DEVICE))) {
+        vm_buf_put(vm_buf);
+        goto out;
+    }
+    void *dst = vm_buf->segs[0].virt_addr;
+    for (unsigned int i = 0; i < old->nsegs; i++) {
+        memcpy(dst, old->segs[i].virt_addr, old->segs[i].len);
+        dst += old->segs[i].len;
+    }
+    handle->buf = vm_buf;
+    vm_buf_put(old);
+    trace_knacs_buff_alloc("OCM Migrate", vm_buf->sz, vm_buf->nsegs, vm_buf->segs[0].dma_addr,
+                           ktime_get_ns() - t0);
+    pr_debug("Migrated buffer of size %lu @ 0x%lx\n", (unsigned long)vm_buf->sz,
+             (unsigned long)vm_buf->segs[0].dma_addr);
+out:
+    if (pool == handle->pool)
+        buff_handle_update_migrate(handle);
+    mutex_unlock(&handle->lock);
+    return ret;
+}
+
+// Try to migrate each of the buffers on the list once.
+static void buff_migrate_work_func(struct work_struct *work)
+{
+    // The work doesn't run concurrently with itself.
+    unsigned long gen = ++buff_migrate_gen;
+    while (true) {
+        struct knacs_buff_handle *handle = NULL, *iter;
+        mutex_lock(&buff_migrate_lock);
+        list_for_each_entry(iter, &buff_migrate_list, migrate_node) {
+            if (iter->migrate_gen == gen)
+                continue;
+            iter->migrate_gen = gen;
+            // The handle may be in the process of being freed.
+            if (refcount_inc_not_zero(&iter->refcnt)) {
+                handle = iter;
+                break;
+            }
+        }
+        mutex_unlock(&buff_migrate_lock);
+        if (!handle)
+            break;
+        knacs_buff_handle_migrate(handle, handle->pool);
+        knacs_buff_handle_put(handle);
+    }
+}
+
+void knacs_buff_alloc_exit(void)
+{
+    cancel_work_sync(&buff_migrate_work);
+}
+
+static void buff_handle_vm_open(struct vm_area_struct *vma)
+{
+    struct knacs_buff_handle *handle = vma->vm_private_data;
+    refcount_inc(&handle->refcnt);
+}
+
+static void buff_handle_vm_close(struct vm_area_struct *vma)
+{
+    trace_knacs_buff_unmap(vma->vm_start, vma->vm_end, vma->vm_pgoff);
+    knacs_buff_handle_put(vma->vm_private_data);
+}
+
+// The pages are inserted on fault since the mapping may be grown with `mremap`,
+// which isn't allowed for `VM_PFNMAP` mappings created with `remap_pfn_range`.
+static vm_fault_t buff_handle_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct knacs_buff_handle *handle = vma->vm_private_data;
+    size_t offset = (vmf->pgoff - handle->pgoff) << PAGE_SHIFT;
+    unsigned long pfn = 0;
+    bool found = false;
+    // The lock is held until the page is inserted. A migration (which frees the old memory)
+    // then either zaps our PTE after we're done or finishes before we look up the buffer.
+    mutex_lock(&handle->lock);
+    struct vm_buf *vm_buf = handle->buf;
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < vm_buf->nsegs; seg_start += vm_buf->segs[i].len, i++) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        if (offset < seg_start + seg->len) {
+            pfn = PHYS_PFN(seg->dma_addr + (offset - seg_start));
+            found = true;
+            break;
+        }
+    }
+    vm_fault_t ret;
+    // Outside of the buffer, e.g. a mapping grown with `mremap` before the buffer.
+    if (!found) {
+        ret = VM_FAULT_SIGBUS;
+    } else {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+        ret = vmf_insert_mixed(vma, vmf->address, pfn_to_pfn_t(pfn));
+#else
+        ret = vmf_insert_mixed(vma, vmf->address, pfn);
+#endif
+    }
+    mutex_unlock(&handle->lock);
     return ret;
 }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+// Map a whole PMD if it's fully covered by a PMD aligned chunk of the buffer.
+static vm_fault_t buff_handle_vm_huge_fault_pmd(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct knacs_buff_handle *handle = vma->vm_private_data;
+    unsigned long addr = vmf->address & PMD_MASK;
+    if (!(handle->flags & KNACS_ALLOC_HUGE) || addr < vma->vm_start ||
+        addr + PMD_SIZE > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    size_t offset = ((vmf->pgoff - handle->pgoff) << PAGE_SHIFT) - (vmf->address - addr);
+    if (offset & ~PMD_MASK)
+        return VM_FAULT_FALLBACK;
+    unsigned long pfn = 0;
+    bool found = false;
+    // Held until the PMD is inserted, see `buff_handle_vm_fault`.
+    mutex_lock(&handle->lock);
+    struct vm_buf *vm_buf = handle->buf;
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < vm_buf->nsegs; seg_start += vm_buf->segs[i].len, i++) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        if (offset >= seg_start + seg->len)
+            continue;
+        phys_addr_t phys = seg->dma_addr + (offset - seg_start);
+        found = offset + PMD_SIZE <= seg_start + seg->len && !(phys & ~PMD_MASK);
+        pfn = PHYS_PFN(phys);
+        break;
+    }
+    vm_fault_t ret;
+    if (!found) {
+        ret = VM_FAULT_FALLBACK;
+    } else {
+        bool write = vmf->flags & FAULT_FLAG_WRITE;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+        ret = vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), write);
+#else
+        ret = vmf_insert_pfn_pmd(vmf, pfn, write);
+#endif
+    }
+    mutex_unlock(&handle->lock);
+    return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+static vm_fault_t buff_handle_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+    if (pe_size != PE_SIZE_PMD)
+        return VM_FAULT_FALLBACK;
+    return buff_handle_vm_huge_fault_pmd(vmf);
+}
+#else
+static vm_fault_t buff_handle_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    if (order != PMD_SHIFT - PAGE_SHIFT)
+        return VM_FAULT_FALLBACK;
+    return buff_handle_vm_huge_fault_pmd(vmf);
+}
+#endif
+#endif
+
+static const struct vm_operations_struct buff_handle_vm_ops = {
+    .open = buff_handle_vm_open,
+    .close = buff_handle_vm_close,
+    .fault = buff_handle_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = buff_handle_vm_huge_fault,
+#endif
+};
+
+int knacs_buff_handle_mmap(struct knacs_buff_handle *handle, struct vm_area_struct *vma)
+{
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+    if (vma->vm_pgoff < handle->pgoff)
+        return -EINVAL;
+    size_t offset = (vma->vm_pgoff - handle->pgoff) << PAGE_SHIFT;
+    mutex_lock(&handle->lock);
+    size_t sz = handle->buf->sz;
+    vm_buf_set_prot(handle->buf, vma);
+    handle->mapping = vma->vm_file->f_mapping;
+    mutex_unlock(&handle->lock);
+    if (offset >= sz || vma->vm_end - vma->vm_start > sz - offset)
+        return -EINVAL;
+
+    vm_flags_t flags = VM_MIXEDMAP | VM_DONTDUMP;
+    // Some kernels only try the huge fault with this set when THP is in `madvise` mode.
+    if (handle->flags & KNACS_ALLOC_HUGE)
+        flags |= VM_HUGEPAGE;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+    vma->vm_flags |= flags;
+#else
+    vm_flags_set(vma, flags);
+#endif
+    refcount_inc(&handle->refcnt);
+    vma->vm_private_data = handle;
+    vma->vm_ops = &buff_handle_vm_ops;
+    trace_knacs_buff_map(vma->vm_start, vma->vm_end, vma->vm_pgoff);
+    return 0;
+}
+
+int knacs_buff_export_mmap(struct vm_buf *vm_buf, struct vm_area_struct *vma)
+{
+    size_t offset = vma->vm_pgoff << PAGE_SHIFT;
+    if (offset >= vm_buf->sz || vma->vm_end - vma->vm_start > vm_buf->sz - offset)
+        return -EINVAL;
+    vm_buf_set_prot(vm_buf, vma);
+    int ret = vm_buf_remap(vm_buf, vma, offset);
+    if (ret)
+        return ret;
+    refcount_inc(&vm_buf->refcnt);
+    vma->vm_private_data = vm_buf;
+    vma->vm_ops = &buff_export_vm_ops;
+    trace_knacs_buff_map(vma->vm_start, vma->vm_end, vma->vm_pgoff);
+    return 0;
+}
+
+// Get the buffer currently mapped by `vma` with a reference.
+// `pgoff` is set to the page offset of the start of the buffer in the mapping.
+static struct vm_buf *vma_get_buf(struct vm_area_struct *vma, unsigned long *pgoff)
+{
+    if (vma->vm_ops == &buff_export_vm_ops) {
+        struct vm_buf *vm_buf = vma->vm_private_data;
+        refcount_inc(&vm_buf->refcnt);
+        *pgoff = 0;
+        return vm_buf;
+    }
+    if (vma->vm_ops == &buff_vm_ops) {
+        struct vm_buf *vm_buf = vma->vm_private_data;
+        refcount_inc(&vm_buf->refcnt);
+        *pgoff = vm_buf->pgoff;
+        return vm_buf;
+    }
+    if (vma->vm_ops == &buff_handle_vm_ops) {
+        struct knacs_buff_handle *handle = vma->vm_private_data;
+        mutex_lock(&handle->lock);
+        struct vm_buf *vm_buf = handle->buf;
+        refcount_inc(&vm_buf->refcnt);
+        mutex_unlock(&handle->lock);
+        *pgoff = handle->pgoff;
+        return vm_buf;
+    }
+    return NULL;
+}
+
+struct vm_buf *knacs_buff_get(unsigned long addr, size_t len, size_t *offset)
+{
+    if (len == 0 || addr + len < addr)
+        return ERR_PTR(-EINVAL);
+
+    struct mm_struct *mm = current->mm;
+    struct vm_buf *vm_buf = ERR_PTR(-EFAULT);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+    down_read(&mm->mmap_sem);
+#else
+    mmap_read_lock(mm);
+#endif
+    struct vm_area_struct *vma = find_vma(mm, addr);
+    if (!vma || vma->vm_start > addr)
+        goto out;
+    unsigned long pgoff;
+    struct vm_buf *buf = vma_get_buf(vma, &pgoff);
+    if (!buf)
+        goto out;
+    size_t buf_offset = ((vma->vm_pgoff - pgoff) << PAGE_SHIFT) + (addr - vma->vm_start);
+    // We don't allow the range to cross VMAs even if they are for the same buffer.
+    if (addr + len > vma->vm_end || buf_offset + len > buf->sz) {
+        vm_buf_put(buf);
+        vm_buf = ERR_PTR(-EINVAL);
+        goto out;
+    }
+    *offset = buf_offset;
+    vm_buf = buf;
+out:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+    up_read(&mm->mmap_sem);
+#else
+    mmap_read_unlock(mm);
+#endif
+    return vm_buf;
+}
+
+void knacs_buff_put(struct vm_buf *vm_buf)
+{
+    vm_buf_put(vm_buf);
+}
+
+int knacs_buff_sync(struct vm_buf *vm_buf, struct device *dev, size_t offset,
+                    size_t len, bool for_device, enum dma_data_direction dir)
+{
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < vm_buf->nsegs; seg_start += vm_buf->segs[i].len, i++) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        size_t start = max(seg_start, offset);
+        size_t end = min(seg_start + seg->len, offset + len);
+        if (end <= start)
+            continue;
+        dma_addr_t addr = seg->dma_addr + (start - seg_start);
+        // The OCM doesn't have `struct page` backing it and can't be synced this way.
+        if (!pfn_valid(PHYS_PFN(addr)))
+            continue;
+        if (!dev)
+            return -ENODEV;
+        if (for_device) {
+            dma_sync_single_for_device(dev, addr, end - start, dir);
+        } else {
+            dma_sync_single_for_cpu(dev, addr, end - start, dir);
+        }
+    }
+    return 0;
+}
@@ -20,9 +20,121 @@
 #ifndef __KNACS_BUFF_ALLOC_H__
 #define __KNACS_BUFF_ALLOC_H__
 
+#include <linux/dma-direction.h>
+#include <linux/fs.h>
 #include <linux/genalloc.h>
+#include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+
+struct knacs_dma_block;
+struct knacs_user_pin;
+
+// A physically contiguous piece of a buffer.
+struct knacs_buf_seg {
+    void *virt_addr;
+    dma_addr_t dma_addr;
+    size_t len;
+};
+
+struct vm_buf {
+    // Where the memory comes from, exactly one of these is set.
+    struct gen_pool *pool;
+    struct knacs_dma_block *block;
+    struct knacs_user_pin *pin; // Pinned user pages, see `dma_pin.c`
+    // For a buffer that was grown, the buffer before growing, which holds the memory
+    // of the leading segments. `block` only holds the memory that was added.
+    struct vm_buf *parent;
+    size_t sz;
+    // The page offset of the original mapping.
+    // Used to compute the offset in the buffer of a (possibly split) VMA.
+    unsigned long pgoff;
+    refcount_t refcnt;
+    // `KNACS_ALLOC_CACHED`, `KNACS_ALLOC_WRITECOMBINE` or `KNACS_ALLOC_UNCACHED`
+    u32 cache_mode;
+    unsigned int nsegs;
+    struct knacs_buf_seg segs[];
+};
 
 int knacs_buff_alloc_mmap(struct gen_pool*, struct vm_area_struct*, const char *name);
+// `flags` are the `KNACS_ALLOC_*` flags. The buffer may contain data from
+// a previous buffer of the same `owner` if `KNACS_ALLOC_NO_ZERO` is set
+// (see `knacs_dma_block_alloc`). `dev` is the device to flush the cache with
+// for the non-cached modes.
+int knacs_buff_block_mmap(struct vm_area_struct*, const char *name, u64 owner, u32 flags,
+                          struct device *dev);
+
+// Allocate a buffer that is only used by the kernel (not mapped to the user).
+// The buffer is allocated from `pool` if it's not `NULL` and there is space,
+// and from the DMA pages otherwise. `flags` are the same as for `knacs_buff_block_mmap`.
+// Returns `NULL` if there isn't enough memory.
+struct vm_buf *knacs_buff_alloc(size_t size, u64 owner, u32 flags, struct gen_pool *pool);
+
+// Find the buffer mapped at `[addr, addr + len)` in the current process and
+// take a reference to it. The buffer will stay alive even if it is unmapped
+// by the user until the reference is released with `knacs_buff_put`.
+// `offset` is set to the offset of `addr` in the buffer.
+struct vm_buf *knacs_buff_get(unsigned long addr, size_t len, size_t *offset);
+// Take another reference to a buffer already referenced by the caller.
+static inline struct vm_buf *knacs_buff_ref(struct vm_buf *vm_buf)
+{
+    refcount_inc(&vm_buf->refcnt);
+    return vm_buf;
+}
+// Safe to be called from interrupt context.
+void knacs_buff_put(struct vm_buf *vm_buf);
+// Map the buffer for the dma-buf it's exported as, with the page offset
+// relative to the start of the buffer. The mapping holds a new reference.
+// The mapping is recognized by `knacs_buff_get` as well.
+int knacs_buff_export_mmap(struct vm_buf *vm_buf, struct vm_area_struct *vma);
+// Sync `[offset, offset + len)` of the buffer in the given direction,
+// regardless of the cache mode. Returns `-ENODEV` if `dev` is `NULL`
+// and there's something to sync.
+int knacs_buff_sync(struct vm_buf *vm_buf, struct device *dev, size_t offset,
+                    size_t len, bool for_device, enum dma_data_direction dir);
+
+// A DMA buffer that can be named by a handle and grown.
+struct knacs_buff_handle {
+    refcount_t refcnt; // From the handle table and the mappings
+    struct mutex lock;
+    struct vm_buf *buf; // The current memory, replaced when the buffer grows
+    u64 owner;
+    u32 flags;
+    struct device *dev;
+    // The page offset of the start of the buffer in the mappings.
+    unsigned long pgoff;
+    // The pool (i.e. the OCM) to place the buffer in when possible,
+    // `NULL` to only use the DMA pages.
+    struct gen_pool *pool;
+    // The file mapping the buffer is mapped through, `NULL` if it was never mapped.
+    // Used to unmap the pages when the buffer is migrated.
+    struct address_space *mapping;
+    // For the list of buffers to migrate to `pool` when there is space (`KNACS_ALLOC_MIGRATE`).
+    struct list_head migrate_node;
+    unsigned long migrate_gen;
+};
+
+// `flags` and `dev` are the same as for `knacs_buff_block_mmap`.
+// The buffer is allocated from `pool` if it's not `NULL` and there is space,
+// and from the DMA pages otherwise.
+struct knacs_buff_handle *knacs_buff_handle_create(size_t size, u64 owner, u32 flags,
+                                                   struct device *dev, struct gen_pool *pool,
+                                                   unsigned long pgoff);
+void knacs_buff_handle_put(struct knacs_buff_handle*);
+// Grow the buffer to `size`, the existing memory is kept in place.
+int knacs_buff_handle_resize(struct knacs_buff_handle*, size_t size);
+// Whether all the memory of the buffer is from `handle->pool`.
+bool knacs_buff_handle_in_pool(struct knacs_buff_handle*);
+// Move the content of the buffer to a single piece of memory from `pool`.
+// The mappings are kept and faulted in again. Fails with `-EBUSY` if the memory
+// is referenced by anything other than the handle (e.g. a transfer or a dma-buf)
+// and `-ENOMEM` if there isn't enough space in the pool.
+int knacs_buff_handle_migrate(struct knacs_buff_handle*, struct gen_pool *pool);
+// Wait for the pending automatic migrations, called when unloading the module.
+void knacs_buff_alloc_exit(void);
+// Map the buffer. The pages are mapped on fault so that the mapping can be grown
+// with `mremap` after the buffer is grown.
+int knacs_buff_handle_mmap(struct knacs_buff_handle*, struct vm_area_struct*);
 
 #endif
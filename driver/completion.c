@@ -0,0 +1,216 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (completion): " fmt
+
+/**
+ * The completion thread.
+ *
+ * The interrupt handlers only acknowledge the hardware and queue the rest
+ * of the work (finishing the DMA transfers, processing the receive ring,
+ * draining the result FIFO, refilling the command FIFO and posting the events)
+ * to a kthread worker owned by the driver. The CPU and the `SCHED_FIFO` priority
+ * of the thread can be changed at any time with the module parameters (also in sysfs)
+ * so that the completion latency is isolated from the rest of the system.
+ * The affinity of the interrupts is kept the same as the thread.
+ */
+
+#include "completion.h"
+
+#include "instance.h"
+
+#include <linux/cpumask.h>
+#include <linux/interrupt.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#include <uapi/linux/sched/types.h>
+
+static bool completion_thread = true;
+module_param(completion_thread, bool, 0444);
+MODULE_PARM_DESC(completion_thread, "Run the completion work in a dedicated thread instead of the interrupt handlers");
+
+static int completion_cpu = -1;
+static unsigned int completion_prio = 50;
+
+static struct kthread_worker *completion_worker = NULL;
+// Protects the worker settings and the list of interrupts.
+static DEFINE_MUTEX(completion_lock);
+// Each instance has at most the pulse controller and two DMA channel interrupts.
+static int completion_irqs[KNACS_MAX_INSTANCES * 3];
+
+static void completion_apply_irq(int irq)
+{
+    const struct cpumask *mask = completion_cpu >= 0 ? cpumask_of(completion_cpu) : NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+    int err = irq_set_affinity_hint(irq, mask);
+#else
+    // Without a CPU the affinity is left to the user (or `irqbalance`).
+    int err = mask ? irq_set_affinity_and_hint(irq, mask) : irq_update_affinity_hint(irq, NULL);
+#endif
+    if (err)
+        pr_warn("Failed to set the affinity of IRQ %d\n", irq);
+}
+
+// Called with the lock held.
+static void completion_apply(void)
+{
+    if (!completion_worker)
+        return;
+    struct task_struct *task = completion_worker->task;
+    const struct cpumask *mask = completion_cpu >= 0 ? cpumask_of(completion_cpu) :
+        cpu_possible_mask;
+    if (set_cpus_allowed_ptr(task, mask))
+        pr_warn("Failed to set the CPU of the completion thread\n");
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = completion_prio ? SCHED_FIFO : SCHED_NORMAL,
+        .sched_priority = completion_prio,
+    };
+    if (sched_setattr_nocheck(task, &attr))
+        pr_warn("Failed to set the priority of the completion thread\n");
+    for (unsigned int i = 0; i < ARRAY_SIZE(completion_irqs); i++) {
+        if (completion_irqs[i] > 0)
+            completion_apply_irq(completion_irqs[i]);
+    }
+}
+
+static int completion_cpu_set(const char *val, const struct kernel_param *kp)
+{
+    int cpu;
+    int err = kstrtoint(val, 0, &cpu);
+    if (err)
+        return err;
+    if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_possible(cpu))))
+        return -EINVAL;
+    mutex_lock(&completion_lock);
+    completion_cpu = cpu;
+    completion_apply();
+    mutex_unlock(&completion_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops completion_cpu_ops = {
+    .set = completion_cpu_set,
+    .get = param_get_int,
+};
+module_param_cb(completion_cpu, &completion_cpu_ops, &completion_cpu, 0644);
+MODULE_PARM_DESC(completion_cpu, "CPU to run the completion thread and the interrupts on (-1 for any)");
+
+static int completion_prio_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int prio;
+    int err = kstrtouint(val, 0, &prio);
+    if (err)
+        return err;
+    if (prio > MAX_RT_PRIO - 1)
+        return -EINVAL;
+    mutex_lock(&completion_lock);
+    completion_prio = prio;
+    completion_apply();
+    mutex_unlock(&completion_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops completion_prio_ops = {
+    .set = completion_prio_set,
+    .get = param_get_uint,
+};
+module_param_cb(completion_prio, &completion_prio_ops, &completion_prio, 0644);
+MODULE_PARM_DESC(completion_prio, "SCHED_FIFO priority of the completion thread (0 for SCHED_NORMAL)");
+
+int __init knacs_completion_init(void)
+{
+    if (!completion_thread)
+        return 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+    struct kthread_worker *worker = kthread_create_worker(0, "knacs-completion");
+#else
+    struct kthread_worker *worker = kthread_run_worker(0, "knacs-completion");
+#endif
+    if (IS_ERR(worker)) {
+        pr_alert("Failed to create the completion thread\n");
+        return PTR_ERR(worker);
+    }
+    mutex_lock(&completion_lock);
+    completion_worker = worker;
+    completion_apply();
+    mutex_unlock(&completion_lock);
+    return 0;
+}
+
+void knacs_completion_exit(void)
+{
+    mutex_lock(&completion_lock);
+    struct kthread_worker *worker = completion_worker;
+    completion_worker = NULL;
+    mutex_unlock(&completion_lock);
+    // All the interrupts are freed by now, this finishes the remaining work.
+    if (worker)
+        kthread_destroy_worker(worker);
+}
+
+void knacs_completion_queue(struct kthread_work *work)
+{
+    // The worker is only changed when there's no interrupt.
+    if (completion_worker) {
+        kthread_queue_work(completion_worker, work);
+    } else {
+        work->func(work);
+    }
+}
+
+void knacs_completion_cancel(struct kthread_work *work)
+{
+    if (completion_worker)
+        kthread_cancel_work_sync(work);
+}
+
+void knacs_completion_add_irq(int irq)
+{
+    mutex_lock(&completion_lock);
+    for (unsigned int i = 0; i < ARRAY_SIZE(completion_irqs); i++) {
+        if (completion_irqs[i] <= 0) {
+            completion_irqs[i] = irq;
+            if (completion_cpu >= 0)
+                completion_apply_irq(irq);
+            break;
+        }
+    }
+    mutex_unlock(&completion_lock);
+}
+
+void knacs_completion_remove_irq(int irq)
+{
+    mutex_lock(&completion_lock);
+    for (unsigned int i = 0; i < ARRAY_SIZE(completion_irqs); i++) {
+        if (completion_irqs[i] == irq) {
+            completion_irqs[i] = 0;
+            // The hint must be cleared before the interrupt is freed.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+            irq_set_affinity_hint(irq, NULL);
+#else
+            irq_update_affinity_hint(irq, NULL);
+#endif
+            break;
+        }
+    }
+    mutex_unlock(&completion_lock);
+}
@@ -0,0 +1,40 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_COMPLETION_H__
+#define __KNACS_COMPLETION_H__
+
+#include <linux/kthread.h>
+
+int knacs_completion_init(void);
+void knacs_completion_exit(void);
+
+// Run the work in the completion thread, or directly if the thread is disabled
+// (with `completion_thread=0`). Safe to be called from interrupt context.
+void knacs_completion_queue(struct kthread_work*);
+// Wait for the work to finish and make sure it's not queued anymore.
+// The interrupt queuing it must have been freed already.
+void knacs_completion_cancel(struct kthread_work*);
+
+// Keep the affinity of the interrupt the same as the completion thread.
+// The interrupt must be removed before it's freed.
+void knacs_completion_add_irq(int irq);
+void knacs_completion_remove_irq(int irq);
+
+#endif
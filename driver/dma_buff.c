@@ -21,86 +21,225 @@
 
 /**
  * Similar to the OCM manager, this allocates physically contiguous buffers from normal memory.
+ * The memory comes from the DMA page cache so a buffer may consist of multiple
+ * physically contiguous chunks.
+ *
+ * The buffer is zero filled unless the file has set `KNACS_ALLOC_NO_ZERO`,
+ * in which case it may contain data from previous buffers of the same file.
+ * The cache attribute of the mapping is also selected by the file's allocation flags.
+ *
+ * Buffers can also be created with `KNACS_BUFF_CREATE`, which returns a handle
+ * that is used to map the buffer (with the handle encoded in the mmap offset)
+ * and to grow it with `KNACS_BUFF_RESIZE`. The handles are per file.
+ * Depending on the placement hint, these buffers may be placed in the OCM instead
+ * and can be migrated there later when the OCM has space.
  */
 
 #include "dma_buff.h"
 
+#include "alloc_bench.h"
 #include "buff_alloc.h"
+#include "dma_engine.h"
+#include "dma_page.h"
+#include "dma_region.h"
+#include "event.h"
 #include "knacs.h"
+#include "ocm.h"
+#include "stats.h"
 
-#include <linux/genalloc.h>
-#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/ktime.h>
+#include <linux/mman.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
 
-#define MAX_PAGE_ORDER 6
-#define MAX_PAGE_COUNT (1 << MAX_PAGE_ORDER)
-
-static struct gen_pool *dma_buff_pool = NULL;
-static struct page *all_pages[MAX_PAGE_COUNT] = {};
-static unsigned int all_orders[MAX_PAGE_COUNT] = {};
+static unsigned int ocm_tier_max_size = 64 * 1024;
+module_param(ocm_tier_max_size, uint, 0644);
+MODULE_PARM_DESC(ocm_tier_max_size, "Largest buffer placed in the OCM with KNACS_ALLOC_TIER_ANY");
 
 int __init knacs_dma_buff_init(void)
 {
-    // Logic copied from `arch/arm/mach-zynq/zynq_ocm.c`
-    // Don't fail the module loading if this fail, we'll simply fail at allocation time instead.
-    dma_buff_pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
-    if (!dma_buff_pool)
-        return 0;
-
-    // Try to allocate 64 pages in total, with as large chuncks as possible.
-    unsigned int order = MAX_PAGE_ORDER;
-    unsigned int allocated = 0;
-    unsigned int all_pages_idx = 0;
-
-    while (allocated < MAX_PAGE_COUNT) {
-        struct page *page = alloc_pages(GFP_KERNEL, order);
-        if (!page) {
-            if (order == 0)
-                break;
-            order--;
-            continue;
-        }
-        unsigned int count = 1 << order;
-        void *virt_addr = page_address(page);
-        unsigned long phy_addr = page_to_pfn(page) << PAGE_SHIFT;
-        int ret = gen_pool_add_virt(dma_buff_pool, (unsigned long)virt_addr,
-                                    phy_addr, count << PAGE_SHIFT, -1);
-        if (ret < 0) {
-            pr_alert("Unable to add page to pool %d\n", ret);
-            __free_pages(page, order);
-            break;
-        }
-        pr_info("Allocated %u pages at %lx\n", count, phy_addr);
-        all_pages[all_pages_idx] = page;
-        all_orders[all_pages_idx] = order;
-        all_pages_idx++;
-        allocated += count;
+    int err = knacs_dma_page_init();
+    if (err) {
+        pr_alert("Unable to initialize DMA page cache\n");
+        return err;
+    }
+    if ((err = knacs_dma_region_init())) {
+        knacs_dma_page_exit();
+        return err;
     }
+    knacs_alloc_bench();
+    return 0;
+}
 
-    if (allocated < MAX_PAGE_COUNT)
-        pr_alert("Unable to allocate %u pages, %u allocated\n", MAX_PAGE_COUNT, allocated);
+void knacs_dma_buff_exit(void)
+{
+    knacs_buff_alloc_exit();
+    // The regions are taken out of the DMA pool before it's destroyed.
+    knacs_dma_region_exit();
+    knacs_dma_page_exit();
+}
 
-    return 0;
+int knacs_dma_buff_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct knacs_file *kfile = file->private_data;
+    u64 t0 = ktime_get_ns();
+    int ret = knacs_buff_block_mmap(vma, "DMA Buff", kfile->id, READ_ONCE(kfile->alloc_flags),
+                                    knacs_dma_device(kfile->inst));
+    knacs_lat_record(KNACS_LAT_DMA_MMAP, ktime_get_ns() - t0);
+    return ret;
 }
 
-void __exit knacs_dma_buff_exit(void)
+static unsigned long buff_handle_pgoff(u32 handle)
 {
-    if (gen_pool_avail(dma_buff_pool) < gen_pool_size(dma_buff_pool)) {
-        pr_warn("Exit while buffer allocated.\n");
-        return;
-    }
+    return (unsigned long)handle << (KNACS_BUFF_OFFSET_SHIFT - PAGE_SHIFT);
+}
 
-    gen_pool_destroy(dma_buff_pool);
-    dma_buff_pool = NULL;
+struct gen_pool *knacs_dma_buff_tier_pool(size_t size, u32 tier)
+{
+    if (tier == KNACS_ALLOC_TIER_BULK ||
+        (tier == KNACS_ALLOC_TIER_ANY && size > READ_ONCE(ocm_tier_max_size)))
+        return NULL;
+    return knacs_ocm_pool();
+}
 
-    for (unsigned int i = 0; i < MAX_PAGE_COUNT; i++) {
-        if (!all_pages[i])
-            break;
-        __free_pages(all_pages[i], all_orders[i]);
+int knacs_dma_buff_create(struct knacs_file *kfile, knacs_buff_create_t __user *arg)
+{
+    knacs_buff_create_t create;
+    if (copy_from_user(&create, arg, sizeof(create)))
+        return -EFAULT;
+    u32 tier = create.flags & KNACS_ALLOC_TIER_MASK;
+    // The buffer must not overlap with the offsets of the next handle.
+    if (create.size == 0 || create.size > (1ull << KNACS_BUFF_OFFSET_SHIFT) ||
+        create.size != (size_t)create.size || !PAGE_ALIGNED(create.size) ||
+        !knacs_alloc_flags_valid(create.flags & ~(KNACS_ALLOC_TIER_MASK | KNACS_ALLOC_MIGRATE)) ||
+        tier > KNACS_ALLOC_TIER_BULK)
+        return -EINVAL;
+
+    mutex_lock(&kfile->buffs_lock);
+    // Keep the handles small enough so that the offset fits in the `mmap2` syscall
+    // on 32-bit systems.
+    int ret = idr_alloc(&kfile->buffs, NULL, 1, KNACS_BUFF_MAX_HANDLES, GFP_KERNEL);
+    if (ret < 0)
+        goto out;
+    u32 handle = ret;
+    struct knacs_buff_handle *buf =
+        knacs_buff_handle_create(create.size, kfile->id, create.flags,
+                                 knacs_dma_device(kfile->inst),
+                                 knacs_dma_buff_tier_pool(create.size, tier),
+                                 buff_handle_pgoff(handle));
+    if (IS_ERR(buf)) {
+        idr_remove(&kfile->buffs, handle);
+        ret = PTR_ERR(buf);
+        goto out;
     }
-    all_pages[0] = NULL;
+    idr_replace(&kfile->buffs, buf, handle);
+    ret = 0;
+    create.handle = handle;
+    create.offset = (u64)handle << KNACS_BUFF_OFFSET_SHIFT;
+    create.location = knacs_buff_handle_in_pool(buf) ? KNACS_BUFF_LOC_OCM : KNACS_BUFF_LOC_DRAM;
+out:
+    mutex_unlock(&kfile->buffs_lock);
+    if (ret)
+        return ret;
+    if (copy_to_user(&arg->handle, &create.handle, sizeof(create.handle)) ||
+        copy_to_user(&arg->offset, &create.offset, sizeof(create.offset)) ||
+        copy_to_user(&arg->location, &create.location, sizeof(create.location)))
+        return -EFAULT;
+    return 0;
 }
 
-int knacs_dma_buff_mmap(struct file *file, struct vm_area_struct *vma)
+int knacs_dma_buff_resize(struct knacs_file *kfile, knacs_buff_resize_t __user *arg)
+{
+    knacs_buff_resize_t resize;
+    if (copy_from_user(&resize, arg, sizeof(resize)))
+        return -EFAULT;
+    if (resize.size > (1ull << KNACS_BUFF_OFFSET_SHIFT) || resize.size != (size_t)resize.size)
+        return -EINVAL;
+    int ret = -EINVAL;
+    mutex_lock(&kfile->buffs_lock);
+    struct knacs_buff_handle *buf = idr_find(&kfile->buffs, resize.handle);
+    if (buf)
+        ret = knacs_buff_handle_resize(buf, resize.size);
+    mutex_unlock(&kfile->buffs_lock);
+    return ret;
+}
+
+int knacs_dma_buff_free(struct knacs_file *kfile, u32 handle)
+{
+    mutex_lock(&kfile->buffs_lock);
+    struct knacs_buff_handle *buf = idr_remove(&kfile->buffs, handle);
+    mutex_unlock(&kfile->buffs_lock);
+    if (!buf)
+        return -EINVAL;
+    // The memory stays alive until it's unmapped.
+    knacs_buff_handle_put(buf);
+    return 0;
+}
+
+int knacs_dma_buff_migrate(struct knacs_file *kfile, u32 handle)
+{
+    int ret = -EINVAL;
+    mutex_lock(&kfile->buffs_lock);
+    struct knacs_buff_handle *buf = idr_find(&kfile->buffs, handle);
+    if (buf)
+        ret = knacs_buff_handle_migrate(buf, knacs_ocm_pool());
+    mutex_unlock(&kfile->buffs_lock);
+    return ret;
+}
+
+int knacs_dma_buff_mmap_handle(struct file *file, struct vm_area_struct *vma)
+{
+    struct knacs_file *kfile = file->private_data;
+    u64 t0 = ktime_get_ns();
+    unsigned long handle = vma->vm_pgoff >> (KNACS_BUFF_OFFSET_SHIFT - PAGE_SHIFT);
+    int ret = -EINVAL;
+    mutex_lock(&kfile->buffs_lock);
+    struct knacs_buff_handle *buf = handle < KNACS_BUFF_MAX_HANDLES ?
+        idr_find(&kfile->buffs, handle) : NULL;
+    if (buf)
+        ret = knacs_buff_handle_mmap(buf, vma);
+    mutex_unlock(&kfile->buffs_lock);
+    knacs_lat_record(KNACS_LAT_DMA_MMAP, ktime_get_ns() - t0);
+    return ret;
+}
+
+void knacs_dma_buff_release(struct knacs_file *kfile)
+{
+    struct knacs_buff_handle *buf;
+    int handle;
+    mutex_lock(&kfile->buffs_lock);
+    idr_for_each_entry(&kfile->buffs, buf, handle)
+        knacs_buff_handle_put(buf);
+    idr_destroy(&kfile->buffs);
+    mutex_unlock(&kfile->buffs_lock);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static unsigned long buff_get_area(struct file *file, unsigned long addr, unsigned long len,
+                                   unsigned long pgoff, unsigned long flags)
 {
-    return knacs_buff_alloc_mmap(dma_buff_pool, vma, "DMA Buff");
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+    return current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
+#else
+    return mm_get_unmapped_area(current->mm, file, addr, len, pgoff, flags);
+#endif
+}
+
+unsigned long knacs_dma_buff_get_unmapped_area(struct file *file, unsigned long addr,
+                                               unsigned long len, unsigned long pgoff,
+                                               unsigned long flags)
+{
+    // We don't know if the buffer uses huge pages until it's mapped
+    // but aligning the address of the large mappings doesn't hurt.
+    if (knacs_dma_buff_is_handle(pgoff) && len >= PMD_SIZE && !(flags & MAP_FIXED)) {
+        unsigned long off = (pgoff & ((PMD_SIZE >> PAGE_SHIFT) - 1)) << PAGE_SHIFT;
+        unsigned long ret = buff_get_area(file, 0, len + PMD_SIZE, pgoff, flags);
+        if (!IS_ERR_VALUE(ret))
+            return ret + ((off - ret) & ~PMD_MASK);
+    }
+    return buff_get_area(file, addr, len, pgoff, flags);
 }
+#endif
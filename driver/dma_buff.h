@@ -20,11 +20,47 @@
 #ifndef __KNACS_DMA_BUFF_H__
 #define __KNACS_DMA_BUFF_H__
 
+#include "knacs.h"
+
 #include <linux/fs.h>
+#include <linux/genalloc.h>
 #include <linux/mm.h>
 
+struct knacs_file;
+
 int knacs_dma_buff_init(void);
 void knacs_dma_buff_exit(void);
 int knacs_dma_buff_mmap(struct file*, struct vm_area_struct*);
 
+static inline bool knacs_alloc_flags_valid(u32 flags)
+{
+    if (flags & ~(KNACS_ALLOC_NO_ZERO | KNACS_ALLOC_CACHE_MASK | KNACS_ALLOC_HUGE))
+        return false;
+    return (flags & KNACS_ALLOC_CACHE_MASK) <= KNACS_ALLOC_UNCACHED;
+}
+
+// The pool to try first for a buffer with the placement hint `tier`
+// (`KNACS_ALLOC_TIER_*`), `NULL` for the DMA pages.
+struct gen_pool *knacs_dma_buff_tier_pool(size_t size, u32 tier);
+
+// Handle based buffers
+static inline bool knacs_dma_buff_is_handle(unsigned long pgoff)
+{
+    return pgoff >= (1ul << (KNACS_BUFF_OFFSET_SHIFT - PAGE_SHIFT));
+}
+int knacs_dma_buff_create(struct knacs_file*, knacs_buff_create_t __user *arg);
+int knacs_dma_buff_resize(struct knacs_file*, knacs_buff_resize_t __user *arg);
+int knacs_dma_buff_free(struct knacs_file*, u32 handle);
+// Move the buffer to the OCM now if possible.
+int knacs_dma_buff_migrate(struct knacs_file*, u32 handle);
+int knacs_dma_buff_mmap_handle(struct file*, struct vm_area_struct*);
+// Release all the handles of the file when it is closed.
+void knacs_dma_buff_release(struct knacs_file*);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+// Align the mappings of the buffers for the huge pages.
+unsigned long knacs_dma_buff_get_unmapped_area(struct file*, unsigned long addr,
+                                               unsigned long len, unsigned long pgoff,
+                                               unsigned long flags);
+#endif
+
 #endif
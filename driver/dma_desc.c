@@ -0,0 +1,123 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-desc): " fmt
+
+/**
+ * Pool of SG descriptors.
+ *
+ * Coherent memory is limited so the descriptors are allocated once when the channel
+ * is created and are only assigned to a transfer right before it is started
+ * (from the completion interrupt for queued transfers). The free list is lock-free
+ * so that it can be used from any context without blocking.
+ */
+
+#include "dma_desc.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+static unsigned int dma_desc_count = 1024;
+module_param(dma_desc_count, uint, 0444);
+MODULE_PARM_DESC(dma_desc_count, "Number of SG descriptors preallocated for each DMA channel");
+
+#define DESC_NONE U32_MAX
+
+static inline u32 head_idx(s64 head)
+{
+    return lower_32_bits(head);
+}
+
+static inline s64 head_make(s64 old, u32 idx)
+{
+    // Bump the tag so that a concurrent pop/push pair can't make the head look unchanged.
+    return (s64)(((u64)upper_32_bits(old) + 1) << 32 | idx);
+}
+
+int knacs_dma_desc_pool_init(struct knacs_dma_desc_pool *pool, struct device *dev)
+{
+    if (dma_desc_count == 0) {
+        pr_alert("Invalid descriptor count %u\n", dma_desc_count);
+        return -EINVAL;
+    }
+    pool->dev = dev;
+    pool->count = dma_desc_count;
+    pool->next = kcalloc(pool->count, sizeof(u32), GFP_KERNEL);
+    if (!pool->next)
+        return -ENOMEM;
+    // Coherent allocations are at least page aligned, which is more than what we need.
+    pool->descs = dma_alloc_coherent(dev, pool->count * sizeof(struct knacs_axi_desc),
+                                     &pool->dma_addr, GFP_KERNEL);
+    if (!pool->descs) {
+        pr_alert("Unable to allocate %u descriptors\n", pool->count);
+        kfree(pool->next);
+        pool->next = NULL;
+        return -ENOMEM;
+    }
+    for (u32 i = 0; i < pool->count; i++)
+        pool->next[i] = i + 1 < pool->count ? i + 1 : DESC_NONE;
+    atomic64_set(&pool->head, 0);
+    atomic_set(&pool->used, 0);
+    atomic_set(&pool->max_used, 0);
+    return 0;
+}
+
+void knacs_dma_desc_pool_destroy(struct knacs_dma_desc_pool *pool)
+{
+    if (!pool->descs)
+        return;
+    if (atomic_read(&pool->used))
+        pr_warn("Descriptors leaked: %d\n", atomic_read(&pool->used));
+    dma_free_coherent(pool->dev, pool->count * sizeof(struct knacs_axi_desc),
+                      pool->descs, pool->dma_addr);
+    pool->descs = NULL;
+    kfree(pool->next);
+    pool->next = NULL;
+}
+
+struct knacs_axi_desc *knacs_dma_desc_alloc(struct knacs_dma_desc_pool *pool)
+{
+    s64 old = atomic64_read(&pool->head);
+    u32 idx;
+    do {
+        idx = head_idx(old);
+        if (idx == DESC_NONE)
+            return NULL;
+    } while (!atomic64_try_cmpxchg(&pool->head, &old,
+                                   head_make(old, READ_ONCE(pool->next[idx]))));
+
+    int used = atomic_inc_return(&pool->used);
+    int max_used = atomic_read(&pool->max_used);
+    while (used > max_used) {
+        if (atomic_try_cmpxchg(&pool->max_used, &max_used, used))
+            break;
+    }
+    return &pool->descs[idx];
+}
+
+void knacs_dma_desc_free(struct knacs_dma_desc_pool *pool, struct knacs_axi_desc *desc)
+{
+    u32 idx = desc - pool->descs;
+    s64 old = atomic64_read(&pool->head);
+    do {
+        WRITE_ONCE(pool->next[idx], head_idx(old));
+    } while (!atomic64_try_cmpxchg(&pool->head, &old, head_make(old, idx)));
+    atomic_dec(&pool->used);
+}
@@ -0,0 +1,79 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_DESC_H__
+#define __KNACS_DMA_DESC_H__
+
+#include <linux/atomic.h>
+#include <linux/bits.h>
+#include <linux/device.h>
+#include <linux/types.h>
+
+// SG descriptor of the AXI DMA engine (PG021).
+struct knacs_axi_desc {
+    u32 next_desc;
+    u32 next_desc_msb;
+    u32 buf_addr;
+    u32 buf_addr_msb;
+    u32 reserved[2];
+    u32 control;
+    u32 status;
+    u32 app[5];
+} __aligned(64);
+
+#define KNACS_AXI_DESC_LEN_MASK GENMASK(25, 0)
+#define KNACS_AXI_DESC_EOF BIT(26)
+#define KNACS_AXI_DESC_SOF BIT(27)
+#define KNACS_AXI_DESC_INT_ERR BIT(28)
+#define KNACS_AXI_DESC_SLV_ERR BIT(29)
+#define KNACS_AXI_DESC_DEC_ERR BIT(30)
+#define KNACS_AXI_DESC_CMPLT BIT(31)
+#define KNACS_AXI_DESC_ERR_MASK (KNACS_AXI_DESC_INT_ERR | KNACS_AXI_DESC_SLV_ERR | \
+                                 KNACS_AXI_DESC_DEC_ERR)
+
+// Preallocated pool of SG descriptors in coherent memory (`knacs_dma_sg_desc` in Design.md).
+struct knacs_dma_desc_pool {
+    struct device *dev;
+    struct knacs_axi_desc *descs;
+    dma_addr_t dma_addr;
+    u32 count;
+    // Link to the next free descriptor for each free descriptor.
+    u32 *next;
+    // Head of the free list, the index of the first free descriptor in the low 32 bits
+    // and a tag that is incremented on every update in the high 32 bits to avoid ABA.
+    atomic64_t head;
+    atomic_t used;
+    atomic_t max_used;
+};
+
+int knacs_dma_desc_pool_init(struct knacs_dma_desc_pool*, struct device*);
+void knacs_dma_desc_pool_destroy(struct knacs_dma_desc_pool*);
+
+// Non-blocking and safe to be called from interrupt context.
+// Returns NULL if the pool is empty.
+struct knacs_axi_desc *knacs_dma_desc_alloc(struct knacs_dma_desc_pool*);
+void knacs_dma_desc_free(struct knacs_dma_desc_pool*, struct knacs_axi_desc*);
+
+static inline dma_addr_t knacs_dma_desc_addr(struct knacs_dma_desc_pool *pool,
+                                             struct knacs_axi_desc *desc)
+{
+    return pool->dma_addr + (desc - pool->descs) * sizeof(*desc);
+}
+
+#endif
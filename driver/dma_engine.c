@@ -0,0 +1,681 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma): " fmt
+
+/**
+ * Hardware independent part of the DMA write (MM2S) path.
+ *
+ * The user submits a range in a buffer mapped from the device.
+ * We split it into pieces that each fit in an SG descriptor and start the transfer
+ * immediately if there's nothing running, or push it to the to-write queue otherwise.
+ * When the backend (the AXI DMA hardware or the loopback device) finishes a transfer,
+ * the next one in the queue is started directly from the completion handler.
+ *
+ * If the backend supports it, up to `dma_chain_depth` transfers are handed to the engine
+ * at the same time, with the chain of each one linked after the previous one,
+ * so that back-to-back sequences run without the engine going idle in between.
+ * The time the engine spends idle while a transfer is waiting is recorded as a gap.
+ *
+ * The descriptors are only taken from the pool when the transfer is started.
+ * If there aren't enough of them, the transfer is sent as multiple packets,
+ * with the next chain started when the previous one finishes.
+ */
+
+#include "dma_engine.h"
+
+#include "buff_alloc.h"
+#include "dma_tx.h"
+#include "event.h"
+#include "instance.h"
+#include "knacs_trace.h"
+#include "stats.h"
+#include "uring.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+static unsigned int dma_chain_depth = 4;
+module_param(dma_chain_depth, uint, 0644);
+MODULE_PARM_DESC(dma_chain_depth,
+                 "Maximum number of transfers handed to the DMA engine at once (<= 1 disables chaining)");
+
+int knacs_dma_chan_init(struct knacs_dma_chan *chan, struct device *dev,
+                        const struct knacs_dma_engine_ops *ops, u32 max_seg_len)
+{
+    chan->dev = dev;
+    chan->ops = ops;
+    chan->max_seg_len = max_seg_len;
+    int err = knacs_dma_desc_pool_init(&chan->desc_pool, dev);
+    if (err)
+        return err;
+    spin_lock_init(&chan->lock);
+    INIT_LIST_HEAD(&chan->queue);
+    INIT_LIST_HEAD(&chan->active);
+    chan->nactive = 0;
+    chan->idle_time = 0;
+    chan->last_token = 0;
+    chan->done_token = 0;
+    init_waitqueue_head(&chan->wait);
+    INIT_LIST_HEAD(&chan->waiters);
+    memset(&chan->stats, 0, sizeof(chan->stats));
+    chan->stats.desc_total = chan->desc_pool.count;
+    refcount_set(&chan->users, 1);
+    init_completion(&chan->unused);
+    chan->dead = false;
+    return 0;
+}
+
+// Give the descriptors of the current chain back to the pool.
+static void knacs_dma_xfer_release_descs(struct knacs_dma_chan *chan,
+                                         struct knacs_dma_xfer *xfer)
+{
+    for (unsigned int i = 0; i < xfer->ndescs; i++)
+        knacs_dma_desc_free(&chan->desc_pool, xfer->descs[i]);
+    xfer->ndescs = 0;
+}
+
+static void knacs_dma_xfer_free(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer)
+{
+    if (xfer->owner)
+        knacs_file_put(xfer->owner);
+    knacs_dma_xfer_release_descs(chan, xfer);
+    kfree(xfer->piece_addrs);
+    kfree(xfer->piece_lens);
+    kfree(xfer->descs);
+    kfree(xfer->desc_addrs);
+    if (xfer->buf)
+        knacs_buff_put(xfer->buf);
+    if (xfer->tx_ring)
+        knacs_tx_ring_put(xfer->tx_ring);
+    kfree(xfer);
+}
+
+// Find the part of the `i`th segment of the buffer covered by the transfer.
+// Returns the length and sets `seg_offset` to the start of it in the segment.
+static size_t knacs_dma_xfer_seg(struct knacs_dma_xfer *xfer, unsigned int i,
+                                 size_t seg_start, size_t *seg_offset)
+{
+    size_t seg_end = seg_start + xfer->buf->segs[i].len;
+    size_t start = max(seg_start, xfer->offset);
+    size_t end = min(seg_end, xfer->offset + xfer->len);
+    *seg_offset = start - seg_start;
+    return end > start ? end - start : 0;
+}
+
+static int knacs_dma_xfer_build(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer)
+{
+    struct vm_buf *buf = xfer->buf;
+    unsigned int npieces = 0;
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < buf->nsegs; seg_start += buf->segs[i].len, i++) {
+        size_t seg_offset;
+        size_t len = knacs_dma_xfer_seg(xfer, i, seg_start, &seg_offset);
+        npieces += DIV_ROUND_UP(len, chan->max_seg_len);
+    }
+    xfer->piece_addrs = kcalloc(npieces, sizeof(*xfer->piece_addrs), GFP_KERNEL);
+    xfer->piece_lens = kcalloc(npieces, sizeof(*xfer->piece_lens), GFP_KERNEL);
+    xfer->descs = kcalloc(npieces, sizeof(*xfer->descs), GFP_KERNEL);
+    xfer->desc_addrs = kcalloc(npieces, sizeof(*xfer->desc_addrs), GFP_KERNEL);
+    if (!xfer->piece_addrs || !xfer->piece_lens || !xfer->descs || !xfer->desc_addrs)
+        return -ENOMEM;
+    // Non-cached mappings are always in sync with the memory.
+    if (buf->cache_mode == KNACS_ALLOC_CACHED)
+        knacs_buff_sync(buf, chan->dev, xfer->offset, xfer->len, true, DMA_TO_DEVICE);
+
+    seg_start = 0;
+    for (unsigned int i = 0; i < buf->nsegs; seg_start += buf->segs[i].len, i++) {
+        size_t seg_offset;
+        size_t len = knacs_dma_xfer_seg(xfer, i, seg_start, &seg_offset);
+        if (!len)
+            continue;
+        dma_addr_t seg_addr = buf->segs[i].dma_addr + seg_offset;
+        for (size_t offset = 0; offset < len; xfer->npieces++) {
+            size_t piece_len = min_t(size_t, len - offset, chan->max_seg_len);
+            xfer->piece_addrs[xfer->npieces] = seg_addr + offset;
+            xfer->piece_lens[xfer->npieces] = piece_len;
+            offset += piece_len;
+        }
+    }
+    return 0;
+}
+
+// Assign descriptors to as many of the remaining pieces as possible.
+// If `whole` is true, nothing is assigned unless all of them fit.
+// Returns false if no descriptor is assigned.
+// Called with the lock held.
+static bool knacs_dma_xfer_assign(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer,
+                                  bool whole)
+{
+    unsigned int first = xfer->next_piece;
+    unsigned int n = 0;
+    while (first + n < xfer->npieces) {
+        struct knacs_axi_desc *desc = knacs_dma_desc_alloc(&chan->desc_pool);
+        if (!desc)
+            break;
+        xfer->descs[n] = desc;
+        xfer->desc_addrs[n] = knacs_dma_desc_addr(&chan->desc_pool, desc);
+        n++;
+    }
+    if (whole && first + n < xfer->npieces) {
+        for (unsigned int i = 0; i < n; i++)
+            knacs_dma_desc_free(&chan->desc_pool, xfer->descs[i]);
+        return false;
+    }
+    if (!n)
+        return false;
+    if (first + n < xfer->npieces)
+        chan->stats.desc_splits++;
+    xfer->ndescs = n;
+    xfer->next_piece = first + n;
+
+    for (unsigned int i = 0; i < n; i++) {
+        struct knacs_axi_desc *desc = xfer->descs[i];
+        // The next pointer of the last one doesn't matter since the engine stops
+        // at the tail descriptor. Point it back to the head to close the ring.
+        dma_addr_t next = xfer->desc_addrs[i + 1 < n ? i + 1 : 0];
+        dma_addr_t buf_addr = xfer->piece_addrs[first + i];
+        memset(desc, 0, sizeof(*desc));
+        desc->next_desc = lower_32_bits(next);
+        desc->next_desc_msb = upper_32_bits(next);
+        desc->buf_addr = lower_32_bits(buf_addr);
+        desc->buf_addr_msb = upper_32_bits(buf_addr);
+        desc->control = xfer->piece_lens[first + i];
+        // Each chain is a complete packet so that the engine notifies us when it finishes.
+        if (i == 0)
+            desc->control |= KNACS_AXI_DESC_SOF;
+        if (i == n - 1)
+            desc->control |= KNACS_AXI_DESC_EOF;
+    }
+    return true;
+}
+
+// Returns 1 if the current chain of the transfer finished, 0 if it hasn't
+// and a negative error code if the engine reported an error for it.
+// Called with the lock held.
+static int knacs_dma_xfer_chain_status(struct knacs_dma_xfer *xfer)
+{
+    for (unsigned int i = 0; i < xfer->ndescs; i++) {
+        u32 status = READ_ONCE(xfer->descs[i]->status);
+        if (status & KNACS_AXI_DESC_ERR_MASK)
+            return -EIO;
+        if (!(status & KNACS_AXI_DESC_CMPLT))
+            return 0;
+    }
+    return 1;
+}
+
+// Report the completion of the transfer to the waiter, the ring or the owner.
+static void knacs_dma_xfer_notify(struct knacs_dma_xfer *xfer, s32 status)
+{
+    if (xfer->waiter) {
+        xfer->waiter->status = status;
+        knacs_uring_complete(xfer->waiter);
+    } else if (xfer->tx_ring) {
+        knacs_tx_ring_done(xfer->tx_ring, status);
+    } else if (xfer->owner) {
+        knacs_event_post(xfer->owner, KNACS_EVENT_DMA_DONE, status, xfer->token);
+    }
+}
+
+// Move the asynchronous waiters that are done to `done`.
+// Called with the lock held.
+static void knacs_dma_chan_collect_waiters(struct knacs_dma_chan *chan, struct list_head *done)
+{
+    struct knacs_dma_waiter *waiter, *next;
+    list_for_each_entry_safe(waiter, next, &chan->waiters, node) {
+        if (waiter->token <= chan->done_token)
+            list_move_tail(&waiter->node, done);
+    }
+}
+
+static void knacs_dma_notify_waiters(struct list_head *done)
+{
+    struct knacs_dma_waiter *waiter, *next;
+    list_for_each_entry_safe(waiter, next, done, node) {
+        list_del(&waiter->node);
+        waiter->status = 0;
+        knacs_uring_complete(waiter);
+    }
+}
+
+// Start the first transfer in the queue if the engine is idle,
+// otherwise chain as many of them as allowed after the active ones.
+// Called with the lock held.
+static void knacs_dma_chan_start_next(struct knacs_dma_chan *chan)
+{
+    while (!list_empty(&chan->queue)) {
+        struct knacs_dma_xfer *xfer = list_first_entry(&chan->queue, struct knacs_dma_xfer, node);
+        if (list_empty(&chan->active)) {
+            // All the descriptors are free when nothing is running so this shouldn't fail.
+            if (WARN_ON(!knacs_dma_xfer_assign(chan, xfer, false)))
+                return;
+            chan->start_time = ktime_get();
+            // Only count the time the transfer had to wait for the engine,
+            // not the time the engine was waiting for the user.
+            u64 idle_ns = ktime_to_ns(chan->idle_time);
+            if (idle_ns && xfer->submit_time < idle_ns) {
+                u64 gap = ktime_to_ns(chan->start_time) - idle_ns;
+                chan->stats.gaps++;
+                chan->stats.gap_ns += gap;
+                if (gap > chan->stats.max_gap_ns)
+                    chan->stats.max_gap_ns = gap;
+            }
+            list_move_tail(&xfer->node, &chan->active);
+            chan->nactive = 1;
+            chan->stats.queued--;
+            chan->ops->start(chan, xfer);
+            continue;
+        }
+        struct knacs_dma_xfer *prev = list_last_entry(&chan->active, struct knacs_dma_xfer, node);
+        // A transfer split into multiple chains has to finish before anything can follow it.
+        if (!chan->ops->append || chan->nactive >= dma_chain_depth ||
+            prev->next_piece < prev->npieces || !knacs_dma_xfer_assign(chan, xfer, true))
+            return;
+        list_move_tail(&xfer->node, &chan->active);
+        chan->nactive++;
+        chan->stats.queued--;
+        chan->stats.chained++;
+        chan->ops->append(chan, prev, xfer);
+    }
+}
+
+void knacs_dma_chan_done(struct knacs_dma_chan *chan, bool success, ktime_t time)
+{
+    LIST_HEAD(finished);
+    LIST_HEAD(done_waiters);
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    if (list_empty(&chan->active)) {
+        spin_unlock_irqrestore(&chan->lock, flags);
+        pr_debug("Spurious transfer completion\n");
+        return;
+    }
+
+    // Make sure we see the status written by the engine.
+    dma_rmb();
+    ktime_t now = ktime_get();
+    bool restarted = false;
+    while (!list_empty(&chan->active)) {
+        struct knacs_dma_xfer *xfer = list_first_entry(&chan->active, struct knacs_dma_xfer, node);
+        int status = knacs_dma_xfer_chain_status(xfer);
+        // Still running, or failed, which is handled when the backend reports the error.
+        // There may be nothing finished at all if the completions of multiple chained
+        // transfers were all handled by an earlier call.
+        if (success && status <= 0)
+            break;
+        knacs_dma_xfer_release_descs(chan, xfer);
+        if (status == 1 && xfer->next_piece < xfer->npieces) {
+            // Continue with the rest of the transfer. Nothing is chained after it.
+            if (knacs_dma_xfer_assign(chan, xfer, false)) {
+                chan->ops->start(chan, xfer);
+                restarted = true;
+                break;
+            }
+            status = -ENOMEM;
+        }
+        list_move_tail(&xfer->node, &finished);
+        chan->nactive--;
+        xfer->status = status == 1 ? 0 : -EIO;
+
+        chan->stats.completed++;
+        if (status == 1)
+            chan->stats.bytes += xfer->len;
+        else
+            chan->stats.errors++;
+        // The next chained transfer starts as soon as this one finishes.
+        chan->stats.busy_ns += ktime_to_ns(ktime_sub(now, chan->start_time));
+        chan->start_time = now;
+        chan->done_token = xfer->token;
+        if (status != 1)
+            break;
+    }
+    if (!success && !restarted) {
+        // The engine has been stopped. The transfers chained after the failed one
+        // never started, put them back to the front of the queue to run again.
+        struct knacs_dma_xfer *xfer;
+        list_for_each_entry(xfer, &chan->active, node) {
+            knacs_dma_xfer_release_descs(chan, xfer);
+            xfer->next_piece = 0;
+            chan->stats.queued++;
+        }
+        list_splice_init(&chan->active, &chan->queue);
+        chan->nactive = 0;
+    }
+    if (list_empty(&chan->active))
+        chan->idle_time = time;
+    knacs_dma_chan_collect_waiters(chan, &done_waiters);
+    knacs_dma_chan_start_next(chan);
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    struct knacs_dma_xfer *xfer, *next;
+    list_for_each_entry_safe(xfer, next, &finished, node) {
+        list_del(&xfer->node);
+        if (xfer->status)
+            pr_alert("Transfer %llu failed\n", (unsigned long long)xfer->token);
+        knacs_dma_xfer_notify(xfer, xfer->status);
+        u64 ns = ktime_get_ns() - xfer->submit_time;
+        knacs_lat_record(KNACS_LAT_DMA_XFER, ns);
+        trace_knacs_dma_complete(xfer->token, xfer->status, ns);
+        knacs_dma_xfer_free(chan, xfer);
+    }
+    knacs_dma_notify_waiters(&done_waiters);
+    wake_up_all(&chan->wait);
+}
+
+void knacs_dma_chan_destroy(struct knacs_dma_chan *chan)
+{
+    LIST_HEAD(aborted);
+    LIST_HEAD(done_waiters);
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    list_splice_tail_init(&chan->active, &aborted);
+    chan->nactive = 0;
+    list_splice_tail_init(&chan->queue, &aborted);
+    struct knacs_dma_xfer *xfer, *next;
+    list_for_each_entry(xfer, &aborted, node) {
+        chan->stats.completed++;
+        chan->stats.errors++;
+    }
+    chan->stats.queued = 0;
+    chan->done_token = chan->last_token;
+    list_splice_tail_init(&chan->waiters, &done_waiters);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    wake_up_all(&chan->wait);
+
+    list_for_each_entry_safe(xfer, next, &aborted, node) {
+        pr_warn("Transfer %llu aborted\n", (unsigned long long)xfer->token);
+        list_del(&xfer->node);
+        knacs_dma_xfer_notify(xfer, -ECANCELED);
+        trace_knacs_dma_complete(xfer->token, -ECANCELED, ktime_get_ns() - xfer->submit_time);
+        knacs_dma_xfer_free(chan, xfer);
+    }
+    knacs_dma_notify_waiters(&done_waiters);
+    knacs_dma_desc_pool_destroy(&chan->desc_pool);
+}
+
+int knacs_dma_register(struct knacs_instance *inst, struct knacs_dma_chan *chan)
+{
+    int ret = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    if (inst->dma_chan) {
+        pr_alert("Only one DMA channel is allowed per instance\n");
+        ret = -EBUSY;
+    } else {
+        WRITE_ONCE(inst->dma_chan, chan);
+    }
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    return ret;
+}
+
+// Take a reference to the channel of the instance so that it can't be destroyed
+// while we use it. Returns `NULL` if there's no channel.
+static struct knacs_dma_chan *knacs_dma_chan_get(struct knacs_instance *inst)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_dma_chan *chan = inst->dma_chan;
+    if (chan)
+        refcount_inc(&chan->users);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    return chan;
+}
+
+static void knacs_dma_chan_put(struct knacs_dma_chan *chan)
+{
+    if (refcount_dec_and_test(&chan->users))
+        complete(&chan->unused);
+}
+
+void knacs_dma_unregister(struct knacs_instance *inst, struct knacs_dma_chan *chan)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    bool registered = inst->dma_chan == chan;
+    if (registered)
+        WRITE_ONCE(inst->dma_chan, NULL);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    if (!registered)
+        return;
+    // No one can get the channel anymore. Wake up the synchronous waits
+    // and wait for everyone else, who only use it for a short time.
+    spin_lock_irqsave(&chan->lock, flags);
+    chan->dead = true;
+    spin_unlock_irqrestore(&chan->lock, flags);
+    wake_up_all(&chan->wait);
+    knacs_dma_chan_put(chan);
+    wait_for_completion(&chan->unused);
+}
+
+// Build the transfer and push it to the queue. Frees the transfer on failure.
+static int knacs_dma_xfer_queue(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer,
+                                u64 *token)
+{
+    int ret = knacs_dma_xfer_build(chan, xfer);
+    if (ret) {
+        knacs_dma_xfer_free(chan, xfer);
+        return ret;
+    }
+    // The transfer might be finished and freed as soon as we release the lock.
+    unsigned int npieces = xfer->npieces;
+    u64 submit_time = xfer->submit_time;
+    size_t len = xfer->len;
+
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    *token = xfer->token = ++chan->last_token;
+    if (xfer->waiter)
+        xfer->waiter->token = xfer->token;
+    chan->stats.submitted++;
+    list_add_tail(&xfer->node, &chan->queue);
+    chan->stats.queued++;
+    if (chan->stats.queued > chan->stats.max_queued)
+        chan->stats.max_queued = chan->stats.queued;
+    knacs_dma_chan_start_next(chan);
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    trace_knacs_dma_submit(*token, len, npieces);
+    knacs_lat_record(KNACS_LAT_DMA_SUBMIT, ktime_get_ns() - submit_time);
+    return 0;
+}
+
+int knacs_dma_submit(struct knacs_file *kfile, u64 addr, u64 len,
+                     struct knacs_dma_waiter *waiter, u64 *token)
+{
+    if (len == 0 || addr != (unsigned long)addr || len != (size_t)len)
+        return -EINVAL;
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(kfile->inst);
+    if (!chan)
+        return -ENODEV;
+
+    int ret;
+    struct knacs_dma_xfer *xfer = kzalloc(sizeof(struct knacs_dma_xfer), GFP_KERNEL);
+    if (!xfer) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    xfer->submit_time = ktime_get_ns();
+    xfer->owner = knacs_file_get(kfile);
+    xfer->waiter = waiter;
+    xfer->len = len;
+    xfer->buf = knacs_buff_get(addr, len, &xfer->offset);
+    if (IS_ERR(xfer->buf)) {
+        ret = PTR_ERR(xfer->buf);
+        xfer->buf = NULL;
+        knacs_dma_xfer_free(chan, xfer);
+        goto out;
+    }
+    if ((ret = knacs_dma_xfer_queue(chan, xfer, token)))
+        goto out;
+    pr_debug("Submitted transfer %llu of size %llu from 0x%lx\n",
+             (unsigned long long)*token, (unsigned long long)len, (unsigned long)addr);
+out:
+    knacs_dma_chan_put(chan);
+    return ret;
+}
+
+int knacs_dma_submit_buf(struct knacs_file *kfile, struct vm_buf *buf, size_t offset,
+                         size_t len, struct knacs_tx_ring *ring, u64 *token)
+{
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(kfile->inst);
+    if (!chan)
+        return -ENODEV;
+    int ret = -ENOMEM;
+    struct knacs_dma_xfer *xfer = kzalloc(sizeof(struct knacs_dma_xfer), GFP_KERNEL);
+    if (xfer) {
+        xfer->submit_time = ktime_get_ns();
+        xfer->owner = knacs_file_get(kfile);
+        if (ring)
+            xfer->tx_ring = knacs_tx_ring_get(ring);
+        xfer->buf = knacs_buff_ref(buf);
+        xfer->offset = offset;
+        xfer->len = len;
+        ret = knacs_dma_xfer_queue(chan, xfer, token);
+    }
+    knacs_dma_chan_put(chan);
+    return ret;
+}
+
+// Returns 1 if the transfer is done, -ENODEV if the channel is going away and 0 otherwise.
+static int knacs_dma_token_done(struct knacs_dma_chan *chan, u64 token)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    int res = chan->done_token >= token ? 1 : (chan->dead ? -ENODEV : 0);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    return res;
+}
+
+int knacs_dma_wait(struct knacs_instance *inst, u64 token)
+{
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(inst);
+    if (!chan)
+        return -ENODEV;
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    u64 last_token = chan->last_token;
+    spin_unlock_irqrestore(&chan->lock, flags);
+    int ret = -EINVAL;
+    int res = 0;
+    if (token != 0 && token <= last_token)
+        ret = wait_event_interruptible(chan->wait, (res = knacs_dma_token_done(chan, token)));
+    knacs_dma_chan_put(chan);
+    return ret ? ret : min(res, 0);
+}
+
+int knacs_dma_wait_async(struct knacs_instance *inst, u64 token, struct knacs_dma_waiter *waiter)
+{
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(inst);
+    if (!chan)
+        return -ENODEV;
+    int ret = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    if (token == 0 || token > chan->last_token) {
+        ret = -EINVAL;
+    } else if (chan->done_token >= token) {
+        ret = 1;
+    } else {
+        waiter->token = token;
+        list_add_tail(&waiter->node, &chan->waiters);
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+    knacs_dma_chan_put(chan);
+    return ret;
+}
+
+bool knacs_dma_cancel_waiter(struct knacs_instance *inst, struct knacs_dma_waiter *waiter)
+{
+    // If the channel is being removed, the waiter is notified when it's destroyed.
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(inst);
+    if (!chan)
+        return false;
+    bool found = false;
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    struct knacs_dma_waiter *iter;
+    list_for_each_entry(iter, &chan->waiters, node) {
+        if (iter == waiter) {
+            list_del(&waiter->node);
+            found = true;
+            break;
+        }
+    }
+    // The transfers are only notified after they are removed from these lists.
+    struct list_head *lists[] = { &chan->active, &chan->queue };
+    for (unsigned int i = 0; !found && i < ARRAY_SIZE(lists); i++) {
+        struct knacs_dma_xfer *xfer;
+        list_for_each_entry(xfer, lists[i], node) {
+            if (xfer->waiter == waiter) {
+                xfer->waiter = NULL;
+                found = true;
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+    knacs_dma_chan_put(chan);
+    return found;
+}
+
+int knacs_dma_get_stats(struct knacs_instance *inst, knacs_dma_stats_t *stats)
+{
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(inst);
+    if (!chan)
+        return -ENODEV;
+    unsigned long flags;
+    spin_lock_irqsave(&chan->lock, flags);
+    *stats = chan->stats;
+    spin_unlock_irqrestore(&chan->lock, flags);
+    stats->desc_used = atomic_read(&chan->desc_pool.used);
+    stats->desc_max_used = atomic_read(&chan->desc_pool.max_used);
+    knacs_dma_chan_put(chan);
+    return 0;
+}
+
+int knacs_dma_sync(struct knacs_instance *inst, u64 addr, u64 len, bool for_device)
+{
+    if (addr != (unsigned long)addr || len != (size_t)len)
+        return -EINVAL;
+    struct device *dev = knacs_dma_device(inst);
+    if (!dev)
+        return -ENODEV;
+    size_t offset;
+    struct vm_buf *buf = knacs_buff_get(addr, len, &offset);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    int ret = 0;
+    if (buf->cache_mode == KNACS_ALLOC_CACHED)
+        ret = knacs_buff_sync(buf, dev, offset, len, for_device, DMA_BIDIRECTIONAL);
+    knacs_buff_put(buf);
+    return ret;
+}
+
+struct device *knacs_dma_device(struct knacs_instance *inst)
+{
+    struct knacs_dma_chan *chan = knacs_dma_chan_get(inst);
+    if (!chan)
+        return NULL;
+    // The device itself outlives the binding of the driver.
+    struct device *dev = chan->dev;
+    knacs_dma_chan_put(chan);
+    return dev;
+}
@@ -0,0 +1,155 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_ENGINE_H__
+#define __KNACS_DMA_ENGINE_H__
+
+#include "dma_desc.h"
+#include "knacs.h"
+
+#include <linux/completion.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+struct knacs_file;
+struct knacs_instance;
+struct knacs_tx_ring;
+struct vm_buf;
+
+// Completion notification for a transfer submitted (or waited on)
+// with an io_uring command, stored in the `pdu` of the command.
+struct knacs_dma_waiter {
+    struct list_head node; // For chaining into the wait list of the channel
+    u64 token;
+    s32 status;
+};
+
+struct knacs_dma_xfer {
+    struct list_head node; // For chaining into the to-write queue or the active list
+    struct knacs_file *owner; // The file to notify when the transfer finishes
+    struct knacs_dma_waiter *waiter; // Notified instead of posting an event if not `NULL`
+    struct knacs_tx_ring *tx_ring; // The ring the slot is from, notified instead of the owner
+    struct vm_buf *buf;
+    size_t offset; // Offset of the data in the buffer
+    size_t len;
+    u64 token;
+    s32 status; // The result of the transfer once it's removed from the active list
+    u64 submit_time; // In ns, for the statistics
+    // The pieces of the data, each one needs a descriptor.
+    unsigned int npieces;
+    dma_addr_t *piece_addrs;
+    u32 *piece_lens;
+    unsigned int next_piece; // The first piece not sent yet
+    // The descriptor chain currently assigned to the transfer,
+    // which may only cover part of the pieces if we ran out of descriptors.
+    unsigned int ndescs;
+    struct knacs_axi_desc **descs;
+    dma_addr_t *desc_addrs;
+};
+
+struct knacs_dma_chan;
+
+struct knacs_dma_engine_ops {
+    // Start running the descriptor chain of the transfer.
+    // Called with the channel lock held and interrupt disabled.
+    // The backend should call `knacs_dma_chan_done` when the chain finishes.
+    // This may be called again for the same transfer if it needs more than one chain.
+    void (*start)(struct knacs_dma_chan*, struct knacs_dma_xfer*);
+    // Optional. Link the chain of the transfer after the one of `prev`, the last transfer
+    // handed to the engine, and let the engine continue into it without stopping.
+    // The engine may have already finished `prev` and gone idle.
+    // Called with the channel lock held and interrupt disabled.
+    void (*append)(struct knacs_dma_chan*, struct knacs_dma_xfer *prev,
+                   struct knacs_dma_xfer*);
+};
+
+struct knacs_dma_chan {
+    struct device *dev;
+    const struct knacs_dma_engine_ops *ops;
+    u32 max_seg_len;
+    struct knacs_dma_desc_pool desc_pool;
+
+    spinlock_t lock;
+    struct list_head queue; // The to-write queue
+    // The transfers handed to the engine, in the order they run.
+    // Only the first one may be running a partial chain.
+    struct list_head active;
+    unsigned int nactive;
+    u64 last_token;
+    u64 done_token;
+    wait_queue_head_t wait;
+    struct list_head waiters; // Asynchronous waits for `done_token`
+    ktime_t start_time; // When the first active transfer started
+    ktime_t idle_time; // When the engine last ran out of active transfers
+    knacs_dma_stats_t stats;
+    // The registration and the callers using the channel of an instance,
+    // see `knacs_dma_unregister`.
+    refcount_t users;
+    struct completion unused; // Completed when `users` drops to 0
+    bool dead; // Unregistered, the synchronous waits give up
+};
+
+int knacs_dma_chan_init(struct knacs_dma_chan*, struct device*,
+                        const struct knacs_dma_engine_ops*, u32 max_seg_len);
+// Abort all pending transfers and free the resources.
+// The hardware must have been stopped before calling this.
+void knacs_dma_chan_destroy(struct knacs_dma_chan*);
+// Called by the backend when one or more of the active transfers finished,
+// or with `success == false` when the engine failed and has been stopped.
+// The finished transfers are found from the status of the descriptors.
+// `time` is when the engine was found to have finished (e.g. when the interrupt arrived),
+// which is where the gap before the next transfer starts.
+// Safe to be called from interrupt context.
+void knacs_dma_chan_done(struct knacs_dma_chan*, bool success, ktime_t time);
+
+// Only one channel can be registered per instance at a time.
+int knacs_dma_register(struct knacs_instance*, struct knacs_dma_chan*);
+// Wait for the current users of the channel (the functions below) to finish
+// so that it can be destroyed. May sleep.
+void knacs_dma_unregister(struct knacs_instance*, struct knacs_dma_chan*);
+
+// Submit to the channel of the instance of the file.
+// The completion is reported to `waiter` instead of the file if it's not `NULL`.
+int knacs_dma_submit(struct knacs_file*, u64 addr, u64 len,
+                     struct knacs_dma_waiter *waiter, u64 *token);
+// Submit `[offset, offset + len)` of a buffer owned by the kernel
+// (a slot of the transmit ring or a cached sequence).
+// The completion is reported to `ring` instead of the file if it's not `NULL`.
+int knacs_dma_submit_buf(struct knacs_file*, struct vm_buf *buf, size_t offset,
+                         size_t len, struct knacs_tx_ring *ring, u64 *token);
+int knacs_dma_wait(struct knacs_instance*, u64 token);
+// Returns 1 if the transfer is already done, otherwise `waiter` is notified
+// when it is (0 is returned) unless there's an error.
+int knacs_dma_wait_async(struct knacs_instance*, u64 token, struct knacs_dma_waiter *waiter);
+// Detach `waiter` (of a transfer or an asynchronous wait) from the channel when its
+// io_uring command is canceled. Returns `true` if it was still pending, in which case
+// it will never be notified. A canceled transfer still runs and is reported to the file.
+// Otherwise the notification is already on its way.
+bool knacs_dma_cancel_waiter(struct knacs_instance*, struct knacs_dma_waiter *waiter);
+int knacs_dma_get_stats(struct knacs_instance*, knacs_dma_stats_t *stats);
+// Sync the cache for `[addr, addr + len)` in a buffer mapped by the current process.
+int knacs_dma_sync(struct knacs_instance*, u64 addr, u64 len, bool for_device);
+// The device to do cache maintenance with, `NULL` if there's no DMA channel.
+struct device *knacs_dma_device(struct knacs_instance*);
+
+#endif
@@ -0,0 +1,154 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-buf): " fmt
+
+/**
+ * Export the buffers as dma-buf so that they can be shared with other processes
+ * (or devices) without copying.
+ *
+ * The dma-buf holds a reference to the `vm_buf` so the memory stays alive as long
+ * as the dma-buf or any mapping of it exists. Mapping the dma-buf creates a mapping
+ * of the same `vm_buf` which can be used for the transfers as usual.
+ */
+
+#include "dma_export.h"
+
+#include "buff_alloc.h"
+
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/file.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+static struct sg_table *knacs_dmabuf_map(struct dma_buf_attachment *attach,
+                                         enum dma_data_direction dir)
+{
+    struct vm_buf *vm_buf = attach->dmabuf->priv;
+    struct sg_table *sgt = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    int ret = sg_alloc_table(sgt, vm_buf->nsegs, GFP_KERNEL);
+    if (ret)
+        goto free;
+    struct scatterlist *sg;
+    unsigned int i;
+    for_each_sgtable_sg(sgt, sg, i) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        // The OCM doesn't have `struct page` backing it.
+        if (!pfn_valid(PHYS_PFN(seg->dma_addr))) {
+            ret = -EINVAL;
+            goto free_table;
+        }
+        sg_set_page(sg, pfn_to_page(PHYS_PFN(seg->dma_addr)), seg->len, 0);
+    }
+    if ((ret = dma_map_sgtable(attach->dev, sgt, dir, 0)))
+        goto free_table;
+    return sgt;
+
+free_table:
+    sg_free_table(sgt);
+free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void knacs_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                               enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static int knacs_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+    return knacs_buff_export_mmap(dmabuf->priv, vma);
+}
+
+static void knacs_dmabuf_release(struct dma_buf *dmabuf)
+{
+    knacs_buff_put(dmabuf->priv);
+}
+
+static const struct dma_buf_ops knacs_dmabuf_ops = {
+    .map_dma_buf = knacs_dmabuf_map,
+    .unmap_dma_buf = knacs_dmabuf_unmap,
+    .mmap = knacs_dmabuf_mmap,
+    .release = knacs_dmabuf_release,
+};
+
+int knacs_dma_export(struct knacs_file *kfile, knacs_buff_export_t __user *arg)
+{
+    knacs_buff_export_t exp;
+    if (copy_from_user(&exp, arg, sizeof(exp)))
+        return -EFAULT;
+    if (exp.addr != (unsigned long)exp.addr)
+        return -EINVAL;
+    size_t offset;
+    struct vm_buf *vm_buf = knacs_buff_get(exp.addr, 1, &offset);
+    if (IS_ERR(vm_buf))
+        return PTR_ERR(vm_buf);
+
+    DEFINE_DMA_BUF_EXPORT_INFO(info);
+    info.ops = &knacs_dmabuf_ops;
+    info.size = vm_buf->sz;
+    info.flags = O_RDWR;
+    info.priv = vm_buf;
+    struct dma_buf *dmabuf = dma_buf_export(&info);
+    if (IS_ERR(dmabuf)) {
+        knacs_buff_put(vm_buf);
+        return PTR_ERR(dmabuf);
+    }
+    // The dma-buf owns the reference to the buffer from now on.
+    // Only install the fd once the user has got it, so that it isn't leaked
+    // in the file table if the copy fails.
+    int fd = get_unused_fd_flags(O_CLOEXEC);
+    int ret;
+    if (fd < 0) {
+        ret = fd;
+        goto put;
+    }
+    if (copy_to_user(&arg->fd, &fd, sizeof(fd))) {
+        ret = -EFAULT;
+        goto put_fd;
+    }
+    // Another thread may close the fd (and free the buffer) once it's installed.
+    pr_debug("Exported buffer of size %lu as fd %d\n", (unsigned long)vm_buf->sz, fd);
+    fd_install(fd, dmabuf->file);
+    return 0;
+
+put_fd:
+    put_unused_fd(fd);
+put:
+    dma_buf_put(dmabuf);
+    return ret;
+}
@@ -0,0 +1,313 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-loopback): " fmt
+
+/**
+ * Software stand-in for the AXI DMA engine.
+ *
+ * When the `dma_loopback` module parameter is set, we register a platform device
+ * that runs the descriptor chains built by the driver on the CPU, copying the data
+ * into a circular sink buffer. This allows testing the DMA write path,
+ * including the queueing and the throughput of the driver side, without an FPGA.
+ *
+ * Each transfer is also sent back as one packet through the receive ring
+ * so that the read path can be tested in the same way.
+ */
+
+#include "dma_loopback.h"
+
+#include "buff_alloc.h"
+#include "dma_engine.h"
+#include "dma_rx.h"
+#include "instance.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+static bool dma_loopback = false;
+module_param(dma_loopback, bool, 0444);
+MODULE_PARM_DESC(dma_loopback, "Use a software loopback device instead of the AXI DMA");
+
+static unsigned int dma_loopback_sink_size = 1024 * 1024;
+module_param(dma_loopback_sink_size, uint, 0444);
+MODULE_PARM_DESC(dma_loopback_sink_size, "Size of the sink buffer of the loopback device");
+
+static unsigned int dma_loopback_instance = 0;
+module_param(dma_loopback_instance, uint, 0444);
+MODULE_PARM_DESC(dma_loopback_instance, "Instance the loopback device is attached to");
+
+// Use the same segment size as the hardware with the default configuration.
+#define LOOPBACK_MAX_SEG_LEN round_down((1u << 14) - 1, 64)
+
+struct knacs_dma_loopback {
+    struct knacs_dma_chan chan;
+    struct knacs_instance *inst;
+    struct work_struct work;
+    struct knacs_dma_xfer *xfer;
+    char *sink;
+    size_t sink_pos;
+    struct knacs_rx_ring *rx;
+    u32 rx_pos; // Counter of the next receive slot to fill
+    size_t rx_fill; // Number of bytes already in the slot
+    bool rx_sof; // Whether the slot starts a packet
+};
+
+static struct platform_device *loopback_pdev = NULL;
+
+static void loopback_sink(struct knacs_dma_loopback *lb, const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t sz = min(len, dma_loopback_sink_size - lb->sink_pos);
+        memcpy(lb->sink + lb->sink_pos, data, sz);
+        data += sz;
+        len -= sz;
+        lb->sink_pos = (lb->sink_pos + sz) % dma_loopback_sink_size;
+    }
+}
+
+// Finish the current receive slot.
+static void loopback_rx_commit(struct knacs_dma_loopback *lb, bool eof)
+{
+    struct knacs_rx_ring *ring = lb->rx;
+    u32 idx = lb->rx_pos & (ring->nslots - 1);
+    dma_sync_single_for_device(ring->dev, ring->slot_dma[idx], lb->rx_fill, ring->dir);
+    u32 status = KNACS_AXI_DESC_CMPLT | lb->rx_fill;
+    if (lb->rx_sof)
+        status |= KNACS_AXI_DESC_SOF;
+    if (eof)
+        status |= KNACS_AXI_DESC_EOF;
+    // The data must be visible before the status, same as the hardware.
+    dma_wmb();
+    WRITE_ONCE(ring->descs[idx].status, status);
+    lb->rx_pos++;
+    lb->rx_fill = 0;
+    lb->rx_sof = eof;
+}
+
+// Send the data to the receive ring, `eop` marks the end of the packet.
+static void loopback_rx_feed(struct knacs_dma_loopback *lb, const char *data, size_t len,
+                             bool eop)
+{
+    struct knacs_rx_ring *ring = lb->rx;
+    u32 end = knacs_rx_ring_armed_end(ring);
+    while (len > 0) {
+        if (lb->rx_pos == end) {
+            // Out of slots, let the ring collect the filled ones and give us more.
+            knacs_rx_ring_process(ring);
+            end = knacs_rx_ring_armed_end(ring);
+        }
+        u32 idx = lb->rx_pos & (ring->nslots - 1);
+        size_t sz = min_t(size_t, len, ring->slot_size - lb->rx_fill);
+        memcpy((char*)page_address(ring->slot_pages[idx]) + lb->rx_fill, data, sz);
+        lb->rx_fill += sz;
+        data += sz;
+        len -= sz;
+        if (lb->rx_fill == ring->slot_size || (eop && len == 0))
+            loopback_rx_commit(lb, eop && len == 0);
+    }
+}
+
+// Find the CPU address of the data of the descriptor.
+static const char *loopback_desc_data(struct knacs_dma_xfer *xfer, struct knacs_axi_desc *desc)
+{
+    dma_addr_t addr = (dma_addr_t)(((u64)desc->buf_addr_msb << 32) | desc->buf_addr);
+    u32 len = desc->control & KNACS_AXI_DESC_LEN_MASK;
+    size_t seg_start = 0;
+    for (unsigned int i = 0; i < xfer->buf->nsegs; i++) {
+        struct knacs_buf_seg *seg = &xfer->buf->segs[i];
+        if (addr >= seg->dma_addr && addr - seg->dma_addr + len <= seg->len) {
+            size_t offset = seg_start + (addr - seg->dma_addr);
+            if (offset < xfer->offset || offset + len > xfer->offset + xfer->len ||
+                !seg->virt_addr)
+                return NULL;
+            return (const char*)seg->virt_addr + (addr - seg->dma_addr);
+        }
+        seg_start += seg->len;
+    }
+    return NULL;
+}
+
+static void loopback_work_func(struct work_struct *work)
+{
+    struct knacs_dma_loopback *lb = container_of(work, struct knacs_dma_loopback, work);
+    struct knacs_dma_xfer *xfer = lb->xfer;
+    bool success = true;
+
+    // Walk the chain the same way the hardware would.
+    // The data is found using the CPU address of the buffer the transfer was created for.
+    for (unsigned int i = 0; i < xfer->ndescs; i++) {
+        struct knacs_axi_desc *desc = xfer->descs[i];
+        u32 len = desc->control & KNACS_AXI_DESC_LEN_MASK;
+        const char *data = loopback_desc_data(xfer, desc);
+        if (!data) {
+            desc->status = KNACS_AXI_DESC_DEC_ERR;
+            success = false;
+            break;
+        }
+        loopback_sink(lb, data, len);
+        desc->status = KNACS_AXI_DESC_CMPLT | len;
+    }
+    if (success) {
+        for (unsigned int i = 0; i < xfer->ndescs; i++) {
+            struct knacs_axi_desc *desc = xfer->descs[i];
+            loopback_rx_feed(lb, loopback_desc_data(xfer, desc),
+                             desc->control & KNACS_AXI_DESC_LEN_MASK, i == xfer->ndescs - 1);
+        }
+        knacs_rx_ring_process(lb->rx);
+    }
+    knacs_dma_chan_done(&lb->chan, success, ktime_get());
+}
+
+static void loopback_start(struct knacs_dma_chan *chan, struct knacs_dma_xfer *xfer)
+{
+    struct knacs_dma_loopback *lb = container_of(chan, struct knacs_dma_loopback, chan);
+    lb->xfer = xfer;
+    queue_work(system_highpri_wq, &lb->work);
+}
+
+static const struct knacs_dma_engine_ops loopback_ops = {
+    .start = loopback_start,
+};
+
+static void loopback_rx_start(struct knacs_rx_ring *ring, u32 head, u32 end)
+{
+    struct knacs_dma_loopback *lb = ring->priv;
+    lb->rx_pos = head;
+    lb->rx_fill = 0;
+    lb->rx_sof = true;
+}
+
+static void loopback_rx_arm(struct knacs_rx_ring *ring, u32 end)
+{
+    // The slots are filled up to `knacs_rx_ring_armed_end` so there's nothing to do.
+}
+
+static const struct knacs_rx_ring_ops loopback_rx_ops = {
+    .start = loopback_rx_start,
+    .arm = loopback_rx_arm,
+};
+
+static int knacs_dma_loopback_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    struct knacs_dma_loopback *lb = devm_kzalloc(dev, sizeof(struct knacs_dma_loopback),
+                                                 GFP_KERNEL);
+    if (!lb)
+        return -ENOMEM;
+    lb->inst = knacs_instance_get(dma_loopback_instance);
+    if (!lb->inst)
+        return -EINVAL;
+    INIT_WORK(&lb->work, loopback_work_func);
+    lb->sink = vzalloc(dma_loopback_sink_size);
+    if (!lb->sink)
+        return -ENOMEM;
+
+    int err = dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    if (err)
+        goto failed;
+    if ((err = knacs_dma_chan_init(&lb->chan, dev, &loopback_ops, LOOPBACK_MAX_SEG_LEN)))
+        goto failed;
+    // The data is written to the receive slots by the CPU.
+    lb->rx = knacs_rx_ring_create(dev, &loopback_rx_ops, LOOPBACK_MAX_SEG_LEN,
+                                  DMA_BIDIRECTIONAL);
+    if (IS_ERR(lb->rx)) {
+        err = PTR_ERR(lb->rx);
+        lb->rx = NULL;
+        goto failed_chan;
+    }
+    lb->rx->priv = lb;
+    if ((err = knacs_rx_register(lb->inst, lb->rx)))
+        goto failed_rx;
+    knacs_rx_ring_start(lb->rx);
+    if ((err = knacs_dma_register(lb->inst, &lb->chan))) {
+        knacs_rx_unregister(lb->inst, lb->rx);
+        goto failed_rx;
+    }
+    platform_set_drvdata(pdev, lb);
+    pr_info("DMA loopback probe (instance %u)\n", lb->inst->idx);
+    return 0;
+
+failed_rx:
+    knacs_rx_ring_put(lb->rx);
+failed_chan:
+    knacs_dma_chan_destroy(&lb->chan);
+failed:
+    vfree(lb->sink);
+    return err;
+}
+
+static int knacs_dma_loopback_remove(struct platform_device *pdev)
+{
+    struct knacs_dma_loopback *lb = platform_get_drvdata(pdev);
+    knacs_dma_unregister(lb->inst, &lb->chan);
+    knacs_rx_unregister(lb->inst, lb->rx);
+    cancel_work_sync(&lb->work);
+    knacs_dma_chan_destroy(&lb->chan);
+    // The pages may still be mapped by the user.
+    knacs_rx_ring_put(lb->rx);
+    vfree(lb->sink);
+    return 0;
+}
+
+static struct platform_driver knacs_dma_loopback_driver = {
+    .driver = {
+        .name = "knacs_dma_loopback",
+        .owner = THIS_MODULE,
+    },
+    .probe = knacs_dma_loopback_probe,
+    .remove = knacs_dma_loopback_remove,
+};
+
+int __init knacs_dma_loopback_init(void)
+{
+    if (!dma_loopback)
+        return 0;
+    if (dma_loopback_sink_size == 0) {
+        pr_alert("Invalid sink size\n");
+        return -EINVAL;
+    }
+
+    int err = platform_driver_register(&knacs_dma_loopback_driver);
+    if (err) {
+        pr_alert("Failed to register DMA loopback driver\n");
+        return err;
+    }
+    loopback_pdev = platform_device_register_simple("knacs_dma_loopback", -1, NULL, 0);
+    if (IS_ERR(loopback_pdev)) {
+        pr_alert("Failed to create DMA loopback device\n");
+        err = PTR_ERR(loopback_pdev);
+        loopback_pdev = NULL;
+        platform_driver_unregister(&knacs_dma_loopback_driver);
+        return err;
+    }
+    return 0;
+}
+
+void knacs_dma_loopback_exit(void)
+{
+    if (!loopback_pdev)
+        return;
+    platform_device_unregister(loopback_pdev);
+    loopback_pdev = NULL;
+    platform_driver_unregister(&knacs_dma_loopback_driver);
+}
@@ -0,0 +1,571 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-page): " fmt
+
+/**
+ * Page allocator for the DMA buffers (`knacs_dma_page` and `knacs_dma_block` in Design.md).
+ *
+ * Each buffer is made of physically contiguous chunks of pages, as large as possible
+ * (up to `KNACS_DMA_MAX_ORDER`) to minimize the number of SG descriptors needed.
+ * Freed chunks are kept in a per-order free list so that allocating and freeing
+ * a buffer normally doesn't need to go through the page allocator at all.
+ * The cache is bounded by the `dma_page_cache_size` parameter and by a shrinker
+ * that gives the memory back to the system when it's under pressure.
+ *
+ * If a DMA pool is configured (see `dma_region.c`) we first try to allocate
+ * the whole buffer contiguously from it, growing the pool if needed, and only fall back
+ * to smaller pieces and then the page allocator when that fails.
+ *
+ * The pools (including the OCM pool) use a best-fit policy so that buffers of mixed sizes
+ * don't break up the large free extents over time, which first-fit does for long running users.
+ *
+ * Freed memory is zero filled in the background before it is reused, so that allocation
+ * doesn't need to do it. The chunks waiting to be scrubbed remember their last owner
+ * and can be reused by the same owner without scrubbing if it doesn't need the memory
+ * to be zero filled. We only scrub synchronously if there's nothing clean left.
+ */
+
+#include "dma_page.h"
+
+#include "dma_region.h"
+#include "stats.h"
+
+#include <linux/bitmap.h>
+#include <linux/genalloc.h>
+#include <linux/module.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+static unsigned int dma_page_cache_size = 1024;
+module_param(dma_page_cache_size, uint, 0644);
+MODULE_PARM_DESC(dma_page_cache_size, "Maximum number of free pages kept in the DMA page cache");
+
+static bool pool_best_fit = true;
+module_param(pool_best_fit, bool, 0644);
+MODULE_PARM_DESC(pool_best_fit, "Use best-fit instead of first-fit allocation for the DMA and OCM pools");
+
+static unsigned int dma_page_prealloc = 64;
+module_param(dma_page_prealloc, uint, 0444);
+MODULE_PARM_DESC(dma_page_prealloc, "Number of pages to put in the DMA page cache at load time");
+
+static DEFINE_SPINLOCK(cache_lock);
+// Clean chunks from the page allocator.
+static struct list_head free_lists[KNACS_DMA_MAX_ORDER + 1];
+// Chunks waiting to be scrubbed, from both the page allocator and the DMA pool.
+static LIST_HEAD(dirty_list);
+// Number of pages from the page allocator in the cache, including the dirty ones.
+static unsigned long cached_pages = 0;
+// Memory from the DMA pool regions.
+static struct gen_pool *region_pool = NULL;
+
+static void dma_page_scrub_func(struct work_struct *work);
+static DECLARE_WORK(scrub_work, dma_page_scrub_func);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *dma_page_shrinker = NULL;
+#else
+static struct shrinker dma_page_shrinker_s;
+static struct shrinker *dma_page_shrinker = NULL;
+#endif
+
+static void dma_page_release(struct knacs_dma_page *dp)
+{
+    if (dp->pooled)
+        gen_pool_free(region_pool, (unsigned long)dp->data, dp->size);
+    else
+        __free_pages(dp->page, dp->order);
+    kfree(dp);
+}
+
+// Get the largest chunk in the cache that is no larger than `max_order`.
+static struct knacs_dma_page *dma_page_cache_get(unsigned int max_order)
+{
+    struct knacs_dma_page *dp = NULL;
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    for (int order = max_order; order >= 0; order--) {
+        dp = list_first_entry_or_null(&free_lists[order], struct knacs_dma_page, node);
+        if (dp) {
+            list_del(&dp->node);
+            cached_pages -= 1ul << order;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return dp;
+}
+
+// Get a chunk waiting to be scrubbed that is no larger than `max_order`
+// and last used by `owner` (or any owner if `owner` is 0).
+static struct knacs_dma_page *dma_page_dirty_get(unsigned int max_order, u64 owner)
+{
+    struct knacs_dma_page *dp = NULL, *iter;
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    list_for_each_entry(iter, &dirty_list, node) {
+        if (iter->pooled || iter->order > max_order || (owner && iter->owner != owner))
+            continue;
+        dp = iter;
+        list_del(&dp->node);
+        cached_pages -= 1ul << dp->order;
+        break;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return dp;
+}
+
+static void dma_page_scrub_func(struct work_struct *work)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    while (!list_empty(&dirty_list)) {
+        struct knacs_dma_page *dp = list_first_entry(&dirty_list, struct knacs_dma_page, node);
+        list_del(&dp->node);
+        spin_unlock_irqrestore(&cache_lock, flags);
+
+        memset(dp->data, 0, dp->size);
+        dp->owner = 0;
+        if (dp->pooled) {
+            // The gen_pool merges the free pieces for us.
+            dma_page_release(dp);
+        } else {
+            spin_lock_irqsave(&cache_lock, flags);
+            // Still counted in `cached_pages`.
+            list_add_tail(&dp->node, &free_lists[dp->order]);
+            spin_unlock_irqrestore(&cache_lock, flags);
+        }
+        cond_resched();
+        spin_lock_irqsave(&cache_lock, flags);
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+}
+
+static struct knacs_dma_page *dma_page_new(unsigned int order)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_NOWARN | __GFP_ZERO;
+    // Don't try too hard for the high order ones since we can always use smaller chunks.
+    if (order > 0)
+        gfp |= __GFP_COMP | __GFP_NORETRY;
+    struct page *page = alloc_pages(gfp, order);
+    if (!page)
+        return NULL;
+    struct knacs_dma_page *dp = kmalloc(sizeof(struct knacs_dma_page), GFP_KERNEL);
+    if (!dp) {
+        __free_pages(page, order);
+        return NULL;
+    }
+    dp->page = page;
+    dp->order = order;
+    dp->pooled = false;
+    dp->size = PAGE_SIZE << order;
+    dp->owner = 0;
+    dp->data = page_address(page);
+    dp->dma_addr = page_to_phys(page);
+    return dp;
+}
+
+// Best-fit version of `gen_pool_first_fit_align`. Among the aligned free ranges
+// in the chunk that are large enough, pick the one with the least free space after it.
+static unsigned long pool_best_fit_align(unsigned long *map, unsigned long size,
+                                         unsigned long start, unsigned int nr, void *data,
+                                         struct gen_pool *pool, unsigned long start_addr)
+{
+    struct genpool_data_align *alignment = data;
+    int order = pool->min_alloc_order;
+    unsigned long align_mask = ((alignment->align + (1UL << order) - 1) >> order) - 1;
+    unsigned long offset_bit = (start_addr & (alignment->align - 1)) >> order;
+    unsigned long best = size;
+    unsigned long best_len = ULONG_MAX;
+    unsigned long index = bitmap_find_next_zero_area_off(map, size, start, nr,
+                                                         align_mask, offset_bit);
+    while (index < size) {
+        unsigned long next_bit = find_next_bit(map, size, index + nr);
+        if (next_bit - index < best_len) {
+            best_len = next_bit - index;
+            best = index;
+            // Exact fit, can't do better.
+            if (best_len == nr)
+                break;
+        }
+        index = bitmap_find_next_zero_area_off(map, size, next_bit + 1, nr,
+                                               align_mask, offset_bit);
+    }
+    return best;
+}
+
+unsigned long knacs_gen_pool_alloc(struct gen_pool *pool, size_t size, size_t align)
+{
+    struct genpool_data_align data = { .align = align };
+    return gen_pool_alloc_algo(pool, size, READ_ONCE(pool_best_fit) ? pool_best_fit_align :
+                               gen_pool_first_fit_align, &data);
+}
+
+struct gen_pool *knacs_dma_page_pool(void)
+{
+    return region_pool;
+}
+
+int knacs_dma_page_pool_reset(void)
+{
+    // Freed chunks are only returned to the pool after they are scrubbed.
+    flush_work(&scrub_work);
+    if (gen_pool_avail(region_pool) != gen_pool_size(region_pool))
+        return -EBUSY;
+    // There's no way to remove a chunk from a gen_pool so start over with an empty one.
+    // The regions are only removed when unloading so nothing can be allocating concurrently.
+    struct gen_pool *pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
+    if (!pool)
+        return -ENOMEM;
+    gen_pool_destroy(region_pool);
+    region_pool = pool;
+    return 0;
+}
+
+static struct knacs_dma_page *dma_page_pool_alloc(size_t size, size_t align)
+{
+    unsigned long virt_addr = knacs_gen_pool_alloc(region_pool, size, align);
+    if (!virt_addr)
+        return NULL;
+    struct knacs_dma_page *dp = kmalloc(sizeof(struct knacs_dma_page), GFP_KERNEL);
+    if (!dp) {
+        gen_pool_free(region_pool, virt_addr, size);
+        return NULL;
+    }
+    phys_addr_t phys_addr = gen_pool_virt_to_phys(region_pool, virt_addr);
+    dp->page = pfn_valid(PHYS_PFN(phys_addr)) ? pfn_to_page(PHYS_PFN(phys_addr)) : NULL;
+    dp->order = 0;
+    dp->pooled = true;
+    dp->size = size;
+    dp->owner = 0;
+    dp->data = (void*)virt_addr;
+    dp->dma_addr = phys_addr;
+    return dp;
+}
+
+int knacs_dma_page_grow(size_t min_size)
+{
+    struct knacs_dma_region *region = knacs_dma_region_grow(min_size);
+    if (!region)
+        return -ENOMEM;
+    int err = gen_pool_add_virt(region_pool, (unsigned long)region->virt_addr,
+                                region->phys_addr, region->size, -1);
+    if (err)
+        pr_alert("Unable to add region to the DMA pool %d\n", err);
+    return err;
+}
+
+// Allocate as much as possible of the next `size` bytes of the block from the DMA pool.
+// Returns the number of pages allocated.
+static size_t dma_page_block_from_pool(struct knacs_dma_block *block, size_t size)
+{
+    if (!gen_pool_size(region_pool) && knacs_dma_page_grow(size))
+        return 0;
+    struct knacs_dma_page *dp = dma_page_pool_alloc(size, PAGE_SIZE);
+    if (!dp) {
+        // Some memory might be waiting to be scrubbed.
+        flush_work(&scrub_work);
+        dp = dma_page_pool_alloc(size, PAGE_SIZE);
+    }
+    if (!dp && !knacs_dma_page_grow(size))
+        dp = dma_page_pool_alloc(size, PAGE_SIZE);
+    if (dp) {
+        list_add_tail(&dp->node, &block->pages);
+        block->npages++;
+        return size >> PAGE_SHIFT;
+    }
+
+    // Unable to find a contiguous piece, collect whatever we can find from the pool,
+    // largest pieces first.
+    size_t remaining = size;
+    size_t piece = remaining;
+    while (remaining > 0) {
+        dp = dma_page_pool_alloc(piece, PAGE_SIZE);
+        if (dp) {
+            list_add_tail(&dp->node, &block->pages);
+            block->npages++;
+            remaining -= piece;
+            piece = min(piece, remaining);
+        } else if (piece == PAGE_SIZE) {
+            break;
+        } else {
+            piece = max_t(size_t, PAGE_SIZE, round_down(piece / 2, PAGE_SIZE));
+        }
+    }
+    return (size - remaining) >> PAGE_SHIFT;
+}
+
+// Allocate the leading part of the block in PMD sized and aligned chunks
+// so that it can be mapped with huge pages. Stops at the first failure.
+// Returns the number of pages allocated.
+static size_t dma_page_block_huge(struct knacs_dma_block *block)
+{
+    size_t nhuge = block->size >> PMD_SHIFT;
+    size_t i;
+    for (i = 0; i < nhuge; i++) {
+        struct knacs_dma_page *dp = NULL;
+        if (knacs_dma_region_enabled()) {
+            dp = dma_page_pool_alloc(PMD_SIZE, PMD_SIZE);
+            if (!dp && !knacs_dma_page_grow((nhuge - i) * PMD_SIZE))
+                dp = dma_page_pool_alloc(PMD_SIZE, PMD_SIZE);
+        }
+        // These are never cached (larger than `KNACS_DMA_MAX_ORDER`)
+        // so they always come from the page allocator.
+        if (!dp)
+            dp = dma_page_new(PMD_SHIFT - PAGE_SHIFT);
+        if (!dp)
+            break;
+        list_add_tail(&dp->node, &block->pages);
+        block->npages++;
+    }
+    return i << (PMD_SHIFT - PAGE_SHIFT);
+}
+
+static void dma_page_put(struct knacs_dma_page *dp, u64 owner)
+{
+    dp->owner = owner;
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    if (dp->pooled) {
+        list_add_tail(&dp->node, &dirty_list);
+        dp = NULL;
+    } else if (dp->order <= KNACS_DMA_MAX_ORDER && cached_pages + (1ul << dp->order) <= READ_ONCE(dma_page_cache_size)) {
+        list_add_tail(&dp->node, &dirty_list);
+        cached_pages += 1ul << dp->order;
+        dp = NULL;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    if (dp) {
+        // No need to scrub the pages we give back to the system.
+        dma_page_release(dp);
+    } else {
+        queue_work(system_unbound_wq, &scrub_work);
+    }
+}
+
+struct knacs_dma_block *knacs_dma_block_alloc(size_t size, u64 owner, bool zero, bool huge)
+{
+    if (size == 0 || !PAGE_ALIGNED(size))
+        return NULL;
+    struct knacs_dma_block *block = kmalloc(sizeof(struct knacs_dma_block), GFP_KERNEL);
+    if (!block)
+        return NULL;
+    INIT_LIST_HEAD(&block->pages);
+    block->npages = 0;
+    block->size = size;
+    block->owner = owner;
+
+    size_t remaining = size >> PAGE_SHIFT;
+    if (huge)
+        remaining -= dma_page_block_huge(block);
+    if (remaining > 0 && knacs_dma_region_enabled())
+        remaining -= dma_page_block_from_pool(block, remaining << PAGE_SHIFT);
+    // Highest order worth trying with the page allocator.
+    // Lowered every time it fails so that we don't keep hitting the slow path.
+    unsigned int new_order = KNACS_DMA_MAX_ORDER;
+    while (remaining > 0) {
+        unsigned int order = min_t(unsigned int, __fls(remaining), KNACS_DMA_MAX_ORDER);
+        struct knacs_dma_page *dp = dma_page_cache_get(order);
+        if (!dp && !zero)
+            dp = dma_page_dirty_get(order, owner);
+        if (!dp && (dp = dma_page_dirty_get(order, 0))) {
+            // Don't wait for the scrubber.
+            memset(dp->data, 0, dp->size);
+            dp->owner = 0;
+        }
+        if (!dp) {
+            new_order = min(new_order, order);
+            while (!(dp = dma_page_new(new_order)) && new_order > 0)
+                new_order--;
+        }
+        if (!dp) {
+            pr_debug("Unable to allocate DMA pages\n");
+            knacs_dma_block_free(block);
+            return NULL;
+        }
+        list_add_tail(&dp->node, &block->pages);
+        block->npages++;
+        remaining -= 1ul << dp->order;
+    }
+    return block;
+}
+
+void knacs_dma_block_free(struct knacs_dma_block *block)
+{
+    struct knacs_dma_page *dp, *next;
+    list_for_each_entry_safe(dp, next, &block->pages, node) {
+        list_del(&dp->node);
+        dma_page_put(dp, block->owner);
+    }
+    kfree(block);
+}
+
+void knacs_dma_page_show(struct seq_file *m)
+{
+    unsigned int nclean[KNACS_DMA_MAX_ORDER + 1] = {};
+    unsigned int ndirty = 0;
+    size_t dirty_size = 0;
+    unsigned long cached;
+    struct knacs_dma_page *dp;
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    for (unsigned int order = 0; order <= KNACS_DMA_MAX_ORDER; order++) {
+        list_for_each_entry(dp, &free_lists[order], node)
+            nclean[order]++;
+    }
+    list_for_each_entry(dp, &dirty_list, node) {
+        ndirty++;
+        dirty_size += dp->size;
+    }
+    cached = cached_pages;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    seq_printf(m, "Page cache: %lu/%u pages\n", cached, READ_ONCE(dma_page_cache_size));
+    for (unsigned int order = 0; order <= KNACS_DMA_MAX_ORDER; order++)
+        seq_printf(m, "    order %u: %u clean\n", order, nclean[order]);
+    seq_printf(m, "    waiting to be scrubbed: %u chunks, %zu bytes\n", ndirty, dirty_size);
+    knacs_gen_pool_show(m, "DMA pool", region_pool);
+}
+
+static unsigned long dma_page_shrink_count(struct shrinker *shrinker,
+                                           struct shrink_control *sc)
+{
+    return READ_ONCE(cached_pages);
+}
+
+static unsigned long dma_page_shrink_scan(struct shrinker *shrinker,
+                                          struct shrink_control *sc)
+{
+    LIST_HEAD(freed_list);
+    unsigned long freed = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&cache_lock, flags);
+    // The dirty chunks don't need to be scrubbed before we give them back.
+    struct knacs_dma_page *dp, *next;
+    list_for_each_entry_safe(dp, next, &dirty_list, node) {
+        if (freed >= sc->nr_to_scan)
+            break;
+        if (dp->pooled)
+            continue;
+        list_move(&dp->node, &freed_list);
+        cached_pages -= 1ul << dp->order;
+        freed += 1ul << dp->order;
+    }
+    // Give back the small chunks first since the large ones are harder to get back.
+    for (unsigned int order = 0; order <= KNACS_DMA_MAX_ORDER; order++) {
+        while (freed < sc->nr_to_scan && !list_empty(&free_lists[order])) {
+            list_move(free_lists[order].next, &freed_list);
+            cached_pages -= 1ul << order;
+            freed += 1ul << order;
+        }
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    list_for_each_entry_safe(dp, next, &freed_list, node)
+        dma_page_release(dp);
+    return freed ? freed : SHRINK_STOP;
+}
+
+static void dma_page_drain(void)
+{
+    flush_work(&scrub_work);
+    for (unsigned int order = 0; order <= KNACS_DMA_MAX_ORDER; order++) {
+        struct knacs_dma_page *dp, *next;
+        list_for_each_entry_safe(dp, next, &free_lists[order], node) {
+            list_del(&dp->node);
+            dma_page_release(dp);
+        }
+    }
+    cached_pages = 0;
+}
+
+int __init knacs_dma_page_init(void)
+{
+    for (unsigned int order = 0; order <= KNACS_DMA_MAX_ORDER; order++)
+        INIT_LIST_HEAD(&free_lists[order]);
+    region_pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
+    if (!region_pool)
+        return -ENOMEM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    dma_page_shrinker = shrinker_alloc(0, "knacs-dma-page");
+    if (!dma_page_shrinker) {
+        gen_pool_destroy(region_pool);
+        return -ENOMEM;
+    }
+    dma_page_shrinker->count_objects = dma_page_shrink_count;
+    dma_page_shrinker->scan_objects = dma_page_shrink_scan;
+    dma_page_shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(dma_page_shrinker);
+#else
+    dma_page_shrinker_s.count_objects = dma_page_shrink_count;
+    dma_page_shrinker_s.scan_objects = dma_page_shrink_scan;
+    dma_page_shrinker_s.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    int err = register_shrinker(&dma_page_shrinker_s, "knacs-dma-page");
+#else
+    int err = register_shrinker(&dma_page_shrinker_s);
+#endif
+    if (err) {
+        gen_pool_destroy(region_pool);
+        return err;
+    }
+    dma_page_shrinker = &dma_page_shrinker_s;
+#endif
+
+    // Warm up the cache, with as large chunks as possible.
+    // Failing this is not fatal, we'll simply allocate the pages later.
+    unsigned long allocated = 0;
+    unsigned int order = KNACS_DMA_MAX_ORDER;
+    while (allocated < dma_page_prealloc) {
+        order = min_t(unsigned int, order, __fls(dma_page_prealloc - allocated));
+        struct knacs_dma_page *dp = dma_page_new(order);
+        if (!dp) {
+            if (order == 0)
+                break;
+            order--;
+            continue;
+        }
+        allocated += 1ul << order;
+        // Newly allocated pages are already clean.
+        list_add(&dp->node, &free_lists[order]);
+        cached_pages += 1ul << order;
+    }
+    pr_info("Cached %lu pages\n", cached_pages);
+    return 0;
+}
+
+void knacs_dma_page_exit(void)
+{
+    if (dma_page_shrinker) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+        shrinker_free(dma_page_shrinker);
+#else
+        unregister_shrinker(dma_page_shrinker);
+#endif
+        dma_page_shrinker = NULL;
+    }
+    dma_page_drain();
+    // All the buffers must have been freed by now.
+    gen_pool_destroy(region_pool);
+    region_pool = NULL;
+}
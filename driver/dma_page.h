@@ -0,0 +1,80 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_PAGE_H__
+#define __KNACS_DMA_PAGE_H__
+
+#include <linux/genalloc.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+
+// Largest chunk we try to allocate, 64 pages.
+#define KNACS_DMA_MAX_ORDER 6
+
+// A physically contiguous chunk of pages, either `1 << order` pages from the page allocator
+// or any number of pages from the DMA pool (when `pooled` is set).
+// Free chunks from the page allocator are kept (with this struct)
+// in the page cache for fast reuse.
+struct knacs_dma_page {
+    struct list_head node; // For chaining into a block or the free list
+    struct page *page;
+    unsigned int order;
+    bool pooled;
+    size_t size;
+    u64 owner; // The owner of the data in the chunk, if not scrubbed yet
+    void *data;
+    dma_addr_t dma_addr;
+};
+
+// The memory backing a buffer, made of one or more chunks of pages.
+struct knacs_dma_block {
+    struct list_head pages;
+    unsigned int npages; // Number of chunks
+    size_t size;
+    u64 owner;
+};
+
+int knacs_dma_page_init(void);
+void knacs_dma_page_exit(void);
+
+// `size` must be a multiple of the page size. `owner` is a non-zero ID
+// of the user of the block. The memory is zero filled unless `zero` is false,
+// in which case it may also contain the data from a previous block of the same owner.
+// With `huge`, the block starts with as many PMD sized and aligned chunks as we can get.
+struct knacs_dma_block *knacs_dma_block_alloc(size_t size, u64 owner, bool zero, bool huge);
+// Safe to be called from interrupt context.
+void knacs_dma_block_free(struct knacs_dma_block*);
+
+// Add a region of at least `min_size` bytes to the DMA pool. May sleep.
+int knacs_dma_page_grow(size_t min_size);
+// The DMA pool. The pages come from the page allocator as well when it's exhausted.
+struct gen_pool *knacs_dma_page_pool(void);
+// Drop all the regions from the DMA pool before they are freed.
+// Returns -EBUSY if any memory from the pool is still in use.
+int knacs_dma_page_pool_reset(void);
+
+// Allocate `size` bytes aligned to `align` (a power of 2) from a pool (the DMA pool or the OCM)
+// with the allocation policy set by the `pool_best_fit` parameter. Returns 0 on failure.
+unsigned long knacs_gen_pool_alloc(struct gen_pool*, size_t size, size_t align);
+
+// Print the statistics of the page cache and the DMA pool for debugfs.
+void knacs_dma_page_show(struct seq_file*);
+
+#endif
@@ -0,0 +1,181 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-pin): " fmt
+
+/**
+ * Transfers directly from user memory that isn't a buffer of the device.
+ *
+ * The pages are pinned and mapped for the device only for the duration of the transfer
+ * and are described by a `vm_buf` with one segment per DMA-contiguous run so that
+ * the rest of the DMA code handles it like any other buffer. The pages are unmapped
+ * and unpinned when the last reference to the `vm_buf` is released.
+ */
+
+#include "dma_pin.h"
+
+#include "buff_alloc.h"
+#include "dma_engine.h"
+#include "event.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/overflow.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+static unsigned long dma_pin_max_size = 64 * 1024 * 1024;
+module_param(dma_pin_max_size, ulong, 0644);
+MODULE_PARM_DESC(dma_pin_max_size, "Maximum size of a transfer from pinned user memory");
+
+struct knacs_user_pin {
+    struct llist_node free_node;
+    struct device *dev;
+    struct sg_table sgt;
+    unsigned int npages;
+    struct page *pages[];
+};
+
+// Unpinning may need to take locks that can't be taken in interrupt context.
+static LLIST_HEAD(pin_free_list);
+static void pin_free_work_func(struct work_struct*);
+static DECLARE_WORK(pin_free_work, pin_free_work_func);
+
+static void pin_free_work_func(struct work_struct *work)
+{
+    struct llist_node *list = llist_del_all(&pin_free_list);
+    struct knacs_user_pin *pin, *next;
+    llist_for_each_entry_safe(pin, next, list, free_node) {
+        // The device only read from the pages so they don't need to be dirtied.
+        dma_unmap_sgtable(pin->dev, &pin->sgt, DMA_TO_DEVICE, 0);
+        sg_free_table(&pin->sgt);
+        unpin_user_pages(pin->pages, pin->npages);
+        put_device(pin->dev);
+        kvfree(pin);
+    }
+}
+
+void knacs_dma_pin_release(struct knacs_user_pin *pin)
+{
+    if (llist_add(&pin->free_node, &pin_free_list))
+        schedule_work(&pin_free_work);
+}
+
+static struct vm_buf *knacs_dma_pin(struct device *dev, unsigned long start,
+                                    unsigned int npages)
+{
+    struct knacs_user_pin *pin = kvzalloc(struct_size(pin, pages, npages), GFP_KERNEL);
+    if (!pin)
+        return ERR_PTR(-ENOMEM);
+    int ret;
+    int pinned = pin_user_pages_fast(start, npages, 0, pin->pages);
+    if (pinned < 0) {
+        ret = pinned;
+        goto free;
+    }
+    pin->npages = pinned;
+    if (pinned < npages) {
+        ret = -EFAULT;
+        goto unpin;
+    }
+    ret = sg_alloc_table_from_pages(&pin->sgt, pin->pages, npages, 0,
+                                    (size_t)npages << PAGE_SHIFT, GFP_KERNEL);
+    if (ret)
+        goto unpin;
+    // This also cleans the cache for the pages.
+    if ((ret = dma_map_sgtable(dev, &pin->sgt, DMA_TO_DEVICE, 0)))
+        goto free_table;
+
+    struct vm_buf *vm_buf = kzalloc(struct_size(vm_buf, segs, pin->sgt.nents), GFP_KERNEL);
+    if (!vm_buf) {
+        ret = -ENOMEM;
+        goto unmap;
+    }
+    pin->dev = get_device(dev);
+    vm_buf->pin = pin;
+    vm_buf->sz = (size_t)npages << PAGE_SHIFT;
+    refcount_set(&vm_buf->refcnt, 1);
+    vm_buf->nsegs = pin->sgt.nents;
+    // Already in sync with the memory after the mapping.
+    vm_buf->cache_mode = KNACS_ALLOC_UNCACHED;
+    // The CPU address is only known (and only needed by the loopback engine)
+    // if the DMA segments are the same as the pages (i.e. there's no IOMMU merging them)
+    // and the pages are in the kernel mapping.
+    bool same = pin->sgt.nents == pin->sgt.orig_nents;
+    struct scatterlist *sg;
+    unsigned int i;
+    for_each_sgtable_dma_sg(&pin->sgt, sg, i) {
+        struct knacs_buf_seg *seg = &vm_buf->segs[i];
+        seg->dma_addr = sg_dma_address(sg);
+        seg->len = sg_dma_len(sg);
+        if (same && !PageHighMem(sg_page(sg)))
+            seg->virt_addr = sg_virt(sg);
+    }
+    return vm_buf;
+
+unmap:
+    dma_unmap_sgtable(dev, &pin->sgt, DMA_TO_DEVICE, 0);
+free_table:
+    sg_free_table(&pin->sgt);
+unpin:
+    unpin_user_pages(pin->pages, pin->npages);
+free:
+    kvfree(pin);
+    return ERR_PTR(ret);
+}
+
+int knacs_dma_submit_user(struct knacs_file *kfile, knacs_dma_submit_t __user *arg)
+{
+    knacs_dma_submit_t submit;
+    if (copy_from_user(&submit, arg, sizeof(submit)))
+        return -EFAULT;
+    struct device *dev = knacs_dma_device(kfile->inst);
+    if (!dev)
+        return -ENODEV;
+    if (submit.len == 0 || submit.len > READ_ONCE(dma_pin_max_size) ||
+        submit.addr != (unsigned long)submit.addr || submit.addr + submit.len < submit.addr)
+        return -EINVAL;
+    size_t offset = offset_in_page(submit.addr);
+    unsigned long npages = PAGE_ALIGN(offset + submit.len) >> PAGE_SHIFT;
+    if (npages > INT_MAX)
+        return -EINVAL;
+    struct vm_buf *buf = knacs_dma_pin(dev, submit.addr - offset, npages);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    int ret = knacs_dma_submit_buf(kfile, buf, offset, submit.len, NULL, &submit.token);
+    knacs_buff_put(buf);
+    if (ret)
+        return ret;
+    pr_debug("Submitted transfer %llu of size %llu from pinned user memory at 0x%llx\n",
+             (unsigned long long)submit.token, (unsigned long long)submit.len,
+             (unsigned long long)submit.addr);
+    if (copy_to_user(&arg->token, &submit.token, sizeof(submit.token)))
+        return -EFAULT;
+    return 0;
+}
+
+void knacs_dma_pin_exit(void)
+{
+    flush_work(&pin_free_work);
+}
@@ -0,0 +1,37 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_PIN_H__
+#define __KNACS_DMA_PIN_H__
+
+#include "knacs.h"
+
+struct knacs_file;
+struct knacs_user_pin;
+
+// Pin the user buffer in the argument and submit it to the DMA channel directly.
+int knacs_dma_submit_user(struct knacs_file*, knacs_dma_submit_t __user *arg);
+// Unmap and unpin the pages. The work is deferred to a workqueue so this is
+// safe to be called from interrupt context (i.e. when the last transfer finishes).
+void knacs_dma_pin_release(struct knacs_user_pin *pin);
+// Wait for the pending releases, called when unloading the module
+// after the DMA engines are gone.
+void knacs_dma_pin_exit(void);
+
+#endif
@@ -0,0 +1,313 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-region): " fmt
+
+/**
+ * Backing memory for the DMA pool.
+ *
+ * The DMA page cache gets memory from the page allocator by default, which
+ * gives us at most `1 << KNACS_DMA_MAX_ORDER` contiguous pages at a time and may not be
+ * able to give us much on a fragmented system. For long sequences we can instead grow
+ * a dedicated pool in large chunks (at least `dma_pool_chunk_size`) from,
+ *
+ * 1. The reserved memory referenced by the `memory-region` of a `nacs,dma-pool`
+ *    device tree node. If the region is reusable (i.e. a CMA area) the chunks are allocated
+ *    from it with the DMA API, otherwise the whole region is mapped and handed out directly.
+ *
+ * 2. The default CMA area, if `dma_pool_max_size` is set and there's no device tree node.
+ *
+ * The first `dma_pool_size` bytes are allocated at load time and more is allocated
+ * on demand up to `dma_pool_max_size` (or the size of the reserved region).
+ */
+
+#include "dma_region.h"
+
+#include "dma_page.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/io.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+static unsigned long dma_pool_size = 0;
+module_param(dma_pool_size, ulong, 0444);
+MODULE_PARM_DESC(dma_pool_size, "Size of the DMA pool allocated at load time (bytes)");
+
+static unsigned long dma_pool_max_size = 0;
+module_param(dma_pool_max_size, ulong, 0444);
+MODULE_PARM_DESC(dma_pool_max_size,
+                 "Maximum size the DMA pool can grow to (bytes, 0 for the reserved region size)");
+
+static unsigned long dma_pool_chunk_size = 4 * 1024 * 1024;
+module_param(dma_pool_chunk_size, ulong, 0644);
+MODULE_PARM_DESC(dma_pool_chunk_size, "Size of each allocation when growing the DMA pool (bytes)");
+
+enum region_kind {
+    REGION_NONE,
+    REGION_CMA, // Allocated with the DMA API, from the device or the default CMA area
+    REGION_RESERVED, // Carved out of a mapped reserved memory region
+};
+
+static DEFINE_MUTEX(region_lock);
+static LIST_HEAD(regions);
+static struct device *region_dev = NULL;
+static enum region_kind region_kind = REGION_NONE;
+static size_t region_limit = 0;
+static size_t region_total = 0;
+// For `REGION_RESERVED`
+static void *rsv_virt = NULL;
+static phys_addr_t rsv_base = 0;
+
+static struct platform_device *region_pdev = NULL;
+
+struct knacs_dma_region *knacs_dma_region_grow(size_t min_size)
+{
+    mutex_lock(&region_lock);
+    struct knacs_dma_region *region = NULL;
+    if (region_kind == REGION_NONE)
+        goto out;
+    size_t size = max_t(size_t, dma_pool_chunk_size, min_size);
+    size = round_down(min_t(size_t, size, region_limit - region_total), PAGE_SIZE);
+    if (!size || size < min_size)
+        goto out;
+    region = kzalloc(sizeof(struct knacs_dma_region), GFP_KERNEL);
+    if (!region)
+        goto out;
+    region->size = size;
+
+    if (region_kind == REGION_RESERVED) {
+        region->virt_addr = (char*)rsv_virt + region_total;
+        region->phys_addr = rsv_base + region_total;
+        region->dma_addr = region->phys_addr;
+        if (pfn_valid(PHYS_PFN(region->phys_addr)))
+            region->page = pfn_to_page(PHYS_PFN(region->phys_addr));
+    } else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+        region->page = dma_alloc_pages(region_dev, size, &region->dma_addr,
+                                       DMA_BIDIRECTIONAL, GFP_KERNEL | __GFP_NOWARN);
+#else
+        // No way to allocate cached memory from CMA, use the page allocator instead.
+        void *virt_addr = alloc_pages_exact(size, GFP_KERNEL | __GFP_NOWARN);
+        region->page = virt_addr ? virt_to_page(virt_addr) : NULL;
+#endif
+        if (!region->page) {
+            pr_warn("Unable to grow DMA pool by %zu bytes\n", size);
+            kfree(region);
+            region = NULL;
+            goto out;
+        }
+        region->virt_addr = page_address(region->page);
+        region->phys_addr = page_to_phys(region->page);
+    }
+    // The pool only hands out clean memory. Freed memory is scrubbed in the background.
+    memset(region->virt_addr, 0, size);
+    list_add_tail(&region->node, &regions);
+    region_total += size;
+    pr_debug("Grew DMA pool by %zu bytes @ 0x%lx, %zu bytes in total\n",
+             size, (unsigned long)region->phys_addr, region_total);
+out:
+    mutex_unlock(&region_lock);
+    return region;
+}
+
+bool knacs_dma_region_enabled(void)
+{
+    return READ_ONCE(region_kind) != REGION_NONE;
+}
+
+size_t knacs_dma_region_size(void)
+{
+    return READ_ONCE(region_total);
+}
+
+static void region_free_all(void)
+{
+    struct knacs_dma_region *region, *next;
+    list_for_each_entry_safe(region, next, &regions, node) {
+        list_del(&region->node);
+        if (region_kind == REGION_CMA) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+            dma_free_pages(region_dev, region->size, region->page, region->dma_addr,
+                           DMA_BIDIRECTIONAL);
+#else
+            free_pages_exact(region->virt_addr, region->size);
+#endif
+        }
+        kfree(region);
+    }
+    region_total = 0;
+}
+
+static int region_setup_reserved(struct device *dev, struct device_node *rmem_np)
+{
+    struct reserved_mem *rmem = of_reserved_mem_lookup(rmem_np);
+    if (!rmem) {
+        pr_alert("Unable to find reserved memory region\n");
+        return -EINVAL;
+    }
+    if (of_property_read_bool(rmem_np, "reusable")) {
+        // CMA area, let the DMA API manage it.
+        int err = of_reserved_mem_device_init(dev);
+        if (err) {
+            pr_alert("Unable to use reserved memory region\n");
+            return err;
+        }
+        region_kind = REGION_CMA;
+    } else {
+        rsv_virt = memremap(rmem->base, rmem->size, MEMREMAP_WB);
+        if (!rsv_virt) {
+            pr_alert("Unable to map reserved memory region\n");
+            return -ENOMEM;
+        }
+        rsv_base = rmem->base;
+        region_kind = REGION_RESERVED;
+    }
+    region_limit = rmem->size;
+    if (dma_pool_max_size)
+        region_limit = min_t(size_t, region_limit, dma_pool_max_size);
+    pr_info("Using reserved memory region of %lu bytes @ 0x%lx\n",
+            (unsigned long)rmem->size, (unsigned long)rmem->base);
+    return 0;
+}
+
+static int knacs_dma_region_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    if (region_dev) {
+        pr_alert("Only one DMA pool is allowed\n");
+        return -EBUSY;
+    }
+
+    int err;
+    struct device_node *rmem_np = dev->of_node ?
+        of_parse_phandle(dev->of_node, "memory-region", 0) : NULL;
+    if (rmem_np) {
+        err = region_setup_reserved(dev, rmem_np);
+        of_node_put(rmem_np);
+        if (err)
+            return err;
+        err = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    } else {
+        // Default CMA area.
+        region_kind = REGION_CMA;
+        region_limit = dma_pool_max_size;
+        err = dev->of_node ? dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32)) :
+            dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    }
+    if (err)
+        goto failed;
+    region_dev = dev;
+
+    while (region_total < dma_pool_size) {
+        if ((err = knacs_dma_page_grow(0))) {
+            pr_alert("Unable to allocate %lu bytes for the DMA pool, %zu allocated\n",
+                     dma_pool_size, region_total);
+            break;
+        }
+    }
+    pr_info("DMA pool probe\n");
+    pr_info("    size %zu, limit %zu\n", region_total, region_limit);
+    return 0;
+
+failed:
+    if (region_kind == REGION_RESERVED)
+        memunmap(rsv_virt);
+    else if (rmem_np)
+        of_reserved_mem_device_release(dev);
+    rsv_virt = NULL;
+    region_kind = REGION_NONE;
+    return err;
+}
+
+static int knacs_dma_region_remove(struct platform_device *pdev)
+{
+    mutex_lock(&region_lock);
+    // The chunks must be out of the DMA pool before the memory goes away.
+    int err = knacs_dma_page_pool_reset();
+    if (err) {
+        mutex_unlock(&region_lock);
+        // Leak the regions rather than freeing memory that is still in use.
+        pr_alert("Unable to release the DMA pool, still in use\n");
+        return err;
+    }
+    enum region_kind kind = region_kind;
+    region_free_all();
+    region_kind = REGION_NONE;
+    mutex_unlock(&region_lock);
+    if (kind == REGION_RESERVED)
+        memunmap(rsv_virt);
+    else if (pdev->dev.of_node)
+        of_reserved_mem_device_release(&pdev->dev);
+    rsv_virt = NULL;
+    region_dev = NULL;
+    return 0;
+}
+
+static const struct of_device_id knacs_dma_region_of_ids[] = {
+    { .compatible = "nacs,dma-pool",},
+    {}
+};
+
+static struct platform_driver knacs_dma_region_driver = {
+    .driver = {
+        .name = "knacs_dma_region",
+        .owner = THIS_MODULE,
+        .of_match_table = knacs_dma_region_of_ids,
+        // The memory can't be released while the buffers are still in use.
+        .suppress_bind_attrs = true,
+    },
+    .probe = knacs_dma_region_probe,
+    .remove = knacs_dma_region_remove,
+};
+
+int __init knacs_dma_region_init(void)
+{
+    int err = platform_driver_register(&knacs_dma_region_driver);
+    if (err) {
+        pr_alert("Failed to register DMA pool driver\n");
+        return err;
+    }
+    // Use the default CMA area if there's no device tree node and we are asked to.
+    if (!region_dev && (dma_pool_size || dma_pool_max_size)) {
+        if (dma_pool_max_size < dma_pool_size)
+            dma_pool_max_size = dma_pool_size;
+        region_pdev = platform_device_register_simple("knacs_dma_region", -1, NULL, 0);
+        if (IS_ERR(region_pdev)) {
+            // Not fatal, we can still use the page allocator.
+            pr_alert("Failed to create DMA pool device\n");
+            region_pdev = NULL;
+        }
+    }
+    return 0;
+}
+
+void knacs_dma_region_exit(void)
+{
+    if (region_pdev) {
+        platform_device_unregister(region_pdev);
+        region_pdev = NULL;
+    }
+    platform_driver_unregister(&knacs_dma_region_driver);
+}
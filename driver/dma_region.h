@@ -0,0 +1,48 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_REGION_H__
+#define __KNACS_DMA_REGION_H__
+
+#include <linux/list.h>
+#include <linux/mm.h>
+
+// A large physically contiguous piece of the DMA pool.
+// It is never freed until the module is unloaded.
+struct knacs_dma_region {
+    struct list_head node;
+    struct page *page; // NULL for reserved memory without `struct page`
+    void *virt_addr;
+    phys_addr_t phys_addr;
+    dma_addr_t dma_addr; // As returned by the DMA API, only used to free the region
+    size_t size;
+};
+
+int knacs_dma_region_init(void);
+void knacs_dma_region_exit(void);
+
+// Allocate a new region of at least `min_size` bytes for the pool.
+// Returns NULL if the pool can't grow anymore. May sleep.
+struct knacs_dma_region *knacs_dma_region_grow(size_t min_size);
+// Whether a DMA pool is configured.
+bool knacs_dma_region_enabled(void);
+// The total size of the regions allocated so far.
+size_t knacs_dma_region_size(void);
+
+#endif
@@ -0,0 +1,341 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-rx): " fmt
+
+/**
+ * Receive (S2MM) ring for the data from the FPGA.
+ *
+ * The ring is a circular SG descriptor chain with one (physically contiguous) slot
+ * per descriptor that the hardware fills continuously. The slots are mapped to the user
+ * together with a header page that contains the producer/consumer counters and the
+ * length and flags of each slot so that the user can consume the data without any syscall.
+ *
+ * The hardware owns the slots between the head and the tail descriptor.
+ * Whenever the user consumes some slots they are given back to the hardware
+ * the next time we process the ring (i.e. on the next interrupt). In order not to stall
+ * the hardware, we always keep at least `min_armed` slots for it and will reuse
+ * the oldest slots that the user has not consumed if necessary.
+ */
+
+#include "dma_rx.h"
+
+#include "event.h"
+#include "instance.h"
+
+#include <linux/dma-mapping.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+static unsigned int rx_ring_slots = 64;
+module_param(rx_ring_slots, uint, 0444);
+MODULE_PARM_DESC(rx_ring_slots, "Number of slots in the receive ring (power of 2)");
+
+static unsigned int rx_slot_size = PAGE_SIZE;
+module_param(rx_slot_size, uint, 0444);
+MODULE_PARM_DESC(rx_slot_size, "Size of each slot in the receive ring (multiple of page size)");
+
+
+static void knacs_rx_ring_free(struct knacs_rx_ring *ring)
+{
+    unsigned int order = get_order(ring->slot_size);
+    if (ring->slot_pages) {
+        for (u32 i = 0; i < ring->nslots; i++) {
+            struct page *page = ring->slot_pages[i];
+            if (!page)
+                continue;
+            if (!dma_mapping_error(ring->dev, ring->slot_dma[i]))
+                dma_unmap_page(ring->dev, ring->slot_dma[i], ring->slot_size,
+                               ring->dir);
+            __free_pages(page, order);
+        }
+    }
+    kfree(ring->slot_pages);
+    kfree(ring->slot_dma);
+    if (ring->descs)
+        dma_free_coherent(ring->dev, ring->nslots * sizeof(struct knacs_axi_desc),
+                          ring->descs, ring->descs_dma);
+    if (ring->hdr_page)
+        __free_pages(ring->hdr_page, get_order(ring->hdr_size));
+    put_device(ring->dev);
+    kfree(ring);
+}
+
+static void knacs_rx_ring_release(struct kref *ref)
+{
+    knacs_rx_ring_free(container_of(ref, struct knacs_rx_ring, ref));
+}
+
+void knacs_rx_ring_put(struct knacs_rx_ring *ring)
+{
+    kref_put(&ring->ref, knacs_rx_ring_release);
+}
+
+struct knacs_rx_ring *knacs_rx_ring_create(struct device *dev,
+                                           const struct knacs_rx_ring_ops *ops,
+                                           u32 max_seg_len, enum dma_data_direction dir)
+{
+    if (!is_power_of_2(rx_ring_slots) || rx_ring_slots < 2 ||
+        rx_slot_size == 0 || rx_slot_size % PAGE_SIZE != 0 || rx_slot_size > max_seg_len) {
+        pr_alert("Invalid receive ring configuration %u x %u\n", rx_ring_slots, rx_slot_size);
+        return ERR_PTR(-EINVAL);
+    }
+    struct knacs_rx_ring *ring = kzalloc(sizeof(struct knacs_rx_ring), GFP_KERNEL);
+    if (!ring)
+        return ERR_PTR(-ENOMEM);
+    kref_init(&ring->ref);
+    ring->dev = get_device(dev);
+    ring->ops = ops;
+    ring->dir = dir;
+    ring->nslots = rx_ring_slots;
+    ring->slot_size = rx_slot_size;
+    ring->min_armed = max(rx_ring_slots / 4, 1u);
+    spin_lock_init(&ring->lock);
+
+    ring->hdr_size = PAGE_ALIGN(sizeof(knacs_rx_ring_t) +
+                                ring->nslots * sizeof(knacs_rx_slot_t));
+    ring->hdr_page = alloc_pages(GFP_KERNEL | __GFP_ZERO, get_order(ring->hdr_size));
+    ring->slot_pages = kcalloc(ring->nslots, sizeof(struct page*), GFP_KERNEL);
+    ring->slot_dma = kcalloc(ring->nslots, sizeof(dma_addr_t), GFP_KERNEL);
+    ring->descs = dma_alloc_coherent(dev, ring->nslots * sizeof(struct knacs_axi_desc),
+                                     &ring->descs_dma, GFP_KERNEL);
+    if (!ring->hdr_page || !ring->slot_pages || !ring->slot_dma || !ring->descs)
+        goto nomem;
+    for (u32 i = 0; i < ring->nslots; i++)
+        ring->slot_dma[i] = DMA_MAPPING_ERROR;
+
+    unsigned int order = get_order(ring->slot_size);
+    for (u32 i = 0; i < ring->nslots; i++) {
+        struct page *page = alloc_pages(GFP_KERNEL | __GFP_ZERO, order);
+        if (!page)
+            goto nomem;
+        ring->slot_pages[i] = page;
+        ring->slot_dma[i] = dma_map_page(dev, page, 0, ring->slot_size, dir);
+        if (dma_mapping_error(dev, ring->slot_dma[i]))
+            goto nomem;
+    }
+
+    for (u32 i = 0; i < ring->nslots; i++) {
+        struct knacs_axi_desc *desc = &ring->descs[i];
+        dma_addr_t next = knacs_rx_ring_desc_addr(ring, i + 1);
+        desc->next_desc = lower_32_bits(next);
+        desc->next_desc_msb = upper_32_bits(next);
+        desc->buf_addr = lower_32_bits(ring->slot_dma[i]);
+        desc->buf_addr_msb = upper_32_bits(ring->slot_dma[i]);
+    }
+
+    ring->hdr = page_address(ring->hdr_page);
+    ring->hdr->nslots = ring->nslots;
+    ring->hdr->slot_size = ring->slot_size;
+    ring->hdr->data_offset = ring->hdr_size;
+    return ring;
+
+nomem:
+    pr_alert("Unable to allocate receive ring\n");
+    knacs_rx_ring_free(ring);
+    return ERR_PTR(-ENOMEM);
+}
+
+// Called with the lock held.
+static void knacs_rx_ring_arm_slot(struct knacs_rx_ring *ring, u32 counter)
+{
+    u32 idx = counter & (ring->nslots - 1);
+    struct knacs_axi_desc *desc = &ring->descs[idx];
+    // Let the user know that the slot is being reused before the hardware can write to it.
+    WRITE_ONCE(ring->hdr->slots[idx].seq, counter);
+    dma_sync_single_for_device(ring->dev, ring->slot_dma[idx], ring->slot_size,
+                               ring->dir);
+    desc->control = ring->slot_size;
+    desc->status = 0;
+}
+
+// Called with the lock held. Returns the old `armed_end`.
+static u32 knacs_rx_ring_refill(struct knacs_rx_ring *ring)
+{
+    u32 old_end = ring->armed_end;
+    // Only trust the user tail if it makes sense.
+    u32 tail = READ_ONCE(ring->hdr->tail);
+    if ((u32)(tail - ring->tail) <= (u32)(ring->hw_head - ring->tail))
+        ring->tail = tail;
+    while (ring->armed_end - ring->tail < ring->nslots)
+        knacs_rx_ring_arm_slot(ring, ring->armed_end++);
+    while (ring->armed_end - ring->hw_head < ring->min_armed) {
+        // The user is falling behind, drop the oldest slot.
+        ring->tail++;
+        WRITE_ONCE(ring->hdr->overflow, ring->hdr->overflow + 1);
+        knacs_rx_ring_arm_slot(ring, ring->armed_end++);
+    }
+    // Make sure the descriptors are visible to the hardware before it's told about them.
+    dma_wmb();
+    return old_end;
+}
+
+void knacs_rx_ring_start(struct knacs_rx_ring *ring)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    // Anything the hardware didn't finish is lost, start again from the head.
+    for (u32 c = ring->hw_head; c != ring->armed_end; c++)
+        knacs_rx_ring_arm_slot(ring, c);
+    knacs_rx_ring_refill(ring);
+    ring->ops->start(ring, ring->hw_head, ring->armed_end);
+    spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+void knacs_rx_ring_process(struct knacs_rx_ring *ring)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    u32 old_head = ring->hw_head;
+    while (ring->hw_head != ring->armed_end) {
+        u32 idx = ring->hw_head & (ring->nslots - 1);
+        u32 status = READ_ONCE(ring->descs[idx].status);
+        if (!(status & KNACS_AXI_DESC_CMPLT))
+            break;
+        // Don't read anything else before the completion status.
+        dma_rmb();
+        u32 len = status & KNACS_AXI_DESC_LEN_MASK;
+        u32 slot_flags = 0;
+        if (status & KNACS_AXI_DESC_SOF)
+            slot_flags |= KNACS_RX_SOF;
+        if (status & KNACS_AXI_DESC_EOF)
+            slot_flags |= KNACS_RX_EOF;
+        if (status & KNACS_AXI_DESC_ERR_MASK)
+            slot_flags |= KNACS_RX_ERROR;
+        dma_sync_single_for_cpu(ring->dev, ring->slot_dma[idx], ring->slot_size,
+                                ring->dir);
+        knacs_rx_slot_t *slot = &ring->hdr->slots[idx];
+        WRITE_ONCE(slot->len, len);
+        WRITE_ONCE(slot->flags, slot_flags);
+        ring->hw_head++;
+    }
+    u32 head = ring->hw_head;
+    if (head != old_head)
+        smp_store_release(&ring->hdr->head, head);
+    u32 old_end = knacs_rx_ring_refill(ring);
+    if (ring->armed_end != old_end)
+        ring->ops->arm(ring, ring->armed_end);
+    spin_unlock_irqrestore(&ring->lock, flags);
+
+    struct knacs_instance *inst = READ_ONCE(ring->inst);
+    if (head != old_head && inst)
+        knacs_event_broadcast(inst, KNACS_EVENT_RX, 0, head);
+}
+
+u32 knacs_rx_ring_armed_end(struct knacs_rx_ring *ring)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    u32 end = ring->armed_end;
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return end;
+}
+
+int knacs_rx_register(struct knacs_instance *inst, struct knacs_rx_ring *ring)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    if (inst->rx_ring) {
+        spin_unlock_irqrestore(&inst->dma_lock, flags);
+        pr_alert("Only one receive ring is allowed per instance\n");
+        return -EBUSY;
+    }
+    inst->rx_ring = ring;
+    WRITE_ONCE(ring->inst, inst);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    return 0;
+}
+
+void knacs_rx_unregister(struct knacs_instance *inst, struct knacs_rx_ring *ring)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    if (inst->rx_ring == ring)
+        inst->rx_ring = NULL;
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+}
+
+static void rx_vm_open(struct vm_area_struct *vma)
+{
+    struct knacs_rx_ring *ring = vma->vm_private_data;
+    kref_get(&ring->ref);
+}
+
+static void rx_vm_close(struct vm_area_struct *vma)
+{
+    knacs_rx_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct rx_vm_ops = {
+    .open = rx_vm_open,
+    .close = rx_vm_close,
+};
+
+int knacs_rx_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+
+    struct knacs_file *kfile = filp->private_data;
+    struct knacs_instance *inst = kfile->inst;
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_rx_ring *ring = inst->rx_ring;
+    if (ring)
+        kref_get(&ring->ref);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    if (!ring)
+        return -ENODEV;
+
+    int err = -EINVAL;
+    unsigned long sz = vma->vm_end - vma->vm_start;
+    if (sz != ring->hdr_size + (unsigned long)ring->nslots * ring->slot_size) {
+        pr_debug("Receive ring must be mapped as a whole\n");
+        goto failed;
+    }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+
+    unsigned long addr = vma->vm_start;
+    err = remap_pfn_range(vma, addr, page_to_pfn(ring->hdr_page), ring->hdr_size,
+                          vma->vm_page_prot);
+    if (err)
+        goto failed;
+    addr += ring->hdr_size;
+    for (u32 i = 0; i < ring->nslots; i++) {
+        err = remap_pfn_range(vma, addr, page_to_pfn(ring->slot_pages[i]),
+                              ring->slot_size, vma->vm_page_prot);
+        if (err)
+            goto failed;
+        addr += ring->slot_size;
+    }
+    vma->vm_private_data = ring;
+    vma->vm_ops = &rx_vm_ops;
+    pr_debug("Mapped receive ring\n");
+    return 0;
+
+failed:
+    knacs_rx_ring_put(ring);
+    return err;
+}
@@ -0,0 +1,92 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_RX_H__
+#define __KNACS_DMA_RX_H__
+
+#include "dma_engine.h"
+
+#include <linux/dma-direction.h>
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+
+struct knacs_instance;
+struct knacs_rx_ring;
+
+struct knacs_rx_ring_ops {
+    // (Re)start the hardware with the slots `[head, end)` ready to be filled.
+    void (*start)(struct knacs_rx_ring*, u32 head, u32 end);
+    // More slots are ready to be filled, up to (excluding) `end`.
+    void (*arm)(struct knacs_rx_ring*, u32 end);
+};
+
+struct knacs_rx_ring {
+    struct kref ref;
+    struct device *dev;
+    const struct knacs_rx_ring_ops *ops;
+    void *priv;
+    struct knacs_instance *inst; // Set when registered, for the events
+    enum dma_data_direction dir;
+    u32 nslots;
+    u32 slot_size;
+    // Minimum number of slots to keep ready for the hardware,
+    // even if that means dropping slots not consumed by the user yet.
+    u32 min_armed;
+
+    knacs_rx_ring_t *hdr;
+    struct page *hdr_page;
+    size_t hdr_size;
+    struct page **slot_pages;
+    dma_addr_t *slot_dma;
+    struct knacs_axi_desc *descs;
+    dma_addr_t descs_dma;
+
+    spinlock_t lock;
+    // Counter of the next slot to be filled by the hardware.
+    u32 hw_head;
+    // Slots `[hw_head, armed_end)` are owned by the hardware.
+    u32 armed_end;
+    // The oldest slot not consumed by the user and not dropped yet.
+    u32 tail;
+};
+
+static inline dma_addr_t knacs_rx_ring_desc_addr(struct knacs_rx_ring *ring, u32 counter)
+{
+    return ring->descs_dma + (counter & (ring->nslots - 1)) * sizeof(struct knacs_axi_desc);
+}
+
+// `dir` is the direction used for the mapping of the slots, which should be
+// `DMA_FROM_DEVICE` unless the slots are filled by the CPU (e.g. the loopback device).
+struct knacs_rx_ring *knacs_rx_ring_create(struct device*, const struct knacs_rx_ring_ops*,
+                                           u32 max_seg_len, enum dma_data_direction dir);
+void knacs_rx_ring_put(struct knacs_rx_ring*);
+// Start the hardware on the ring, also used to restart it after a reset.
+void knacs_rx_ring_start(struct knacs_rx_ring*);
+// Collect the slots filled by the hardware and give more slots back to it.
+// Safe to be called from interrupt context.
+void knacs_rx_ring_process(struct knacs_rx_ring*);
+u32 knacs_rx_ring_armed_end(struct knacs_rx_ring*);
+
+// Only one ring can be registered per instance at a time.
+int knacs_rx_register(struct knacs_instance*, struct knacs_rx_ring*);
+void knacs_rx_unregister(struct knacs_instance*, struct knacs_rx_ring*);
+int knacs_rx_mmap(struct file*, struct vm_area_struct*);
+
+#endif
@@ -0,0 +1,332 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (dma-tx): " fmt
+
+/**
+ * Transmit ring for streaming sequences that don't fit in the DMA memory.
+ *
+ * The slots are a fixed range of a DMA buffer mapped by the user and each filled slot
+ * is submitted as a normal transfer, so it's queued and chained the same way as
+ * the ones from `KNACS_DMA_SUBMIT`. The counters and the slot lengths are in
+ * a separate control page (the same layout as the result ring) so that the kernel
+ * doesn't need to read the counters through a possibly non-cached alias.
+ *
+ * Whenever a slot finishes, we check whether the user has filled more slots and submit
+ * them from a work item, so a stream that is kept ahead of the hardware runs without
+ * any syscall. The number of slots still queued when each one finishes is the margin
+ * the stream has before an underrun, which is reported to the user when it gets low.
+ */
+
+#include "dma_tx.h"
+
+#include "buff_alloc.h"
+#include "dma_engine.h"
+#include "event.h"
+#include "instance.h"
+
+#include <linux/overflow.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+
+static void knacs_tx_ring_release(struct kref *ref)
+{
+    struct knacs_tx_ring *ring = container_of(ref, struct knacs_tx_ring, ref);
+    vfree(ring->hdr);
+    if (ring->buf)
+        knacs_buff_put(ring->buf);
+    mutex_destroy(&ring->fill_lock);
+    kfree(ring);
+}
+
+void knacs_tx_ring_put(struct knacs_tx_ring *ring)
+{
+    kref_put(&ring->ref, knacs_tx_ring_release);
+}
+
+// Copy our counters to the shared page. Called with the ring lock held.
+static void tx_ring_publish(struct knacs_tx_ring *ring)
+{
+    knacs_tx_ring_t *hdr = ring->hdr;
+    WRITE_ONCE(hdr->submitted, ring->submitted);
+    WRITE_ONCE(hdr->low_water_hits, ring->low_water_hits);
+    WRITE_ONCE(hdr->underruns, ring->underruns);
+    WRITE_ONCE(hdr->min_queued, ring->min_queued);
+    WRITE_ONCE(hdr->errors, ring->errors);
+    // The user may refill the slot as soon as it sees the new head.
+    smp_store_release(&hdr->head, ring->head);
+}
+
+// Submit the slots filled by the user.
+static int tx_ring_fill(struct knacs_tx_ring *ring)
+{
+    int err = 0;
+    mutex_lock(&ring->fill_lock);
+    // Loading the tail with acquire makes sure we see the data and the length
+    // of the slots written before it.
+    u32 tail = smp_load_acquire(&ring->hdr->tail);
+    for (;;) {
+        unsigned long flags;
+        spin_lock_irqsave(&ring->lock, flags);
+        u32 next = ring->submitted;
+        bool avail = !ring->stopped && (s32)(tail - next) > 0 &&
+            next - ring->head < ring->nslots;
+        // Count the slot before submitting it since it may finish right away.
+        if (avail)
+            ring->submitted = next + 1;
+        spin_unlock_irqrestore(&ring->lock, flags);
+        if (!avail)
+            break;
+
+        u32 idx = next & (ring->nslots - 1);
+        u32 len = READ_ONCE(ring->slots[idx].len);
+        u64 token;
+        err = -EINVAL;
+        if (len > 0 && len <= ring->slot_size)
+            err = knacs_dma_submit_buf(ring->kfile, ring->buf,
+                                       ring->offset + (size_t)idx * ring->slot_size, len,
+                                       ring, &token);
+        spin_lock_irqsave(&ring->lock, flags);
+        if (err) {
+            // Nothing was submitted for the slot, stall the ring on it.
+            // The user can fix it and push again.
+            ring->submitted = next;
+            ring->errors++;
+        }
+        tx_ring_publish(ring);
+        spin_unlock_irqrestore(&ring->lock, flags);
+        if (err) {
+            pr_debug("Failed to submit slot %u: %d\n", next, err);
+            break;
+        }
+    }
+    mutex_unlock(&ring->fill_lock);
+    return err;
+}
+
+static void tx_ring_fill_work_func(struct work_struct *work)
+{
+    tx_ring_fill(container_of(work, struct knacs_tx_ring, fill_work));
+}
+
+void knacs_tx_ring_done(struct knacs_tx_ring *ring, s32 status)
+{
+    int event = 1;
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    u32 head = ++ring->head;
+    u32 queued = ring->submitted - head;
+    if (status)
+        ring->errors++;
+    if (queued < ring->min_queued)
+        ring->min_queued = queued;
+    tx_ring_publish(ring);
+    // Pairs with the user checking `submitted == head` after advancing `tail`,
+    // so that either we see the new tail or the user sees that it needs to push.
+    smp_mb();
+    u32 tail = READ_ONCE(ring->hdr->tail);
+    if (queued == 0) {
+        if (tail == head && (READ_ONCE(ring->hdr->flags) & KNACS_TX_END)) {
+            event = 0;
+        } else if (!ring->stopped) {
+            ring->underruns++;
+            event = -EPIPE;
+        }
+    } else if (queued + 1 == ring->low_water) {
+        ring->low_water_hits++;
+        event = -EAGAIN;
+    }
+    // Update the counters again for the event.
+    if (event < 0)
+        tx_ring_publish(ring);
+    bool refill = !ring->stopped && tail != ring->submitted;
+    if (refill)
+        queue_work(system_highpri_wq, &ring->fill_work);
+    spin_unlock_irqrestore(&ring->lock, flags);
+
+    if (event <= 0)
+        knacs_event_post(ring->kfile, KNACS_EVENT_TX, event, head);
+    wake_up_interruptible_poll(&ring->kfile->wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+// Get the ring of the file with a reference.
+static struct knacs_tx_ring *tx_ring_of(struct knacs_file *kfile)
+{
+    mutex_lock(&kfile->tx_lock);
+    struct knacs_tx_ring *ring = kfile->tx_ring;
+    if (ring)
+        knacs_tx_ring_get(ring);
+    mutex_unlock(&kfile->tx_lock);
+    return ring;
+}
+
+int knacs_tx_ring_start(struct knacs_file *kfile, knacs_tx_ring_start_t __user *arg)
+{
+    knacs_tx_ring_start_t start;
+    if (copy_from_user(&start, arg, sizeof(start)))
+        return -EFAULT;
+    size_t size;
+    if (!is_power_of_2(start.nslots) || start.nslots > KNACS_TX_RING_MAX_SLOTS ||
+        start.slot_size == 0 || start.low_water > start.nslots ||
+        start.addr != (unsigned long)start.addr ||
+        check_mul_overflow((size_t)start.nslots, (size_t)start.slot_size, &size))
+        return -EINVAL;
+    if (!knacs_dma_device(kfile->inst))
+        return -ENODEV;
+
+    struct knacs_tx_ring *ring = kzalloc(sizeof(struct knacs_tx_ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+    kref_init(&ring->ref);
+    mutex_init(&ring->fill_lock);
+    INIT_WORK(&ring->fill_work, tx_ring_fill_work_func);
+    spin_lock_init(&ring->lock);
+    ring->kfile = kfile;
+    ring->nslots = start.nslots;
+    ring->slot_size = start.slot_size;
+    ring->low_water = start.low_water;
+    ring->min_queued = start.nslots;
+    int err;
+    ring->buf = knacs_buff_get(start.addr, size, &ring->offset);
+    if (IS_ERR(ring->buf)) {
+        err = PTR_ERR(ring->buf);
+        ring->buf = NULL;
+        goto failed;
+    }
+    ring->hdr_size = PAGE_ALIGN(sizeof(knacs_tx_ring_t) + start.nslots * sizeof(knacs_tx_slot_t));
+    // Zeroed and suitable for `remap_vmalloc_range`.
+    ring->hdr = vmalloc_user(ring->hdr_size);
+    if (!ring->hdr) {
+        err = -ENOMEM;
+        goto failed;
+    }
+    ring->slots = (void*)ring->hdr + sizeof(knacs_tx_ring_t);
+    ring->hdr->nslots = ring->nslots;
+    ring->hdr->slot_size = ring->slot_size;
+    ring->hdr->slot_offset = sizeof(knacs_tx_ring_t);
+    ring->hdr->min_queued = ring->min_queued;
+
+    mutex_lock(&kfile->tx_lock);
+    if (kfile->tx_ring) {
+        err = -EBUSY;
+    } else {
+        kfile->tx_ring = ring;
+        err = 0;
+    }
+    mutex_unlock(&kfile->tx_lock);
+    if (err)
+        goto failed;
+    pr_debug("Started transmit ring with %u slots of %u bytes\n", ring->nslots, ring->slot_size);
+    return 0;
+
+failed:
+    knacs_tx_ring_put(ring);
+    return err;
+}
+
+int knacs_tx_ring_push(struct knacs_file *kfile)
+{
+    struct knacs_tx_ring *ring = tx_ring_of(kfile);
+    if (!ring)
+        return -EINVAL;
+    int err = tx_ring_fill(ring);
+    knacs_tx_ring_put(ring);
+    return err;
+}
+
+void knacs_tx_ring_stop(struct knacs_file *kfile)
+{
+    mutex_lock(&kfile->tx_lock);
+    struct knacs_tx_ring *ring = kfile->tx_ring;
+    kfile->tx_ring = NULL;
+    mutex_unlock(&kfile->tx_lock);
+    if (!ring)
+        return;
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    ring->stopped = true;
+    spin_unlock_irqrestore(&ring->lock, flags);
+    // The work isn't queued again once the ring is stopped.
+    cancel_work_sync(&ring->fill_work);
+    // The memory stays around until the user unmaps it and the submitted slots finish.
+    knacs_tx_ring_put(ring);
+}
+
+__poll_t knacs_tx_ring_poll(struct knacs_file *kfile)
+{
+    struct knacs_tx_ring *ring = tx_ring_of(kfile);
+    if (!ring)
+        return 0;
+    __poll_t mask = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&ring->lock, flags);
+    if (READ_ONCE(ring->hdr->tail) - ring->head < ring->nslots)
+        mask = EPOLLOUT | EPOLLWRNORM;
+    spin_unlock_irqrestore(&ring->lock, flags);
+    knacs_tx_ring_put(ring);
+    return mask;
+}
+
+static void tx_vm_open(struct vm_area_struct *vma)
+{
+    knacs_tx_ring_get(vma->vm_private_data);
+}
+
+static void tx_vm_close(struct vm_area_struct *vma)
+{
+    knacs_tx_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct tx_vm_ops = {
+    .open = tx_vm_open,
+    .close = tx_vm_close,
+};
+
+int knacs_tx_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+
+    struct knacs_tx_ring *ring = tx_ring_of(filp->private_data);
+    if (!ring)
+        return -ENODEV;
+
+    int err = -EINVAL;
+    if (vma->vm_end - vma->vm_start != ring->hdr_size) {
+        pr_debug("Transmit ring must be mapped as a whole\n");
+        goto failed;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+    if ((err = remap_vmalloc_range(vma, ring->hdr, 0)))
+        goto failed;
+    vma->vm_private_data = ring;
+    vma->vm_ops = &tx_vm_ops;
+    pr_debug("Mapped transmit ring\n");
+    return 0;
+
+failed:
+    knacs_tx_ring_put(ring);
+    return err;
+}
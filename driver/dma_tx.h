@@ -0,0 +1,83 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_DMA_TX_H__
+#define __KNACS_DMA_TX_H__
+
+#include "knacs.h"
+
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct knacs_file;
+struct vm_buf;
+
+struct knacs_tx_ring {
+    struct kref ref; // From the file, the mappings and the submitted slots
+    // The file that started the ring, not counted. Valid as long as the ring
+    // is started or any slot is in flight (the transfers hold the file).
+    struct knacs_file *kfile;
+    knacs_tx_ring_t *hdr; // The mapped memory, followed by the slot lengths
+    knacs_tx_slot_t *slots;
+    size_t hdr_size;
+    struct vm_buf *buf;
+    size_t offset; // Offset of the first slot in the buffer
+    u32 nslots;
+    u32 slot_size;
+    u32 low_water;
+
+    // Serializes picking up new slots from the user.
+    struct mutex fill_lock;
+    struct work_struct fill_work;
+
+    spinlock_t lock;
+    bool stopped;
+    // Our copy of the counters, the user could write anything to the shared ones.
+    u32 head;
+    u32 submitted;
+    u32 low_water_hits;
+    u32 underruns;
+    u32 min_queued;
+    u32 errors;
+};
+
+int knacs_tx_ring_start(struct knacs_file*, knacs_tx_ring_start_t __user *arg);
+int knacs_tx_ring_push(struct knacs_file*);
+// Also called when the file is closed.
+void knacs_tx_ring_stop(struct knacs_file*);
+int knacs_tx_ring_mmap(struct file*, struct vm_area_struct*);
+// The wait queue of the file must be registered by the caller.
+__poll_t knacs_tx_ring_poll(struct knacs_file*);
+
+static inline struct knacs_tx_ring *knacs_tx_ring_get(struct knacs_tx_ring *ring)
+{
+    kref_get(&ring->ref);
+    return ring;
+}
+// Safe to be called from interrupt context.
+void knacs_tx_ring_put(struct knacs_tx_ring*);
+// Called by the DMA engine when a slot finishes, safe to be called from interrupt context.
+void knacs_tx_ring_done(struct knacs_tx_ring*, s32 status);
+
+#endif
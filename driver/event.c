@@ -0,0 +1,254 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (event): " fmt
+
+/**
+ * Completion notifications for the user.
+ *
+ * Events are generated from the interrupt handlers and queued to the files
+ * that are interested in them. The user can wait for them with `poll`/`epoll`
+ * or an eventfd and read them back in batches.
+ */
+
+#include "event.h"
+#include "instance.h"
+
+#include <linux/eventfd.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+static unsigned int event_queue_size = 256;
+module_param(event_queue_size, uint, 0444);
+MODULE_PARM_DESC(event_queue_size, "Number of events that can be queued per open file");
+
+static atomic64_t knacs_file_ids = ATOMIC64_INIT(0);
+
+int __init knacs_event_init(void)
+{
+    if (event_queue_size < 2) {
+        pr_alert("Event queue too small\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void knacs_event_exit(void)
+{
+}
+
+u64 knacs_owner_id_alloc(void)
+{
+    return atomic64_inc_return(&knacs_file_ids);
+}
+
+struct knacs_file *knacs_file_create(struct knacs_instance *inst)
+{
+    struct knacs_file *kfile = kzalloc(sizeof(struct knacs_file), GFP_KERNEL);
+    if (!kfile)
+        return NULL;
+    if (kfifo_alloc(&kfile->events, event_queue_size, GFP_KERNEL)) {
+        kfree(kfile);
+        return NULL;
+    }
+    kref_init(&kfile->ref);
+    kfile->id = knacs_owner_id_alloc();
+    kfile->inst = inst;
+    spin_lock_init(&kfile->lock);
+    init_waitqueue_head(&kfile->wait);
+    mutex_init(&kfile->buffs_lock);
+    idr_init(&kfile->buffs);
+    mutex_init(&kfile->tx_lock);
+
+    unsigned long flags;
+    spin_lock_irqsave(&inst->files_lock, flags);
+    list_add_tail(&kfile->node, &inst->files);
+    spin_unlock_irqrestore(&inst->files_lock, flags);
+    return kfile;
+}
+
+static void knacs_file_free(struct kref *ref)
+{
+    struct knacs_file *kfile = container_of(ref, struct knacs_file, ref);
+    if (kfile->eventfd)
+        eventfd_ctx_put(kfile->eventfd);
+    kfifo_free(&kfile->events);
+    // The handles are released when the file is closed.
+    mutex_destroy(&kfile->buffs_lock);
+    mutex_destroy(&kfile->tx_lock);
+    kfree(kfile);
+}
+
+void knacs_file_put(struct knacs_file *kfile)
+{
+    kref_put(&kfile->ref, knacs_file_free);
+}
+
+void knacs_file_release(struct knacs_file *kfile)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&kfile->inst->files_lock, flags);
+    list_del(&kfile->node);
+    spin_unlock_irqrestore(&kfile->inst->files_lock, flags);
+
+    // Pending transfers may still hold a reference. Make sure they don't signal
+    // the eventfd after the file is closed.
+    spin_lock_irqsave(&kfile->lock, flags);
+    kfile->event_mask = 0;
+    struct eventfd_ctx *eventfd = kfile->eventfd;
+    kfile->eventfd = NULL;
+    spin_unlock_irqrestore(&kfile->lock, flags);
+    if (eventfd)
+        eventfd_ctx_put(eventfd);
+    knacs_file_put(kfile);
+}
+
+int knacs_file_set_event_mask(struct knacs_file *kfile, u32 mask)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&kfile->lock, flags);
+    kfile->event_mask = mask;
+    spin_unlock_irqrestore(&kfile->lock, flags);
+    return 0;
+}
+
+int knacs_file_set_eventfd(struct knacs_file *kfile, int fd)
+{
+    struct eventfd_ctx *eventfd = NULL;
+    if (fd >= 0) {
+        eventfd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(eventfd))
+            return PTR_ERR(eventfd);
+    }
+    unsigned long flags;
+    spin_lock_irqsave(&kfile->lock, flags);
+    swap(kfile->eventfd, eventfd);
+    spin_unlock_irqrestore(&kfile->lock, flags);
+    if (eventfd)
+        eventfd_ctx_put(eventfd);
+    return 0;
+}
+
+void knacs_event_post(struct knacs_file *kfile, u32 type, s32 status, u64 token)
+{
+    knacs_event_t event = {
+        .type = type,
+        .status = status,
+        .token = token,
+        .timestamp = ktime_get_ns(),
+    };
+    unsigned long flags;
+    spin_lock_irqsave(&kfile->lock, flags);
+    if (!(kfile->event_mask & (1u << type))) {
+        spin_unlock_irqrestore(&kfile->lock, flags);
+        return;
+    }
+    // Drop the oldest event to make room so that all the dropped events
+    // come before the ones still in the queue, where the overflow is reported.
+    if (kfifo_is_full(&kfile->events)) {
+        kfifo_skip(&kfile->events);
+        kfile->dropped++;
+    }
+    kfifo_put(&kfile->events, event);
+    if (kfile->eventfd) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(kfile->eventfd, 1);
+#else
+        eventfd_signal(kfile->eventfd);
+#endif
+    }
+    spin_unlock_irqrestore(&kfile->lock, flags);
+    wake_up_interruptible(&kfile->wait);
+}
+
+void knacs_event_broadcast(struct knacs_instance *inst, u32 type, s32 status, u64 token)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->files_lock, flags);
+    struct knacs_file *kfile;
+    list_for_each_entry(kfile, &inst->files, node)
+        knacs_event_post(kfile, type, status, token);
+    spin_unlock_irqrestore(&inst->files_lock, flags);
+}
+
+static bool knacs_file_has_event(struct knacs_file *kfile)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&kfile->lock, flags);
+    bool res = kfile->dropped || !kfifo_is_empty(&kfile->events);
+    spin_unlock_irqrestore(&kfile->lock, flags);
+    return res;
+}
+
+// Number of events to copy to the user at a time.
+#define EVENT_BATCH 16
+
+ssize_t knacs_file_read_events(struct knacs_file *kfile, char __user *buf, size_t len,
+                               bool nonblock)
+{
+    size_t nmax = len / sizeof(knacs_event_t);
+    if (nmax == 0)
+        return -EINVAL;
+    if (!nonblock) {
+        int err = wait_event_interruptible(kfile->wait, knacs_file_has_event(kfile));
+        if (err)
+            return err;
+    }
+
+    knacs_event_t events[EVENT_BATCH];
+    size_t copied = 0;
+    while (copied < nmax) {
+        unsigned int n = 0;
+        unsigned int nbatch = min_t(size_t, nmax - copied, EVENT_BATCH);
+        unsigned long flags;
+        spin_lock_irqsave(&kfile->lock, flags);
+        // The dropped events are older than everything in the queue.
+        if (kfile->dropped) {
+            events[n++] = (knacs_event_t){
+                .type = KNACS_EVENT_OVERFLOW,
+                .token = kfile->dropped,
+                .timestamp = ktime_get_ns(),
+            };
+            kfile->dropped = 0;
+        }
+        while (n < nbatch && kfifo_get(&kfile->events, &events[n]))
+            n++;
+        spin_unlock_irqrestore(&kfile->lock, flags);
+        if (n == 0)
+            break;
+        // The events are already removed from the queue,
+        // return what we've got if some were copied before.
+        if (copy_to_user(buf + copied * sizeof(knacs_event_t), events,
+                         n * sizeof(knacs_event_t)))
+            return copied ? copied * sizeof(knacs_event_t) : -EFAULT;
+        copied += n;
+    }
+    if (copied == 0)
+        return -EAGAIN;
+    return copied * sizeof(knacs_event_t);
+}
+
+__poll_t knacs_file_poll(struct knacs_file *kfile, struct file *filp, poll_table *wait)
+{
+    poll_wait(filp, &kfile->wait, wait);
+    return knacs_file_has_event(kfile) ? EPOLLIN | EPOLLRDNORM : 0;
+}
@@ -0,0 +1,88 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_EVENT_H__
+#define __KNACS_EVENT_H__
+
+#include "knacs.h"
+
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+struct eventfd_ctx;
+struct knacs_instance;
+struct knacs_tx_ring;
+
+// Per open file state.
+struct knacs_file {
+    struct kref ref;
+    struct list_head node; // For the list of files to broadcast events to
+    struct knacs_instance *inst; // The instance the file was opened on
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    DECLARE_KFIFO_PTR(events, knacs_event_t);
+    u32 event_mask;
+    u64 dropped;
+    struct eventfd_ctx *eventfd;
+    // Unique (never reused) ID, used to track the owner of the memory.
+    u64 id;
+    u32 alloc_flags;
+    // Buffer handles created by the file (`KNACS_BUFF_CREATE`).
+    struct mutex buffs_lock;
+    struct idr buffs;
+    // The transmit ring started from the file (`KNACS_TX_RING_START`).
+    struct mutex tx_lock;
+    struct knacs_tx_ring *tx_ring;
+};
+
+int knacs_event_init(void);
+void knacs_event_exit(void);
+
+// A new unique ID for the owner of the memory, the same ones used for the files.
+u64 knacs_owner_id_alloc(void);
+struct knacs_file *knacs_file_create(struct knacs_instance*);
+// Called when the file is closed. Drops the reference from the file.
+void knacs_file_release(struct knacs_file*);
+static inline struct knacs_file *knacs_file_get(struct knacs_file *kfile)
+{
+    kref_get(&kfile->ref);
+    return kfile;
+}
+// Safe to be called from interrupt context.
+void knacs_file_put(struct knacs_file*);
+
+int knacs_file_set_event_mask(struct knacs_file*, u32 mask);
+int knacs_file_set_eventfd(struct knacs_file*, int fd);
+ssize_t knacs_file_read_events(struct knacs_file*, char __user *buf, size_t len,
+                               bool nonblock);
+__poll_t knacs_file_poll(struct knacs_file*, struct file*, poll_table*);
+
+// Queue an event to a single file if it is enabled. Safe to be called from interrupt context.
+void knacs_event_post(struct knacs_file*, u32 type, s32 status, u64 token);
+// Queue an event to all files open on the instance. Safe to be called from interrupt context.
+void knacs_event_broadcast(struct knacs_instance*, u32 type, s32 status, u64 token);
+
+#endif
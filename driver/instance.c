@@ -0,0 +1,66 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (instance): " fmt
+
+/**
+ * Each pulse controller and the DMA engine feeding it form an instance with
+ * its own character device (`/dev/knacsN`, `N` being the index of the instance).
+ * `/dev/knacs` is the same as `/dev/knacs0` for compatibility.
+ *
+ * The devices are assigned to the instances using the `nacs,instance` property
+ * in the device tree.
+ */
+
+#include "instance.h"
+
+#include <linux/property.h>
+
+static struct knacs_instance instances[KNACS_MAX_INSTANCES];
+
+void __init knacs_instance_init(void)
+{
+    for (unsigned int i = 0; i < KNACS_MAX_INSTANCES; i++) {
+        struct knacs_instance *inst = &instances[i];
+        inst->idx = i;
+        spin_lock_init(&inst->files_lock);
+        INIT_LIST_HEAD(&inst->files);
+        atomic64_set(&inst->pulse_ctl_irq_count, 0);
+        atomic64_set(&inst->pulse_ctl_irq_ns, 0);
+        spin_lock_init(&inst->dma_lock);
+        init_waitqueue_head(&inst->result_wait);
+    }
+}
+
+struct knacs_instance *knacs_instance_get(unsigned int idx)
+{
+    if (idx >= KNACS_MAX_INSTANCES)
+        return NULL;
+    return &instances[idx];
+}
+
+struct knacs_instance *knacs_instance_of(struct device *dev)
+{
+    u32 idx = 0;
+    device_property_read_u32(dev, "nacs,instance", &idx);
+    struct knacs_instance *inst = knacs_instance_get(idx);
+    if (!inst)
+        pr_alert("Invalid instance %u\n", idx);
+    return inst;
+}
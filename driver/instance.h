@@ -0,0 +1,82 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_INSTANCE_H__
+#define __KNACS_INSTANCE_H__
+
+#include "pulse_stream.h"
+
+#include <linux/device.h>
+#include <linux/ioport.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#define KNACS_MAX_INSTANCES 8
+
+struct knacs_dma_chan;
+struct knacs_result_ring;
+struct knacs_rx_ring;
+
+// The state of one pulse controller and the DMA engine attached to it.
+// Each instance has its own locks so that they can be used in parallel.
+// The memory allocators (OCM and the DMA page cache) are shared.
+struct knacs_instance {
+    unsigned int idx;
+    // `/dev/knacsN`, created when the pulse controller is probed.
+    struct device *chrdev;
+
+    // Open files, for broadcasting events.
+    spinlock_t files_lock;
+    struct list_head files;
+
+    // Pulse controller
+    struct resource *pulse_ctl_regs;
+    void __iomem *pulse_ctl_base; // Cleared before unmapping, see knacs_pulse_ctl_regs_lock
+    void __iomem *pulse_ctl_mapped; // The ioremap'd window, owned by the teardown
+    int pulse_ctl_irq; // 0 if there's no interrupt
+    atomic64_t pulse_ctl_irq_count;
+    atomic64_t pulse_ctl_irq_ns; // Time of the last interrupt not handled yet
+    struct kthread_work pulse_ctl_work; // The completion work for the interrupt
+    // For the mock pulse controller
+    struct page *pulse_ctl_mock_page;
+    struct resource pulse_ctl_mock_res;
+    struct knacs_pulse_stream stream;
+
+    // Protects the DMA channel, receive ring and result ring pointers.
+    // Also serializes the draining of the result FIFO.
+    spinlock_t dma_lock;
+    struct knacs_dma_chan *dma_chan;
+    struct knacs_rx_ring *rx_ring;
+    struct knacs_result_ring *result_ring;
+    wait_queue_head_t result_wait;
+};
+
+void knacs_instance_init(void);
+// `NULL` if `idx` is out of range.
+struct knacs_instance *knacs_instance_get(unsigned int idx);
+// The instance a device belongs to, from the `nacs,instance` property (0 by default).
+struct knacs_instance *knacs_instance_of(struct device*);
+
+// Create/destroy `/dev/knacsN` for the instance (in `nacs_char.c`).
+int knacs_chrdev_create(struct knacs_instance*);
+void knacs_chrdev_destroy(struct knacs_instance*);
+
+#endif
@@ -20,12 +20,39 @@
 #ifndef __KNACS_H__
 #define __KNACS_H__
 
+#include <linux/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 enum {
     KNACS_GET_VERSION,
+    KNACS_DMA_SUBMIT,
+    KNACS_DMA_WAIT,
+    KNACS_DMA_GET_STATS,
+    KNACS_SET_EVENT_MASK,
+    KNACS_SET_EVENTFD,
+    KNACS_SET_ALLOC_FLAGS,
+    KNACS_DMA_SYNC,
+    KNACS_REG_BATCH,
+    KNACS_STREAM_START,
+    KNACS_STREAM_STOP,
+    KNACS_STREAM_GET_STATS,
+    KNACS_BUFF_CREATE,
+    KNACS_BUFF_RESIZE,
+    KNACS_BUFF_FREE,
+    KNACS_BUFF_EXPORT,
+    KNACS_BUFF_MIGRATE,
+    KNACS_TX_RING_START,
+    KNACS_TX_RING_PUSH,
+    KNACS_TX_RING_STOP,
+    KNACS_SEQ_CACHE_PUT,
+    KNACS_SEQ_CACHE_SUBMIT,
+    KNACS_SEQ_CACHE_EVICT,
+    KNACS_SEQ_CACHE_GET_STATS,
+    KNACS_DMA_SUBMIT_USER,
+    KNACS_POOL_GET_STATS,
 };
 
 typedef struct {
@@ -33,6 +60,599 @@ typedef struct {
     int minor;
 } knacs_version_t;
 
+// Page offsets for `mmap`
+enum {
+    KNACS_MMAP_PULSE_CTL = 0,
+    KNACS_MMAP_OCM = 1,
+    KNACS_MMAP_DMA_BUFF = 2,
+    KNACS_MMAP_RX_RING = 3,
+    KNACS_MMAP_RESULT_RING = 4,
+    KNACS_MMAP_TX_RING = 5,
+};
+
+/**
+ * Argument for `KNACS_SET_ALLOC_FLAGS` (`__u32`), applies to the DMA buffers
+ * mapped from the file afterwards.
+ *
+ * Buffers are normally zero filled when they are mapped.
+ * With `KNACS_ALLOC_NO_ZERO`, memory last used by a buffer from the same file
+ * may be returned with the old content. This is meant for users that will
+ * overwrite the whole buffer anyway. Memory last used by anyone else is still
+ * zero filled.
+ */
+#define KNACS_ALLOC_NO_ZERO (1u << 0)
+
+/**
+ * The cache attribute of the user mapping for the buffers (also part of
+ * the `KNACS_SET_ALLOC_FLAGS` argument). The default is a normal cached mapping
+ * and the driver cleans the cache for the range on `KNACS_DMA_SUBMIT`.
+ * Use `KNACS_DMA_SYNC` to see the data written by the hardware.
+ *
+ * Write-combined and uncached mappings don't need any cache maintenance
+ * (`KNACS_DMA_SYNC` is a no-op on them) which saves the time to clean the cache
+ * for large transfers but is much slower to read from the CPU.
+ * Write-combined mapping is usually the best choice for buffers that are
+ * only filled sequentially by the CPU. These only apply to the DMA buffers
+ * (page offset 2), the OCM (page offset 1) always uses the default mapping.
+ */
+#define KNACS_ALLOC_CACHE_MASK (3u << 1)
+#define KNACS_ALLOC_CACHED (0u << 1)
+#define KNACS_ALLOC_WRITECOMBINE (1u << 1)
+#define KNACS_ALLOC_UNCACHED (2u << 1)
+
+/**
+ * Map the buffer with huge (PMD sized) pages where possible to reduce the TLB misses
+ * when accessing large buffers. Only used for the buffers created with `KNACS_BUFF_CREATE`
+ * (ignored otherwise). The memory is allocated in PMD sized and aligned chunks
+ * when available and the mapping address is aligned accordingly unless `MAP_FIXED`
+ * is used. Parts that can't be mapped this way fall back to normal pages.
+ * This needs kernel support for huge PFN mappings (`CONFIG_TRANSPARENT_HUGEPAGE`),
+ * which is not available on 32-bit ARM without LPAE.
+ */
+#define KNACS_ALLOC_HUGE (1u << 3)
+
+/**
+ * Placement hint for the buffers created with `KNACS_BUFF_CREATE`
+ * (not allowed in `KNACS_SET_ALLOC_FLAGS`).
+ *
+ * * `KNACS_ALLOC_TIER_ANY`: use the OCM if the buffer is small
+ *   (no larger than the module parameter `ocm_tier_max_size`) and there is space.
+ * * `KNACS_ALLOC_TIER_LATENCY`: use the OCM whenever there is space.
+ * * `KNACS_ALLOC_TIER_BULK`: always use the normal memory.
+ *
+ * The buffer falls back to the normal memory when it can't be placed in the OCM.
+ * The location is returned in `location` of `knacs_buff_create_t`.
+ * Growing a buffer in the OCM with `KNACS_BUFF_RESIZE` adds normal memory to it.
+ *
+ * With `KNACS_ALLOC_MIGRATE`, a buffer that isn't (fully) in the OCM is moved
+ * to the OCM automatically when enough space is freed there (not for `KNACS_ALLOC_TIER_BULK`).
+ * `KNACS_BUFF_MIGRATE` (`__u32` handle) tries to do this immediately and returns `0`
+ * if the buffer is in the OCM afterwards, `ENOMEM` if there isn't enough space, or `EBUSY`
+ * if the memory is being used by a transfer or by an exported dma-buf.
+ * The content and the mappings are kept, the pages are mapped again on the next access.
+ */
+#define KNACS_ALLOC_TIER_MASK (3u << 4)
+#define KNACS_ALLOC_TIER_ANY (0u << 4)
+#define KNACS_ALLOC_TIER_LATENCY (1u << 4)
+#define KNACS_ALLOC_TIER_BULK (2u << 4)
+#define KNACS_ALLOC_MIGRATE (1u << 6)
+
+enum {
+    KNACS_BUFF_LOC_DRAM = 0,
+    KNACS_BUFF_LOC_OCM = 1,
+};
+
+/**
+ * Handle based DMA buffers.
+ *
+ * `KNACS_BUFF_CREATE` allocates a DMA buffer of `size` bytes (a multiple of the page size)
+ * with the `KNACS_ALLOC_*` `flags` and returns a (non-zero) `handle`, as well as
+ * the `offset` (`handle << KNACS_BUFF_OFFSET_SHIFT`) to pass to `mmap` to map it.
+ * The buffer can be mapped (shared) any number of times, in whole or in part
+ * by adding the offset in the buffer to `offset`.
+ *
+ * `KNACS_BUFF_RESIZE` grows the buffer to `size` bytes without moving or copying
+ * the existing data. Existing mappings can then be grown with `mremap`,
+ * which is done in place when the address space after the mapping is free
+ * (or with `MREMAP_MAYMOVE`, which only changes the virtual address).
+ * Buffers cannot be shrunk.
+ *
+ * `KNACS_BUFF_FREE` (`__u32` handle) releases the handle. The memory is freed
+ * when it is also unmapped and not used by any transfer anymore.
+ * The handles belong to the file and are released when it is closed.
+ * There can be at most `KNACS_BUFF_MAX_HANDLES - 1` handles per file.
+ */
+#define KNACS_BUFF_OFFSET_SHIFT 32
+#define KNACS_BUFF_MAX_HANDLES 4096
+typedef struct {
+    __u64 size;
+    __u32 flags;
+    __u32 handle;
+    __u64 offset;
+    __u32 location; // `KNACS_BUFF_LOC_*`
+    __u32 _pad;
+} knacs_buff_create_t;
+typedef struct {
+    __u32 handle;
+    __u32 _pad;
+    __u64 size;
+} knacs_buff_resize_t;
+
+/**
+ * Argument for `KNACS_BUFF_EXPORT`.
+ *
+ * Export the buffer mapped from the device at `addr` (any address in the buffer)
+ * as a dma-buf. On success, `fd` is set to the new dma-buf file descriptor
+ * (close-on-exec), which can be passed to another process.
+ * The whole buffer is exported, for a buffer with a handle this is the buffer
+ * as of the time of the export (later growth is not included).
+ *
+ * The dma-buf can be mapped (shared) with `mmap` on the dma-buf fd with the offset
+ * relative to the start of the buffer. Addresses in such a mapping can be used with
+ * `KNACS_DMA_SUBMIT`, `KNACS_DMA_SYNC` and `KNACS_STREAM_START` the same way
+ * as the original mapping. The memory is shared, no data is copied.
+ * The memory is freed when all the mappings and the dma-buf are gone.
+ * OCM buffers cannot be attached to other devices.
+ */
+typedef struct {
+    __u64 addr;
+    __s32 fd;
+    __u32 _pad;
+} knacs_buff_export_t;
+
+/**
+ * Argument for `KNACS_DMA_SUBMIT`.
+ *
+ * `[addr, addr + len)` must be within a single DMA buffer mapped from the device
+ * (page offset 2 or a buffer handle). The content must not be modified until the transfer is done.
+ * On success, `token` is set to a (non-zero) number identifying the transfer.
+ * Tokens are assigned in submission order and the transfers are done in the same order.
+ * Transfers submitted before the previous one finishes are linked after it on the engine
+ * (up to the `dma_chain_depth` module parameter) so that they run back-to-back.
+ * Each one still gets its own `KNACS_EVENT_DMA_DONE` event.
+ */
+typedef struct {
+    __u64 addr;
+    __u64 len;
+    __u64 token;
+} knacs_dma_submit_t;
+
+/**
+ * `KNACS_DMA_SUBMIT_USER` takes the same argument as `KNACS_DMA_SUBMIT`
+ * but `[addr, addr + len)` can be any readable memory of the process
+ * (up to the `dma_pin_max_size` module parameter).
+ * The pages are pinned and mapped for the device directly instead of being copied
+ * into a DMA buffer first, and are unpinned when the transfer is done.
+ * The cache is cleaned for the whole range on submission. The same as `KNACS_DMA_SUBMIT`,
+ * the content must not be modified until the transfer is done.
+ */
+
+/**
+ * Argument for `KNACS_DMA_WAIT`, the token of the transfer to wait for.
+ */
+typedef __u64 knacs_dma_wait_t;
+
+/**
+ * Argument for `KNACS_DMA_SYNC`.
+ *
+ * `[addr, addr + len)` must be within a single buffer mapped from the device.
+ * With `KNACS_SYNC_FOR_DEVICE`, the data written by the CPU is written back to
+ * the memory. With `KNACS_SYNC_FOR_CPU`, any stale data in the cache is dropped
+ * so that the data written by the hardware can be read.
+ */
+enum {
+    KNACS_SYNC_FOR_DEVICE = 0,
+    KNACS_SYNC_FOR_CPU = 1,
+};
+typedef struct {
+    __u64 addr;
+    __u64 len;
+    __u32 dir;
+    __u32 _pad;
+} knacs_dma_sync_t;
+
+/**
+ * Argument for `KNACS_REG_BATCH`.
+ *
+ * Run a list of 32-bit pulse controller register operations in the kernel
+ * with preemption disabled. `offset` is the byte offset of the register
+ * and must be 4-byte aligned.
+ *
+ * * `KNACS_REG_WRITE`: write `val` to the register.
+ * * `KNACS_REG_READ`: read the register, the result is stored in `val`.
+ * * `KNACS_REG_WAIT`: wait until `(reg & mask) == val`, e.g. for space in a FIFO.
+ *
+ * The whole batch runs with preemption disabled and fails with `ETIMEDOUT` if it
+ * doesn't finish within `timeout_us` (0 for the default, both capped by the module
+ * parameter `reg_wait_max_us`). The time is checked between the operations,
+ * so the batch may run a few operations past the deadline.
+ *
+ * `ops` points to an array of `nops` (at most `KNACS_REG_BATCH_MAX`) operations
+ * which is copied back on return with the read results filled in.
+ * `ndone` is set to the number of operations finished, including when
+ * the batch failed with `ETIMEDOUT`.
+ */
+enum {
+    KNACS_REG_WRITE = 0,
+    KNACS_REG_READ = 1,
+    KNACS_REG_WAIT = 2,
+};
+#define KNACS_REG_BATCH_MAX 4096
+typedef struct {
+    __u32 op;
+    __u32 offset;
+    __u32 val;
+    __u32 mask;
+} knacs_reg_op_t;
+typedef struct {
+    __u64 ops;
+    __u32 nops;
+    __u32 timeout_us;
+    __u32 ndone;
+    __u32 _pad;
+} knacs_reg_batch_t;
+
+/**
+ * io_uring commands (Linux 6.5 or newer).
+ *
+ * `KNACS_DMA_SUBMIT`, `KNACS_DMA_WAIT` and `KNACS_REG_BATCH` can also be queued
+ * with `IORING_OP_URING_CMD` on the device file with `cmd_op` set to the command
+ * and the argument stored inline in the `cmd` area of the SQE as below.
+ * This allows many of them to be done with one syscall,
+ * or without any with `IORING_SETUP_SQPOLL`.
+ *
+ * * `KNACS_DMA_SUBMIT` (`knacs_uring_dma_submit_t`): the CQE is posted when
+ *   the transfer finishes with `res` set to `0` or a negative error code,
+ *   no `KNACS_EVENT_DMA_DONE` event is posted for it.
+ *   With `IORING_SETUP_CQE32`, the token of the transfer is in `big_cqe[0]`.
+ * * `KNACS_DMA_WAIT` (`knacs_dma_wait_t`): the CQE (with `res` `0`) is posted
+ *   when the transfer is done, without blocking the submission.
+ * * `KNACS_REG_BATCH` (`knacs_uring_reg_batch_t`, pointing to the `knacs_reg_batch_t`):
+ *   run during the submission, `res` is the return value of the `ioctl`.
+ *
+ * On Linux 6.7 or newer, the pending `KNACS_DMA_SUBMIT` and `KNACS_DMA_WAIT` are canceled
+ * (with `res` `-ECANCELED`) when the ring is torn down or the task exits instead of waiting
+ * for the hardware. A canceled transfer still runs and posts a `KNACS_EVENT_DMA_DONE` event.
+ */
+typedef struct {
+    __u64 addr;
+    __u64 len;
+} knacs_uring_dma_submit_t;
+typedef struct {
+    __u64 batch;
+} knacs_uring_reg_batch_t;
+
+/**
+ * Argument for `KNACS_STREAM_START`.
+ *
+ * Stream `[addr, addr + len)` in a DMA buffer mapped from the device into the command
+ * FIFO of the pulse controller as 32-bit words, refilling the FIFO from the kernel.
+ * Only one stream can run at a time. The content must not be modified until
+ * the stream is done, which is reported with `KNACS_EVENT_STREAM`.
+ * `KNACS_STREAM_STOP` (no argument) aborts the running stream.
+ */
+typedef struct {
+    __u64 addr;
+    __u64 len;
+} knacs_stream_start_t;
+
+/**
+ * Result for `KNACS_STREAM_GET_STATS`, for the running or the last stream.
+ */
+typedef struct {
+    __u64 words_total; // Number of words in the stream
+    __u64 words_sent; // Number of words written to the FIFO
+    __u64 underflows; // Number of times the FIFO was found empty
+    __u64 fills; // Number of times the FIFO was refilled
+    __u64 elapsed_ns; // Time since the stream started (until it finished)
+    __u64 rate; // Average number of words sent per second
+    __u32 running;
+    __u32 _pad;
+} knacs_stream_stats_t;
+
+/**
+ * Result for `KNACS_DMA_GET_STATS`.
+ */
+typedef struct {
+    __u64 submitted; // Number of transfers submitted
+    __u64 completed; // Number of transfers finished (including failed ones)
+    __u64 errors; // Number of failed transfers
+    __u64 bytes; // Number of bytes transferred
+    __u64 busy_ns; // Total time with a transfer running on the hardware
+    __u32 queued; // Number of transfers currently waiting in the queue
+    __u32 max_queued; // Maximum number of transfers waiting in the queue
+    __u32 desc_total; // Number of SG descriptors in the pool
+    __u32 desc_used; // Number of SG descriptors currently assigned to a transfer
+    __u32 desc_max_used; // Maximum number of SG descriptors assigned at the same time
+    // Number of times a transfer had to be split into multiple packets
+    // because there weren't enough free descriptors.
+    __u32 desc_splits;
+    __u64 chained; // Number of transfers linked after a running one without stopping the engine
+    // Number of transfers that were already submitted when the engine went idle
+    // and were started only after that, and the time between the two for them.
+    __u64 gaps;
+    __u64 gap_ns;
+    __u64 max_gap_ns;
+} knacs_dma_stats_t;
+
+/**
+ * Events that can be read from the device.
+ *
+ * Each open file has its own event queue. Events are only queued for the types
+ * enabled with `KNACS_SET_EVENT_MASK` (a bit mask of `1 << type`, none by default).
+ * `read` returns as many whole events as fit in the buffer and blocks if there's none
+ * (unless the file is non-blocking). `poll` reports readable when the queue is not empty.
+ * An eventfd registered with `KNACS_SET_EVENTFD` (`-1` to unregister)
+ * is also signaled for every queued event.
+ */
+enum {
+    // Some events were dropped because the queue was full.
+    // `token` is the number of dropped events. The oldest events are dropped,
+    // so they all happened before the events that follow this one.
+    KNACS_EVENT_OVERFLOW = 0,
+    // A DMA transfer submitted from this file finished.
+    // `token` is the one returned by `KNACS_DMA_SUBMIT`,
+    // `status` is `0` on success or a negative error code.
+    KNACS_EVENT_DMA_DONE = 1,
+    // Interrupt from the pulse controller. `token` is the interrupt count.
+    KNACS_EVENT_PULSE_CTL = 2,
+    // New data in the receive ring. `token` is the new `head` of the ring.
+    KNACS_EVENT_RX = 3,
+    // The FIFO of the stream started from this file underflowed (`status` is `-EPIPE`)
+    // or the stream finished (`status` is `0` or `-ECANCELED`).
+    // `token` is the number of words sent so far.
+    KNACS_EVENT_STREAM = 4,
+    // Flow control of the transmit ring. `token` is the `head` of the ring.
+    // `status` is `-EAGAIN` when fewer than `low_water` slots are left queued,
+    // `-EPIPE` when the hardware ran out of slots (underrun)
+    // and `0` when all the slots were sent after `KNACS_TX_END` was set.
+    KNACS_EVENT_TX = 5,
+};
+
+typedef struct {
+    __u32 type;
+    __s32 status;
+    __u64 token;
+    __u64 timestamp; // `CLOCK_MONOTONIC` time in ns when the event happened.
+} knacs_event_t;
+
+/**
+ * Receive ring for the data from the FPGA (page offset 3).
+ *
+ * The whole ring must be mapped (shared) at once. The mapping starts with the
+ * `knacs_rx_ring_t` header, followed by `nslots` slots of `slot_size` bytes each
+ * starting at `data_offset`. The hardware fills the slots in order.
+ * `head` and `tail` are free running counters and the slot for counter `i`
+ * is `i % nslots` (`nslots` is a power of 2).
+ *
+ * The kernel fills in `slots[i % nslots]` and then advances `head`.
+ * The user consumes `[tail, head)` and then advances `tail`.
+ * Each slot holds the first `len` bytes of (part of) one packet.
+ * `KNACS_RX_SOF`/`KNACS_RX_EOF` in `flags` marks the first/last slot of a packet.
+ *
+ * The hardware is never stalled waiting for the user. If the user falls behind,
+ * the kernel reuses the oldest slots that are not consumed yet and counts them
+ * in `overflow`. `seq` of a slot is set to the counter it is used for before
+ * the hardware can write to it so the user must check that `seq` equals the counter
+ * both before and after reading the data of a slot and drop the slot otherwise.
+ */
+#define KNACS_RX_SOF (1u << 0)
+#define KNACS_RX_EOF (1u << 1)
+#define KNACS_RX_ERROR (1u << 2)
+
+typedef struct {
+    __u32 seq;
+    __u32 len;
+    __u32 flags;
+    __u32 _reserved;
+} knacs_rx_slot_t;
+
+typedef struct {
+    __u32 nslots;
+    __u32 slot_size;
+    __u32 data_offset;
+    __u32 _reserved;
+    __u32 head; // Written by the kernel
+    __u32 tail; // Written by the user
+    __u32 overflow; // Number of slots dropped
+    __u32 _reserved2;
+    knacs_rx_slot_t slots[];
+} knacs_rx_ring_t;
+
+/**
+ * Result ring (page offset 4).
+ *
+ * When the result FIFO registers of the pulse controller are configured
+ * (module parameters `result_fifo_data_reg` and `result_fifo_count_reg`),
+ * the FIFO is drained into this ring from the pulse controller interrupt
+ * so that the FIFO doesn't overflow when the user thread is delayed.
+ *
+ * The whole ring must be mapped (shared) at once. The mapping starts with the
+ * `knacs_result_ring_t` header, followed by `nentries` entries starting at `entry_offset`.
+ * `head` and `tail` are free running counters and the entry for counter `i`
+ * is `i % nentries` (`nentries` is a power of 2).
+ * The kernel fills in the entries and then advances `head`.
+ * The user consumes `[tail, head)` and then advances `tail`.
+ * The FIFO is always drained, the words that don't fit in the ring are dropped
+ * and counted in `overflow`.
+ *
+ * `timestamp` is the `CLOCK_MONOTONIC` time in ns of the pulse controller interrupt
+ * the word was read for, taken in the interrupt handler. All the words read for one interrupt
+ * (or for several that arrived before the FIFO was drained, in which case the last one)
+ * have the same timestamp.
+ *
+ * `poll` on the device reports `POLLPRI` when there are at least `wake_threshold`
+ * entries in the ring (at least 1), which can be changed by the user at any time.
+ */
+typedef struct {
+    __u64 timestamp;
+    __u32 value;
+    __u32 _reserved;
+} knacs_result_entry_t;
+
+typedef struct {
+    // Written by the kernel
+    __u32 nentries;
+    __u32 entry_offset;
+    __u32 head;
+    __u32 overflow; // Number of words dropped
+    __u32 _reserved[12];
+    // Written by the user, in a separate cache line
+    __u32 tail;
+    __u32 wake_threshold;
+    __u32 _reserved2[14];
+} knacs_result_ring_t;
+
+/**
+ * Argument for `KNACS_TX_RING_START`.
+ *
+ * Stream a sequence of any length through a ring of `nslots` slots
+ * (a power of 2, at most `KNACS_TX_RING_MAX_SLOTS`) of `slot_size` bytes each,
+ * starting at `addr` in a DMA buffer mapped from the device.
+ * Each filled slot is sent as one transfer in order, while the user refills
+ * the ones that were sent, so the kernel memory used doesn't depend on the
+ * length of the sequence. Only one ring can be started per file.
+ * `KNACS_TX_RING_STOP` (no argument) stops submitting new slots, the ones already
+ * submitted still finish. The ring is also stopped when the file is closed.
+ */
+#define KNACS_TX_RING_MAX_SLOTS 256
+
+typedef struct {
+    __u64 addr;
+    __u32 slot_size;
+    __u32 nslots;
+    __u32 low_water; // Report `-EAGAIN` when fewer slots are queued (`0` to disable)
+    __u32 _pad;
+} knacs_tx_ring_start_t;
+
+/**
+ * Control page of the transmit ring (page offset 5), only valid after `KNACS_TX_RING_START`.
+ *
+ * The whole control page must be mapped (shared) at once. The length of each slot
+ * is in the `knacs_tx_slot_t` array starting at `slot_offset`.
+ * `head`, `submitted` and `tail` are free running counters and the slot for counter `i`
+ * is `i % nslots`. The user fills in the data and the length of the slots
+ * `[tail, head + nslots)` and then advances `tail`.
+ * The kernel submits `[submitted, tail)` and advances `head` as the hardware
+ * finishes each slot, at which point the slot can be filled again.
+ *
+ * New slots are picked up when a slot finishes so that the stream keeps going
+ * without syscalls as long as it doesn't run dry. If `submitted == head`
+ * after `tail` is advanced, the user must call `KNACS_TX_RING_PUSH` (no argument)
+ * to submit them. Calling it at other times is harmless.
+ *
+ * `poll` on the device reports `POLLOUT` when there are free slots to fill.
+ * Set `KNACS_TX_END` in `flags` after the last slot is filled so that the end of
+ * the stream isn't reported as an underrun.
+ */
+#define KNACS_TX_END (1u << 0)
+
+typedef struct {
+    __u32 len;
+    __u32 _reserved;
+} knacs_tx_slot_t;
+
+typedef struct {
+    // Written by the kernel
+    __u32 nslots;
+    __u32 slot_size;
+    __u32 slot_offset;
+    __u32 head; // Number of slots finished by the hardware
+    __u32 submitted; // Number of slots submitted to the hardware
+    __u32 low_water_hits; // Number of times fewer than `low_water` slots were queued
+    __u32 underruns; // Number of times the hardware ran out of slots
+    __u32 min_queued; // Minimum number of slots queued when one finished
+    __u32 errors; // Number of slots that failed
+    __u32 _reserved[7];
+    // Written by the user, in a separate cache line
+    __u32 tail;
+    __u32 flags;
+    __u32 _reserved2[14];
+} knacs_tx_ring_t;
+
+/**
+ * Argument for `KNACS_SEQ_CACHE_PUT`.
+ *
+ * Copy `len` bytes at `addr` (any user memory) into a buffer owned by the kernel
+ * and keep it in the sequence cache of the instance under `key`,
+ * which should be computed by the user from the content (e.g. a 64-bit hash).
+ * The kernel doesn't check the content against the key.
+ * Nothing is copied if the key is already in the cache with the same `len`.
+ * If it's cached with a different `len` the key must have collided (or been reused
+ * for a different sequence) and the PUT fails with `EEXIST`. Evict the old sequence
+ * with `KNACS_SEQ_CACHE_EVICT` first to replace it.
+ * `flags` is one of the `KNACS_ALLOC_TIER_*` placement hints and `location`
+ * is set to where the cached copy is (`KNACS_BUFF_LOC_*`).
+ *
+ * The total size of the cache is limited by the `seq_cache_size` module parameter.
+ * The least recently used sequences are evicted when it's full or when there's
+ * no memory left for a new one. A sequence being sent is kept alive until the
+ * transfer finishes even if it's evicted.
+ */
+typedef struct {
+    __u64 key;
+    __u64 addr;
+    __u64 len;
+    __u32 flags;
+    __u32 location;
+} knacs_seq_put_t;
+
+/**
+ * Argument for `KNACS_SEQ_CACHE_SUBMIT`.
+ *
+ * Submit the sequence cached under `key` as a DMA transfer, the same way as `KNACS_DMA_SUBMIT`
+ * (`token` is set to the token of the transfer). Fails with `-ENOENT` if the key isn't
+ * in the cache, in which case the user should upload it with `KNACS_SEQ_CACHE_PUT`.
+ * `KNACS_SEQ_CACHE_EVICT` (`__u64` key) removes a sequence from the cache.
+ */
+typedef struct {
+    __u64 key;
+    __u64 token;
+} knacs_seq_submit_t;
+
+/**
+ * Result for `KNACS_SEQ_CACHE_GET_STATS`, shared by all the instances.
+ */
+typedef struct {
+    __u64 hits; // Number of `KNACS_SEQ_CACHE_SUBMIT` that found the key
+    __u64 misses; // Number of `KNACS_SEQ_CACHE_SUBMIT` that didn't
+    __u64 puts; // Number of sequences copied into the cache
+    __u64 put_hits; // Number of `KNACS_SEQ_CACHE_PUT` skipped since the key was cached
+    __u64 evictions; // Number of sequences evicted to make space
+    __u64 bytes; // Total size of the cached sequences
+    __u64 capacity; // Maximum total size
+    __u32 entries; // Number of cached sequences
+    __u32 _pad;
+} knacs_seq_cache_stats_t;
+
+/**
+ * Usage of one of the memory pools, see `knacs_pool_get_stats_t`.
+ *
+ * `largest_free` is the largest contiguous free extent, i.e. the largest buffer
+ * that can be allocated from the pool without splitting it (OCM buffers are never split).
+ * `frag_ppm` is `1 - largest_free / free` in parts per million, 0 if nothing is free.
+ * All zero if the pool doesn't exist.
+ */
+typedef struct {
+    __u64 size;
+    __u64 free;
+    __u64 largest_free;
+    __u32 frag_ppm;
+    __u32 _pad;
+} knacs_pool_stats_t;
+
+/**
+ * Result for `KNACS_POOL_GET_STATS`, shared by all the instances.
+ *
+ * The values are a snapshot that may be out of date as soon as the ioctl returns,
+ * but are good enough to decide if it's worth trying a large allocation.
+ * The DMA buffers fall back to pages from the system when the DMA pool is exhausted.
+ */
+typedef struct {
+    knacs_pool_stats_t dram; // The DMA pool (`KNACS_BUFF_LOC_DRAM`)
+    knacs_pool_stats_t ocm; // The OCM pool (`KNACS_BUFF_LOC_OCM`)
+} knacs_pool_get_stats_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,144 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM knacs
+
+#if !defined(__KNACS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __KNACS_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+// `name` is the kind of the buffer ("OCM" or "DMA Buff")
+TRACE_EVENT(knacs_buff_alloc,
+    TP_PROTO(const char *name, size_t size, unsigned int nsegs, u64 dma_addr, u64 ns),
+    TP_ARGS(name, size, nsegs, dma_addr, ns),
+    TP_STRUCT__entry(
+        __array(char, name, 16)
+        __field(size_t, size)
+        __field(unsigned int, nsegs)
+        __field(u64, dma_addr)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->name, name, sizeof(__entry->name));
+        __entry->size = size;
+        __entry->nsegs = nsegs;
+        __entry->dma_addr = dma_addr;
+        __entry->ns = ns;
+    ),
+    TP_printk("%s size=%zu nsegs=%u dma_addr=0x%llx ns=%llu", __entry->name,
+              __entry->size, __entry->nsegs, __entry->dma_addr, __entry->ns)
+);
+
+TRACE_EVENT(knacs_buff_free,
+    TP_PROTO(size_t size, u64 dma_addr),
+    TP_ARGS(size, dma_addr),
+    TP_STRUCT__entry(
+        __field(size_t, size)
+        __field(u64, dma_addr)
+    ),
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->dma_addr = dma_addr;
+    ),
+    TP_printk("size=%zu dma_addr=0x%llx", __entry->size, __entry->dma_addr)
+);
+
+DECLARE_EVENT_CLASS(knacs_vma,
+    TP_PROTO(unsigned long start, unsigned long end, unsigned long pgoff),
+    TP_ARGS(start, end, pgoff),
+    TP_STRUCT__entry(
+        __field(unsigned long, start)
+        __field(unsigned long, end)
+        __field(unsigned long, pgoff)
+    ),
+    TP_fast_assign(
+        __entry->start = start;
+        __entry->end = end;
+        __entry->pgoff = pgoff;
+    ),
+    TP_printk("0x%lx-0x%lx pgoff=%lu", __entry->start, __entry->end, __entry->pgoff)
+);
+
+DEFINE_EVENT(knacs_vma, knacs_buff_map,
+    TP_PROTO(unsigned long start, unsigned long end, unsigned long pgoff),
+    TP_ARGS(start, end, pgoff));
+
+DEFINE_EVENT(knacs_vma, knacs_buff_unmap,
+    TP_PROTO(unsigned long start, unsigned long end, unsigned long pgoff),
+    TP_ARGS(start, end, pgoff));
+
+TRACE_EVENT(knacs_pulse_ctl_mmap,
+    TP_PROTO(size_t size, int ret, u64 ns),
+    TP_ARGS(size, ret, ns),
+    TP_STRUCT__entry(
+        __field(size_t, size)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("size=%zu ret=%d ns=%llu", __entry->size, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(knacs_dma_submit,
+    TP_PROTO(u64 token, size_t len, unsigned int npieces),
+    TP_ARGS(token, len, npieces),
+    TP_STRUCT__entry(
+        __field(u64, token)
+        __field(size_t, len)
+        __field(unsigned int, npieces)
+    ),
+    TP_fast_assign(
+        __entry->token = token;
+        __entry->len = len;
+        __entry->npieces = npieces;
+    ),
+    TP_printk("token=%llu len=%zu npieces=%u", __entry->token, __entry->len,
+              __entry->npieces)
+);
+
+// `ns` is the time since the transfer was submitted.
+TRACE_EVENT(knacs_dma_complete,
+    TP_PROTO(u64 token, int status, u64 ns),
+    TP_ARGS(token, status, ns),
+    TP_STRUCT__entry(
+        __field(u64, token)
+        __field(int, status)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->token = token;
+        __entry->status = status;
+        __entry->ns = ns;
+    ),
+    TP_printk("token=%llu status=%d ns=%llu", __entry->token, __entry->status, __entry->ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE knacs_trace
+#include <trace/define_trace.h>
@@ -24,9 +24,25 @@
 
 #include "knacs.h"
 
+#include "axi_dma.h"
+#include "completion.h"
 #include "dma_buff.h"
+#include "dma_engine.h"
+#include "dma_export.h"
+#include "dma_loopback.h"
+#include "dma_page.h"
+#include "dma_pin.h"
+#include "dma_rx.h"
+#include "dma_tx.h"
+#include "event.h"
+#include "instance.h"
 #include "ocm.h"
 #include "pulse_ctrl.h"
+#include "pulse_stream.h"
+#include "result_ring.h"
+#include "seq_cache.h"
+#include "stats.h"
+#include "uring.h"
 
 #include <linux/module.h>
 #include <linux/fs.h>
@@ -50,8 +66,9 @@ MODULE_VERSION("0.1");
 static int knacs_dev_open(struct inode*, struct file*);
 static int knacs_dev_release(struct inode*, struct file*);
 
-/* static ssize_t knacs_dev_read(struct file*, char*, size_t, loff_t*); */
+static ssize_t knacs_dev_read(struct file*, char __user*, size_t, loff_t*);
 /* static ssize_t knacs_dev_write(struct file*, const char*, size_t, loff_t*); */
+static __poll_t knacs_dev_poll(struct file*, poll_table*);
 
 static long knacs_dev_ioctl(struct file *file, unsigned int cmd,
                             unsigned long arg);
@@ -60,11 +77,18 @@ static int knacs_dev_mmap(struct file *filp, struct vm_area_struct *vma);
 static const struct file_operations knacs_fops = {
     .owner = THIS_MODULE,
     .open = knacs_dev_open,
-    /* .read = knacs_dev_read, */
+    .read = knacs_dev_read,
     /* .write = knacs_dev_write, */
+    .poll = knacs_dev_poll,
     .release = knacs_dev_release,
     .mmap = knacs_dev_mmap,
     .unlocked_ioctl = knacs_dev_ioctl,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .get_unmapped_area = knacs_dma_buff_get_unmapped_area,
+#endif
+#ifdef KNACS_HAS_URING_CMD
+    .uring_cmd = knacs_uring_cmd,
+#endif
 };
 
 static int majorNumber;
@@ -74,6 +98,8 @@ static struct device *knacsDevice = NULL;
 static int __init knacs_init(void)
 {
     int err = 0;
+    knacs_instance_init();
+
     // Try to dynamically allocate a major number for the device --
     // more difficult but worth it
     majorNumber = register_chrdev(0, DEVICE_NAME, &knacs_fops);
@@ -96,7 +122,9 @@ static int __init knacs_init(void)
         goto class_create_fail;
     }
 
-    // Register the device driver
+    // Register the device driver. `/dev/knacs` is always available (as instance 0)
+    // even without a pulse controller. The per-instance devices `/dev/knacsN`
+    // (with minor `N + 1`) are created when the pulse controllers are probed.
     knacsDevice = device_create(nacsClass, NULL, MKDEV(majorNumber, 0), NULL,
                                 DEVICE_NAME);
     if (IS_ERR(knacsDevice)) {
@@ -105,6 +133,18 @@ static int __init knacs_init(void)
         goto dev_create_fail;
     }
 
+    knacs_debugfs_init();
+
+    if ((err = knacs_event_init()))
+        goto event_init_fail;
+    knacs_seq_cache_init();
+
+    if ((err = knacs_completion_init()))
+        goto completion_init_fail;
+
+    if ((err = knacs_pulse_stream_init()))
+        goto pulse_stream_init_fail;
+
     if ((err = knacs_pulse_ctl_init()))
         goto pulse_ctl_init_fail;
 
@@ -114,13 +154,30 @@ static int __init knacs_init(void)
     if ((err = knacs_dma_buff_init()))
         goto dma_buff_init_fail;
 
+    if ((err = knacs_axi_dma_init()))
+        goto axi_dma_init_fail;
+
+    if ((err = knacs_dma_loopback_init()))
+        goto dma_loopback_init_fail;
+
     return 0;
 
+dma_loopback_init_fail:
+    knacs_axi_dma_exit();
+axi_dma_init_fail:
+    knacs_dma_buff_exit();
 dma_buff_init_fail:
     knacs_ocm_exit();
 ocm_init_fail:
     knacs_pulse_ctl_exit();
 pulse_ctl_init_fail:
+    knacs_pulse_stream_exit();
+pulse_stream_init_fail:
+    knacs_completion_exit();
+completion_init_fail:
+    knacs_event_exit();
+event_init_fail:
+    knacs_debugfs_exit();
     device_destroy(nacsClass, MKDEV(majorNumber, 0)); // remove the device
 dev_create_fail:
     class_destroy(nacsClass);
@@ -132,9 +189,17 @@ reg_dev_fail:
 
 static void __exit knacs_exit(void)
 {
+    knacs_dma_loopback_exit();
+    knacs_axi_dma_exit();
+    knacs_seq_cache_exit();
+    knacs_dma_pin_exit();
     knacs_dma_buff_exit();
     knacs_ocm_exit();
     knacs_pulse_ctl_exit();
+    knacs_pulse_stream_exit();
+    knacs_completion_exit();
+    knacs_event_exit();
+    knacs_debugfs_exit();
     device_destroy(nacsClass, MKDEV(majorNumber, 0)); // remove the device
     class_unregister(nacsClass); // unregister the device class
     class_destroy(nacsClass); // remove the device class
@@ -142,16 +207,54 @@ static void __exit knacs_exit(void)
     pr_debug("Goodbye.\n");
 }
 
+int knacs_chrdev_create(struct knacs_instance *inst)
+{
+    struct device *dev = device_create(nacsClass, NULL, MKDEV(majorNumber, inst->idx + 1),
+                                       inst, DEVICE_NAME "%u", inst->idx);
+    if (IS_ERR(dev)) {
+        pr_alert("Failed to create the device for instance %u\n", inst->idx);
+        return PTR_ERR(dev);
+    }
+    inst->chrdev = dev;
+    return 0;
+}
+
+void knacs_chrdev_destroy(struct knacs_instance *inst)
+{
+    if (!inst->chrdev)
+        return;
+    device_destroy(nacsClass, MKDEV(majorNumber, inst->idx + 1));
+    inst->chrdev = NULL;
+}
+
 static int
 knacs_dev_open(struct inode *inodep, struct file *filep)
 {
+    unsigned int minor = iminor(inodep);
+    struct knacs_instance *inst = knacs_instance_get(minor == 0 ? 0 : minor - 1);
+    if (!inst)
+        return -ENODEV;
+    struct knacs_file *kfile = knacs_file_create(inst);
+    if (!kfile)
+        return -ENOMEM;
+    filep->private_data = kfile;
     return 0;
 }
 
-/* static ssize_t */
-/* knacs_dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) */
-/* { */
-/* } */
+static ssize_t
+knacs_dev_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+{
+    return knacs_file_read_events(filep->private_data, buffer, len,
+                                  filep->f_flags & O_NONBLOCK);
+}
+
+static __poll_t
+knacs_dev_poll(struct file *filep, poll_table *wait)
+{
+    struct knacs_file *kfile = filep->private_data;
+    return knacs_file_poll(kfile, filep, wait) |
+        knacs_result_ring_poll(kfile->inst, filep, wait) | knacs_tx_ring_poll(kfile);
+}
 
 /* static ssize_t */
 /* knacs_dev_write(struct file *filep, const char *buffer, size_t len, */
@@ -162,12 +265,17 @@ knacs_dev_open(struct inode *inodep, struct file *filep)
 static int
 knacs_dev_release(struct inode *inodep, struct file *filep)
 {
+    knacs_tx_ring_stop(filep->private_data);
+    knacs_dma_buff_release(filep->private_data);
+    knacs_file_release(filep->private_data);
     return 0;
 }
 
 static long
 knacs_dev_ioctl(struct file *file, unsigned int cmd, unsigned long _arg)
 {
+    struct knacs_file *kfile = file->private_data;
+    struct knacs_instance *inst = kfile->inst;
     switch (cmd) {
     case KNACS_GET_VERSION: {
         const int major_ver = KNACS_MAJOR_VER;
@@ -179,6 +287,133 @@ knacs_dev_ioctl(struct file *file, unsigned int cmd, unsigned long _arg)
         }
         break;
     }
+    case KNACS_DMA_SUBMIT: {
+        knacs_dma_submit_t *arg = (knacs_dma_submit_t*)_arg;
+        knacs_dma_submit_t submit;
+        if (copy_from_user(&submit, arg, sizeof(submit)))
+            return -EFAULT;
+        int err = knacs_dma_submit(kfile, submit.addr, submit.len, NULL,
+                                   &submit.token);
+        if (err)
+            return err;
+        if (copy_to_user(&arg->token, &submit.token, sizeof(submit.token)))
+            return -EFAULT;
+        break;
+    }
+    case KNACS_DMA_WAIT: {
+        knacs_dma_wait_t token;
+        if (copy_from_user(&token, (knacs_dma_wait_t*)_arg, sizeof(token)))
+            return -EFAULT;
+        return knacs_dma_wait(inst, token);
+    }
+    case KNACS_DMA_GET_STATS: {
+        knacs_dma_stats_t stats;
+        int err = knacs_dma_get_stats(inst, &stats);
+        if (err)
+            return err;
+        if (copy_to_user((knacs_dma_stats_t*)_arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        break;
+    }
+    case KNACS_SET_EVENT_MASK: {
+        __u32 mask;
+        if (copy_from_user(&mask, (__u32*)_arg, sizeof(mask)))
+            return -EFAULT;
+        return knacs_file_set_event_mask(kfile, mask);
+    }
+    case KNACS_SET_EVENTFD: {
+        int fd;
+        if (copy_from_user(&fd, (int*)_arg, sizeof(fd)))
+            return -EFAULT;
+        return knacs_file_set_eventfd(kfile, fd);
+    }
+    case KNACS_SET_ALLOC_FLAGS: {
+        __u32 flags;
+        if (copy_from_user(&flags, (__u32*)_arg, sizeof(flags)))
+            return -EFAULT;
+        if (!knacs_alloc_flags_valid(flags))
+            return -EINVAL;
+        WRITE_ONCE(kfile->alloc_flags, flags);
+        return 0;
+    }
+    case KNACS_DMA_SYNC: {
+        knacs_dma_sync_t sync;
+        if (copy_from_user(&sync, (knacs_dma_sync_t*)_arg, sizeof(sync)))
+            return -EFAULT;
+        if (sync.dir != KNACS_SYNC_FOR_DEVICE && sync.dir != KNACS_SYNC_FOR_CPU)
+            return -EINVAL;
+        return knacs_dma_sync(inst, sync.addr, sync.len, sync.dir == KNACS_SYNC_FOR_DEVICE);
+    }
+    case KNACS_REG_BATCH:
+        return knacs_pulse_ctl_batch(inst, (knacs_reg_batch_t __user*)_arg);
+    case KNACS_STREAM_START: {
+        knacs_stream_start_t start;
+        if (copy_from_user(&start, (knacs_stream_start_t*)_arg, sizeof(start)))
+            return -EFAULT;
+        return knacs_pulse_stream_start(kfile, start.addr, start.len);
+    }
+    case KNACS_STREAM_STOP:
+        knacs_pulse_stream_stop(inst);
+        break;
+    case KNACS_STREAM_GET_STATS: {
+        knacs_stream_stats_t stats;
+        knacs_pulse_stream_get_stats(inst, &stats);
+        if (copy_to_user((knacs_stream_stats_t*)_arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        break;
+    }
+    case KNACS_BUFF_CREATE:
+        return knacs_dma_buff_create(kfile, (knacs_buff_create_t __user*)_arg);
+    case KNACS_BUFF_RESIZE:
+        return knacs_dma_buff_resize(kfile, (knacs_buff_resize_t __user*)_arg);
+    case KNACS_BUFF_FREE: {
+        __u32 handle;
+        if (copy_from_user(&handle, (__u32*)_arg, sizeof(handle)))
+            return -EFAULT;
+        return knacs_dma_buff_free(kfile, handle);
+    }
+    case KNACS_BUFF_EXPORT:
+        return knacs_dma_export(kfile, (knacs_buff_export_t __user*)_arg);
+    case KNACS_BUFF_MIGRATE: {
+        __u32 handle;
+        if (copy_from_user(&handle, (__u32*)_arg, sizeof(handle)))
+            return -EFAULT;
+        return knacs_dma_buff_migrate(kfile, handle);
+    }
+    case KNACS_TX_RING_START:
+        return knacs_tx_ring_start(kfile, (knacs_tx_ring_start_t __user*)_arg);
+    case KNACS_TX_RING_PUSH:
+        return knacs_tx_ring_push(kfile);
+    case KNACS_TX_RING_STOP:
+        knacs_tx_ring_stop(kfile);
+        break;
+    case KNACS_SEQ_CACHE_PUT:
+        return knacs_seq_cache_put(kfile, (knacs_seq_put_t __user*)_arg);
+    case KNACS_SEQ_CACHE_SUBMIT:
+        return knacs_seq_cache_submit(kfile, (knacs_seq_submit_t __user*)_arg);
+    case KNACS_SEQ_CACHE_EVICT: {
+        __u64 key;
+        if (copy_from_user(&key, (__u64*)_arg, sizeof(key)))
+            return -EFAULT;
+        return knacs_seq_cache_evict(kfile, key);
+    }
+    case KNACS_SEQ_CACHE_GET_STATS: {
+        knacs_seq_cache_stats_t stats;
+        knacs_seq_cache_get_stats(&stats);
+        if (copy_to_user((knacs_seq_cache_stats_t*)_arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        break;
+    }
+    case KNACS_DMA_SUBMIT_USER:
+        return knacs_dma_submit_user(kfile, (knacs_dma_submit_t __user*)_arg);
+    case KNACS_POOL_GET_STATS: {
+        knacs_pool_get_stats_t stats;
+        knacs_gen_pool_get_stats(knacs_dma_page_pool(), &stats.dram);
+        knacs_gen_pool_get_stats(knacs_ocm_pool(), &stats.ocm);
+        if (copy_to_user((knacs_pool_get_stats_t*)_arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        break;
+    }
     default:
         return -EINVAL;
     }
@@ -190,12 +425,20 @@ static int
 knacs_dev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
     // The first page is the pulse controller registers
-    if (vma->vm_pgoff == 0)
+    if (vma->vm_pgoff == KNACS_MMAP_PULSE_CTL)
         return knacs_pulse_ctl_mmap(filp, vma);
-    if (vma->vm_pgoff == 1)
+    if (vma->vm_pgoff == KNACS_MMAP_OCM)
         return knacs_ocm_mmap(filp, vma);
-    if (vma->vm_pgoff == 2)
+    if (vma->vm_pgoff == KNACS_MMAP_DMA_BUFF)
         return knacs_dma_buff_mmap(filp, vma);
+    if (vma->vm_pgoff == KNACS_MMAP_RX_RING)
+        return knacs_rx_mmap(filp, vma);
+    if (vma->vm_pgoff == KNACS_MMAP_RESULT_RING)
+        return knacs_result_ring_mmap(filp, vma);
+    if (vma->vm_pgoff == KNACS_MMAP_TX_RING)
+        return knacs_tx_ring_mmap(filp, vma);
+    if (knacs_dma_buff_is_handle(vma->vm_pgoff))
+        return knacs_dma_buff_mmap_handle(filp, vma);
     pr_alert("Mapping unknown pages.\n");
     return -EINVAL;
 }
@@ -30,22 +30,60 @@
  * The allocation interface for userspace is to mmap the `knacs` device with page offset 1.
  * The size of the allocation is determined by the mmap size and the map must be shared.
  * Multiple mappings can be made on the same fd which will result in independent allocations.
+ *
+ * For testing without the hardware, `ocm_mock_size` can be set to create a pool
+ * of the given size from normal memory instead.
  */
 
 #include "ocm.h"
 
 #include "buff_alloc.h"
 #include "knacs.h"
+#include "stats.h"
 
 #include <linux/genalloc.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
 #include <linux/of_device.h>
 
 const char *const ocmc_comp = "xlnx,zynq-ocmc-1.0";
 static struct device_node *ocmc_dev_node = NULL;
 static struct gen_pool *ocmc_pool = NULL;
 
+static unsigned int ocm_mock_size = 0;
+module_param(ocm_mock_size, uint, 0444);
+MODULE_PARM_DESC(ocm_mock_size, "Size of the mock OCM pool backed by normal memory (0 to use the real OCM)");
+static void *ocm_mock_mem = NULL;
+
+static int ocm_mock_init(void)
+{
+    size_t size = PAGE_ALIGN(ocm_mock_size);
+    ocm_mock_mem = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+    if (!ocm_mock_mem)
+        return -ENOMEM;
+    ocmc_pool = gen_pool_create(PAGE_SHIFT, NUMA_NO_NODE);
+    if (!ocmc_pool)
+        goto free_mem;
+    if (gen_pool_add_virt(ocmc_pool, (unsigned long)ocm_mock_mem, virt_to_phys(ocm_mock_mem),
+                          size, NUMA_NO_NODE))
+        goto destroy_pool;
+    pr_info("Created mock OCM pool of %zu bytes\n", size);
+    return 0;
+
+destroy_pool:
+    gen_pool_destroy(ocmc_pool);
+    ocmc_pool = NULL;
+free_mem:
+    free_pages_exact(ocm_mock_mem, size);
+    ocm_mock_mem = NULL;
+    return -ENOMEM;
+}
+
 int __init knacs_ocm_init(void)
 {
+    if (ocm_mock_size)
+        return ocm_mock_init();
+
     // Get a hold of the OCM pool.
     // Logic copied from `zynq_pm_remap_ocm` in `arch/arm/mach-zynq/pm.c`.
     // Don't fail the module loading if this fail, we'll simply fail at allocation time instead.
@@ -73,6 +111,12 @@ failed:
 
 void knacs_ocm_exit(void)
 {
+    if (ocm_mock_mem) {
+        // All the buffers must have been freed by now.
+        gen_pool_destroy(ocmc_pool);
+        free_pages_exact(ocm_mock_mem, PAGE_ALIGN(ocm_mock_size));
+        ocm_mock_mem = NULL;
+    }
     ocmc_pool = NULL;
     if (ocmc_dev_node)
         of_node_put(ocmc_dev_node);
@@ -81,5 +125,18 @@ void knacs_ocm_exit(void)
 
 int knacs_ocm_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    return knacs_buff_alloc_mmap(ocmc_pool, vma, "OCM");
+    u64 t0 = ktime_get_ns();
+    int ret = knacs_buff_alloc_mmap(ocmc_pool, vma, "OCM");
+    knacs_lat_record(KNACS_LAT_OCM_MMAP, ktime_get_ns() - t0);
+    return ret;
+}
+
+struct gen_pool *knacs_ocm_pool(void)
+{
+    return ocmc_pool;
+}
+
+void knacs_ocm_show(struct seq_file *m)
+{
+    knacs_gen_pool_show(m, "OCM pool", ocmc_pool);
 }
@@ -21,10 +21,15 @@
 #define __KNACS_OCM_H__
 
 #include <linux/fs.h>
+#include <linux/genalloc.h>
 #include <linux/mm.h>
+#include <linux/seq_file.h>
 
 int knacs_ocm_init(void);
 void knacs_ocm_exit(void);
 int knacs_ocm_mmap(struct file*, struct vm_area_struct*);
+// The OCM pool, `NULL` if there's no OCM.
+struct gen_pool *knacs_ocm_pool(void);
+void knacs_ocm_show(struct seq_file*);
 
 #endif
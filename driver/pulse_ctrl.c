@@ -21,39 +21,208 @@
 
 #include "pulse_ctrl.h"
 
+#include "completion.h"
+#include "event.h"
+#include "instance.h"
+#include "knacs_trace.h"
+#include "pulse_stream.h"
+#include "result_ring.h"
+#include "stats.h"
+
+#include <linux/interrupt.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
 #include <linux/of_platform.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
 
-static struct resource *pulse_ctl_regs = NULL;
+static unsigned int reg_wait_max_us = 1000;
+module_param(reg_wait_max_us, uint, 0644);
+MODULE_PARM_DESC(reg_wait_max_us, "Maximum time a register batch (including the waits) runs with preemption disabled");
+
+static unsigned int pulse_ctl_mock = 0;
+module_param(pulse_ctl_mock, uint, 0444);
+MODULE_PARM_DESC(pulse_ctl_mock, "Number of mock pulse controllers backed by a page of normal memory");
+
+static struct platform_device *pulse_ctl_mock_pdevs[KNACS_MAX_INSTANCES];
+
+// We only drain the result FIFO and refill the command FIFO if they are in use.
+// Interrupts that come in before the work runs are handled together
+// and only generate one event.
+static void knacs_pulse_ctl_work_func(struct kthread_work *work)
+{
+    struct knacs_instance *inst = container_of(work, struct knacs_instance, pulse_ctl_work);
+    u64 irq_ns = atomic64_xchg(&inst->pulse_ctl_irq_ns, 0);
+    int idx = knacs_pulse_ctl_regs_lock();
+    size_t regs_size;
+    // Nothing to drain once the controller is going away.
+    if (knacs_pulse_ctl_regs(inst, &regs_size))
+        knacs_result_ring_process(inst, irq_ns ? irq_ns : ktime_get_ns());
+    knacs_pulse_ctl_regs_unlock(idx);
+    knacs_event_broadcast(inst, KNACS_EVENT_PULSE_CTL, 0,
+                          atomic64_read(&inst->pulse_ctl_irq_count));
+    knacs_pulse_stream_irq(inst);
+}
+
+// The interrupt line is expected to be edge triggered (as configured in the device tree)
+// so there's nothing to acknowledge here. Finding out the reason of the interrupt
+// is left to the user which has the register mapping anyway.
+static irqreturn_t knacs_pulse_ctl_irq_handler(int irq, void *data)
+{
+    struct knacs_instance *inst = data;
+    // Taken here so that the scheduling delay of the completion thread
+    // doesn't show up in the timestamps of the results.
+    atomic64_set(&inst->pulse_ctl_irq_ns, ktime_get_ns());
+    atomic64_inc(&inst->pulse_ctl_irq_count);
+    knacs_completion_queue(&inst->pulse_ctl_work);
+    return IRQ_HANDLED;
+}
+
+// The registers of the mock controller are a page of memory
+// that can be accessed and mapped the same way as the real ones.
+static int pulse_ctl_mock_setup(struct knacs_instance *inst)
+{
+    inst->pulse_ctl_mock_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!inst->pulse_ctl_mock_page)
+        return -ENOMEM;
+    inst->pulse_ctl_mock_res = (struct resource)DEFINE_RES_MEM_NAMED(
+        page_to_phys(inst->pulse_ctl_mock_page), PAGE_SIZE, "knacs-pulse-controller-mock");
+    inst->pulse_ctl_regs = &inst->pulse_ctl_mock_res;
+    inst->pulse_ctl_base = (void __iomem*)page_address(inst->pulse_ctl_mock_page);
+    pr_info("mock pulse controller %u @0x%lx\n", inst->idx,
+            (unsigned long)inst->pulse_ctl_regs->start);
+    return 0;
+}
+
+static int pulse_ctl_map_regs(struct knacs_instance *inst, struct resource *regs)
+{
+    if  (!regs || !request_mem_region(regs->start, resource_size(regs),
+                                      "knacs-pulse-controller")) {
+        pr_alert("Failed to request pulse controller registers\n");
+        return -EBUSY;
+    }
+    inst->pulse_ctl_mapped = ioremap(regs->start, resource_size(regs));
+    inst->pulse_ctl_base = inst->pulse_ctl_mapped;
+    if (!inst->pulse_ctl_base) {
+        pr_alert("Failed to map pulse controller registers\n");
+        release_mem_region(regs->start, resource_size(regs));
+        return -ENOMEM;
+    }
+    inst->pulse_ctl_regs = regs;
+    pr_info("pulse controller %u probe\n", inst->idx);
+    pr_info("    res->start @0x%lx\n", (unsigned long)regs->start);
+    return 0;
+}
+
+// Protects the register windows of all the instances, see `knacs_pulse_ctl_regs_lock`.
+DEFINE_STATIC_SRCU(pulse_ctl_srcu);
+
+int knacs_pulse_ctl_regs_lock(void)
+{
+    return srcu_read_lock(&pulse_ctl_srcu);
+}
+
+void knacs_pulse_ctl_regs_unlock(int idx)
+{
+    srcu_read_unlock(&pulse_ctl_srcu, idx);
+}
+
+// Hide the registers from new users and wait for the current ones to finish.
+static void pulse_ctl_unpublish_regs(struct knacs_instance *inst)
+{
+    WRITE_ONCE(inst->pulse_ctl_base, NULL);
+    synchronize_srcu(&pulse_ctl_srcu);
+}
+
+static void pulse_ctl_release_regs(struct knacs_instance *inst)
+{
+    if (inst->pulse_ctl_mock_page) {
+        __free_page(inst->pulse_ctl_mock_page);
+        inst->pulse_ctl_mock_page = NULL;
+    } else if (inst->pulse_ctl_regs) {
+        iounmap(inst->pulse_ctl_mapped);
+        release_mem_region(inst->pulse_ctl_regs->start, resource_size(inst->pulse_ctl_regs));
+    }
+    inst->pulse_ctl_base = NULL;
+    inst->pulse_ctl_mapped = NULL;
+    inst->pulse_ctl_regs = NULL;
+}
+
+static void pulse_ctl_free_irq(struct platform_device *pdev, struct knacs_instance *inst)
+{
+    if (!inst->pulse_ctl_irq)
+        return;
+    devm_free_irq(&pdev->dev, inst->pulse_ctl_irq, inst);
+    knacs_completion_cancel(&inst->pulse_ctl_work);
+    inst->pulse_ctl_irq = 0;
+}
 
 static int knacs_pulse_ctl_probe(struct platform_device *pdev)
 {
-    if (pulse_ctl_regs) {
-        pr_alert("Only one pulse controller is allowed\n");
+    struct resource *regs = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    // The mock devices don't have any resource and use the device ID as the instance.
+    bool mock = !regs && pulse_ctl_mock;
+    struct knacs_instance *inst = mock ? knacs_instance_get(pdev->id) :
+        knacs_instance_of(&pdev->dev);
+    if (!inst)
+        return -EINVAL;
+    if (inst->pulse_ctl_regs) {
+        pr_alert("Only one pulse controller is allowed per instance\n");
         return -EINVAL;
     }
 
-    pulse_ctl_regs = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    if  (!pulse_ctl_regs ||
-         !request_mem_region(pulse_ctl_regs->start,
-                             resource_size(pulse_ctl_regs),
-                             "knacs-pulse-controller")) {
-        pr_alert("Failed to request pulse controller registers\n");
-        return -EBUSY;
+    int err = mock ? pulse_ctl_mock_setup(inst) : pulse_ctl_map_regs(inst, regs);
+    if (err)
+        return err;
+    if ((err = knacs_result_ring_setup(inst)))
+        goto release;
+
+    // The interrupt is optional, the user will need to poll the registers without it.
+    int irq = mock ? 0 : platform_get_irq_optional(pdev, 0);
+    kthread_init_work(&inst->pulse_ctl_work, knacs_pulse_ctl_work_func);
+    if (irq > 0) {
+        err = devm_request_irq(&pdev->dev, irq, knacs_pulse_ctl_irq_handler, 0,
+                               "knacs-pulse-controller", inst);
+        if (err) {
+            pr_alert("Failed to request IRQ %d\n", irq);
+            goto teardown;
+        }
+        pr_info("    irq %d\n", irq);
+        inst->pulse_ctl_irq = irq;
     }
-    pr_info("pulse controller probe\n");
-    pr_info("    res->start @0x%x\n", pulse_ctl_regs->start);
 
+    if ((err = knacs_chrdev_create(inst)))
+        goto free_irq;
+    if (inst->pulse_ctl_irq)
+        knacs_completion_add_irq(inst->pulse_ctl_irq);
+    platform_set_drvdata(pdev, inst);
     return 0;
+
+free_irq:
+    pulse_ctl_free_irq(pdev, inst);
+teardown:
+    knacs_result_ring_teardown(inst);
+release:
+    pulse_ctl_release_regs(inst);
+    return err;
 }
 
 static int knacs_pulse_ctl_remove(struct platform_device *pdev)
 {
-    if (pulse_ctl_regs) {
-        release_mem_region(pulse_ctl_regs->start,
-                           resource_size(pulse_ctl_regs));
-        pulse_ctl_regs = NULL;
-    }
+    struct knacs_instance *inst = platform_get_drvdata(pdev);
+    knacs_chrdev_destroy(inst);
+    if (inst->pulse_ctl_irq)
+        knacs_completion_remove_irq(inst->pulse_ctl_irq);
+    pulse_ctl_free_irq(pdev, inst);
+    // The files may outlive the device. Make sure no batch is running
+    // and no stream can be started before unmapping the registers.
+    pulse_ctl_unpublish_regs(inst);
+    // The stream might be using the registers.
+    knacs_pulse_stream_stop(inst);
+    knacs_result_ring_teardown(inst);
+    pulse_ctl_release_regs(inst);
     return 0;
 }
 
@@ -87,13 +256,17 @@ static int knacs_pulse_ctl_mmap_hardcode(struct file *filp, struct vm_area_struc
 #endif
 }
 
-int knacs_pulse_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
+static int pulse_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    if (!pulse_ctl_regs)
-        return knacs_pulse_ctl_mmap_hardcode(filp, vma);
+    struct knacs_file *kfile = filp->private_data;
+    struct knacs_instance *inst = kfile->inst;
+    struct resource *regs = inst->pulse_ctl_regs;
+    // The hard coded address is only for the first controller.
+    if (!regs)
+        return inst->idx == 0 ? knacs_pulse_ctl_mmap_hardcode(filp, vma) : -ENODEV;
 
     unsigned long requested_size = vma->vm_end - vma->vm_start;
-    if (requested_size > resource_size(pulse_ctl_regs)) {
+    if (requested_size > resource_size(regs)) {
         pr_alert("MMap size too large for pulse controller\n");
         return -EINVAL;
     }
@@ -107,10 +280,117 @@ int knacs_pulse_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
     pr_debug("mmap pulse controller\n");
 
     return remap_pfn_range(vma, vma->vm_start,
-                           pulse_ctl_regs->start >> PAGE_SHIFT,
+                           regs->start >> PAGE_SHIFT,
                            requested_size, vma->vm_page_prot);
 }
 
+int knacs_pulse_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    u64 t0 = ktime_get_ns();
+    int ret = pulse_ctl_mmap(filp, vma);
+    u64 ns = ktime_get_ns() - t0;
+    knacs_lat_record(KNACS_LAT_PULSE_CTL_MMAP, ns);
+    trace_knacs_pulse_ctl_mmap(vma->vm_end - vma->vm_start, ret, ns);
+    return ret;
+}
+
+void __iomem *knacs_pulse_ctl_regs(struct knacs_instance *inst, size_t *size)
+{
+    // The resource is only cleared after the users are gone.
+    void __iomem *base = READ_ONCE(inst->pulse_ctl_base);
+    if (!base)
+        return NULL;
+    *size = resource_size(inst->pulse_ctl_regs);
+    return base;
+}
+
+// Returns the number of operations finished.
+// Number of operations between the checks of the deadline
+// when there's nothing to wait for.
+#define REG_DEADLINE_CHECK 16
+
+static u32 knacs_pulse_ctl_run(void __iomem *base, knacs_reg_op_t *ops, u32 nops,
+                               u64 timeout_ns)
+{
+    // The deadline is for the whole batch so that it bounds the time
+    // spent with preemption disabled.
+    u64 deadline = ktime_get_ns() + timeout_ns;
+    // The registers are only accessed by the CPU so there's no need for the barriers
+    // for ordering with the memory. The accesses to the same device are still in order.
+    u32 i;
+    for (i = 0; i < nops; i++) {
+        knacs_reg_op_t *op = &ops[i];
+        void __iomem *reg = base + op->offset;
+        if (i % REG_DEADLINE_CHECK == REG_DEADLINE_CHECK - 1 && ktime_get_ns() > deadline)
+            return i;
+        if (op->op == KNACS_REG_WRITE) {
+            writel_relaxed(op->val, reg);
+        } else if (op->op == KNACS_REG_READ) {
+            op->val = readl_relaxed(reg);
+        } else if ((readl_relaxed(reg) & op->mask) != op->val) {
+            while ((readl_relaxed(reg) & op->mask) != op->val) {
+                if (ktime_get_ns() > deadline)
+                    return i;
+                cpu_relax();
+            }
+        }
+    }
+    return i;
+}
+
+int knacs_pulse_ctl_batch(struct knacs_instance *inst, knacs_reg_batch_t __user *arg)
+{
+    knacs_reg_batch_t batch;
+    if (copy_from_user(&batch, arg, sizeof(batch)))
+        return -EFAULT;
+    if (batch.nops == 0 || batch.nops > KNACS_REG_BATCH_MAX)
+        return -EINVAL;
+    knacs_reg_op_t __user *uops = u64_to_user_ptr(batch.ops);
+    knacs_reg_op_t *ops = kvmalloc_array(batch.nops, sizeof(*ops), GFP_KERNEL);
+    if (!ops)
+        return -ENOMEM;
+    int ret = 0;
+    if (copy_from_user(ops, uops, batch.nops * sizeof(*ops))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    // Hold the register window for the whole batch so that the remove can't unmap it
+    // under us. Validate everything before touching the hardware.
+    int idx = knacs_pulse_ctl_regs_lock();
+    size_t regs_size;
+    void __iomem *base = knacs_pulse_ctl_regs(inst, &regs_size);
+    if (!base) {
+        ret = -ENODEV;
+        goto unlock;
+    }
+    for (u32 i = 0; i < batch.nops; i++) {
+        if (ops[i].op > KNACS_REG_WAIT || ops[i].offset % 4 != 0 ||
+            ops[i].offset >= regs_size) {
+            ret = -EINVAL;
+            goto unlock;
+        }
+    }
+    u32 max_us = READ_ONCE(reg_wait_max_us);
+    u32 timeout_us = batch.timeout_us ? min(batch.timeout_us, max_us) : max_us;
+
+    preempt_disable();
+    batch.ndone = knacs_pulse_ctl_run(base, ops, batch.nops, (u64)timeout_us * NSEC_PER_USEC);
+    preempt_enable();
+    knacs_pulse_ctl_regs_unlock(idx);
+
+    if (batch.ndone < batch.nops)
+        ret = -ETIMEDOUT;
+    if (copy_to_user(uops, ops, batch.ndone * sizeof(*ops)) ||
+        copy_to_user(&arg->ndone, &batch.ndone, sizeof(batch.ndone)))
+        ret = -EFAULT;
+out:
+    kvfree(ops);
+    return ret;
+unlock:
+    knacs_pulse_ctl_regs_unlock(idx);
+    goto out;
+}
+
 static const struct of_device_id knacs_pulse_ctl_of_ids[] = {
     { .compatible = "xlnx,pulse-controller-5",},
     {}
@@ -133,13 +413,32 @@ int __init knacs_pulse_ctl_init(void)
         pr_alert("Failed to register pulse controller driver\n");
         goto err;
     }
+    // The device ID is used as the instance index for the mock controllers.
+    for (unsigned int i = 0; i < min_t(unsigned int, pulse_ctl_mock, KNACS_MAX_INSTANCES); i++) {
+        struct platform_device *pdev =
+            platform_device_register_simple("knacs_pulse_controller", i, NULL, 0);
+        if (IS_ERR(pdev)) {
+            pr_alert("Failed to create mock pulse controller %u\n", i);
+            err = PTR_ERR(pdev);
+            goto unregister;
+        }
+        pulse_ctl_mock_pdevs[i] = pdev;
+    }
     return 0;
 
+unregister:
+    knacs_pulse_ctl_exit();
 err:
     return err;
 }
 
 void knacs_pulse_ctl_exit(void)
 {
+    for (int i = 0; i < KNACS_MAX_INSTANCES; i++) {
+        if (!pulse_ctl_mock_pdevs[i])
+            continue;
+        platform_device_unregister(pulse_ctl_mock_pdevs[i]);
+        pulse_ctl_mock_pdevs[i] = NULL;
+    }
     platform_driver_unregister(&knacs_pulse_ctl_driver);
 }
@@ -20,11 +20,25 @@
 #ifndef __KNACS_PULSE_CTRL_H__
 #define __KNACS_PULSE_CTRL_H__
 
+#include "knacs.h"
+
 #include <linux/mm.h>
 #include <linux/platform_device.h>
 
+struct knacs_instance;
+
 int knacs_pulse_ctl_init(void);
 void knacs_pulse_ctl_exit(void);
 int knacs_pulse_ctl_mmap(struct file*, struct vm_area_struct*);
+int knacs_pulse_ctl_batch(struct knacs_instance*, knacs_reg_batch_t __user *arg);
+// The register window stays mapped until `knacs_pulse_ctl_regs_unlock` (which must be
+// passed the returned value) after `knacs_pulse_ctl_regs_lock`. Can be used in any context
+// and doesn't block the remove of the controller, it only delays the unmapping.
+int knacs_pulse_ctl_regs_lock(void);
+void knacs_pulse_ctl_regs_unlock(int idx);
+// The mapped registers and their size, `NULL` if there's no pulse controller.
+// The pointer is only valid until the registers are unlocked
+// (or, for the setup of the users, until they are torn down when the controller is removed).
+void __iomem *knacs_pulse_ctl_regs(struct knacs_instance*, size_t *size);
 
 #endif
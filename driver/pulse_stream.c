@@ -0,0 +1,302 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (pulse-stream): " fmt
+
+/**
+ * Stream commands from a DMA buffer into the command FIFO of the pulse controller
+ * for hardware without a working AXI DMA. Each instance can run one stream.
+ *
+ * The FIFO is refilled from a periodic hrtimer and from the pulse controller interrupt
+ * (which is expected to be the FIFO-low interrupt when streaming), each time writing
+ * as many words as there's space for. The layout of the FIFO registers depends on
+ * the pulse controller configuration and must be set with the module parameters.
+ * Running out of data in the FIFO before the stream finishes is reported as an underflow.
+ *
+ * When the `pulse_stream_sim` module parameter is set, a simulated FIFO that drains
+ * at a fixed rate is used instead so that the engine can be tested without the FPGA.
+ */
+
+#include "pulse_stream.h"
+
+#include "buff_alloc.h"
+#include "event.h"
+#include "instance.h"
+#include "pulse_ctrl.h"
+
+#include <linux/hrtimer.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+
+static int pulse_stream_data_reg = -1;
+module_param(pulse_stream_data_reg, int, 0444);
+MODULE_PARM_DESC(pulse_stream_data_reg, "Offset of the command FIFO write register");
+
+static int pulse_stream_space_reg = -1;
+module_param(pulse_stream_space_reg, int, 0444);
+MODULE_PARM_DESC(pulse_stream_space_reg, "Offset of the register for the free space (in words) in the command FIFO");
+
+static unsigned int pulse_stream_depth = 0;
+module_param(pulse_stream_depth, uint, 0444);
+MODULE_PARM_DESC(pulse_stream_depth, "Depth of the command FIFO in words, for underflow detection");
+
+static unsigned int pulse_stream_period_us = 50;
+module_param(pulse_stream_period_us, uint, 0644);
+MODULE_PARM_DESC(pulse_stream_period_us, "Period of the FIFO refill timer");
+
+static bool pulse_stream_sim = false;
+module_param(pulse_stream_sim, bool, 0444);
+MODULE_PARM_DESC(pulse_stream_sim, "Stream into a simulated FIFO instead of the pulse controller");
+
+static unsigned int pulse_stream_sim_depth = 1024;
+module_param(pulse_stream_sim_depth, uint, 0444);
+MODULE_PARM_DESC(pulse_stream_sim_depth, "Depth of the simulated FIFO in words");
+
+static unsigned int pulse_stream_sim_rate = 10000000;
+module_param(pulse_stream_sim_rate, uint, 0644);
+MODULE_PARM_DESC(pulse_stream_sim_rate, "Rate the simulated FIFO is drained at in words per second");
+
+static u32 stream_fifo_space(struct knacs_pulse_stream *ps, bool *empty)
+{
+    if (ps->regs) {
+        u32 space = min(readl_relaxed(ps->regs + pulse_stream_space_reg), ps->depth);
+        *empty = space == ps->depth;
+        return space;
+    }
+    u64 now = ktime_get_ns();
+    u64 drained = div_u64((now - ps->sim_time) * READ_ONCE(pulse_stream_sim_rate),
+                          NSEC_PER_SEC);
+    // Only advance the time by what we've accounted for so that we don't lose
+    // the fractional words when this is called very often.
+    if (drained) {
+        ps->sim_time = now;
+        *empty = drained >= ps->sim_level;
+        ps->sim_level = drained >= ps->sim_level ? 0 : ps->sim_level - drained;
+    } else {
+        *empty = ps->sim_level == 0;
+    }
+    return ps->depth - ps->sim_level;
+}
+
+static void stream_fifo_push(struct knacs_pulse_stream *ps, const u32 *words, u32 n)
+{
+    if (!ps->regs) {
+        ps->sim_level += n;
+        return;
+    }
+    // The accesses to the same device are in order, no need for the barriers.
+    void __iomem *reg = ps->regs + pulse_stream_data_reg;
+    for (u32 i = 0; i < n; i++)
+        writel_relaxed(words[i], reg);
+}
+
+// Called with the lock held.
+static void stream_finish(struct knacs_pulse_stream *ps, int status)
+{
+    ps->running = false;
+    ps->stats.running = 0;
+    ps->stats.elapsed_ns = ktime_get_ns() - ps->start_time;
+    knacs_event_post(ps->owner, KNACS_EVENT_STREAM, status, ps->stats.words_sent);
+    knacs_buff_put(ps->buf);
+    knacs_file_put(ps->owner);
+    ps->buf = NULL;
+    ps->owner = NULL;
+}
+
+// Refill the FIFO. Called with the lock held.
+static void stream_fill(struct knacs_pulse_stream *ps)
+{
+    if (!ps->running)
+        return;
+    bool empty;
+    u32 space = stream_fifo_space(ps, &empty);
+    // The FIFO is empty at the beginning.
+    if (empty && ps->stats.words_sent) {
+        ps->stats.underflows++;
+        knacs_event_post(ps->owner, KNACS_EVENT_STREAM, -EPIPE, ps->stats.words_sent);
+    }
+    while (space > 0 && ps->remaining > 0) {
+        struct knacs_buf_seg *seg = &ps->buf->segs[ps->seg];
+        size_t len = min3((size_t)space * 4, ps->remaining, seg->len - ps->seg_offset);
+        u32 n = len / 4;
+        stream_fifo_push(ps, (const u32*)((const char*)seg->virt_addr + ps->seg_offset), n);
+        space -= n;
+        ps->remaining -= len;
+        ps->stats.words_sent += n;
+        ps->seg_offset += len;
+        if (ps->seg_offset == seg->len) {
+            ps->seg++;
+            ps->seg_offset = 0;
+        }
+    }
+    ps->stats.fills++;
+    if (ps->remaining == 0)
+        stream_finish(ps, 0);
+}
+
+static ktime_t stream_period(void)
+{
+    return ns_to_ktime((u64)max(READ_ONCE(pulse_stream_period_us), 1u) * NSEC_PER_USEC);
+}
+
+static enum hrtimer_restart stream_timer_func(struct hrtimer *timer)
+{
+    struct knacs_pulse_stream *ps = container_of(timer, struct knacs_pulse_stream, timer);
+    unsigned long flags;
+    spin_lock_irqsave(&ps->lock, flags);
+    stream_fill(ps);
+    bool running = ps->running;
+    spin_unlock_irqrestore(&ps->lock, flags);
+    if (!running)
+        return HRTIMER_NORESTART;
+    hrtimer_forward_now(timer, stream_period());
+    return HRTIMER_RESTART;
+}
+
+void knacs_pulse_stream_irq(struct knacs_instance *inst)
+{
+    struct knacs_pulse_stream *ps = &inst->stream;
+    unsigned long flags;
+    spin_lock_irqsave(&ps->lock, flags);
+    stream_fill(ps);
+    spin_unlock_irqrestore(&ps->lock, flags);
+}
+
+static int stream_start(struct knacs_file *kfile, u64 addr, u64 len)
+{
+    struct knacs_instance *inst = kfile->inst;
+    struct knacs_pulse_stream *ps = &inst->stream;
+    if (len == 0 || len % 4 != 0 || addr % 4 != 0 ||
+        addr != (unsigned long)addr || len != (size_t)len)
+        return -EINVAL;
+    void __iomem *regs = NULL;
+    u32 depth;
+    if (pulse_stream_sim) {
+        depth = pulse_stream_sim_depth;
+    } else {
+        size_t regs_size;
+        regs = knacs_pulse_ctl_regs(inst, &regs_size);
+        if (!regs || pulse_stream_data_reg < 0 || pulse_stream_space_reg < 0 ||
+            pulse_stream_data_reg + 4 > regs_size || pulse_stream_space_reg + 4 > regs_size)
+            return -ENODEV;
+        // Without the depth we can't tell when the FIFO is empty.
+        depth = pulse_stream_depth ? pulse_stream_depth : U32_MAX;
+    }
+    if (!depth)
+        return -EINVAL;
+
+    size_t offset;
+    struct vm_buf *buf = knacs_buff_get(addr, len, &offset);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    // The data is read by the CPU, nothing to sync.
+    unsigned int seg = 0;
+    while (offset >= buf->segs[seg].len) {
+        offset -= buf->segs[seg].len;
+        seg++;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&ps->lock, flags);
+    if (ps->running) {
+        spin_unlock_irqrestore(&ps->lock, flags);
+        knacs_buff_put(buf);
+        return -EBUSY;
+    }
+    ps->owner = knacs_file_get(kfile);
+    ps->buf = buf;
+    ps->seg = seg;
+    ps->seg_offset = offset;
+    ps->remaining = len;
+    ps->regs = regs;
+    ps->depth = depth;
+    ps->sim_level = 0;
+    ps->sim_time = ktime_get_ns();
+    memset(&ps->stats, 0, sizeof(ps->stats));
+    ps->stats.words_total = len / 4;
+    ps->stats.running = 1;
+    ps->start_time = ktime_get_ns();
+    ps->running = true;
+    stream_fill(ps);
+    bool running = ps->running;
+    spin_unlock_irqrestore(&ps->lock, flags);
+    if (running)
+        hrtimer_start(&ps->timer, stream_period(), HRTIMER_MODE_REL_HARD);
+    return 0;
+}
+
+int knacs_pulse_stream_start(struct knacs_file *kfile, u64 addr, u64 len)
+{
+    // Keep the registers mapped until the stream is installed so that the remove
+    // (which stops the stream after unpublishing the registers) can't miss it.
+    int idx = knacs_pulse_ctl_regs_lock();
+    int ret = stream_start(kfile, addr, len);
+    knacs_pulse_ctl_regs_unlock(idx);
+    return ret;
+}
+
+void knacs_pulse_stream_stop(struct knacs_instance *inst)
+{
+    struct knacs_pulse_stream *ps = &inst->stream;
+    hrtimer_cancel(&ps->timer);
+    unsigned long flags;
+    spin_lock_irqsave(&ps->lock, flags);
+    if (ps->running)
+        stream_finish(ps, -ECANCELED);
+    spin_unlock_irqrestore(&ps->lock, flags);
+}
+
+void knacs_pulse_stream_get_stats(struct knacs_instance *inst, knacs_stream_stats_t *stats)
+{
+    struct knacs_pulse_stream *ps = &inst->stream;
+    unsigned long flags;
+    spin_lock_irqsave(&ps->lock, flags);
+    *stats = ps->stats;
+    if (ps->running)
+        stats->elapsed_ns = ktime_get_ns() - ps->start_time;
+    spin_unlock_irqrestore(&ps->lock, flags);
+    if (stats->elapsed_ns)
+        stats->rate = div64_u64(stats->words_sent * NSEC_PER_SEC, stats->elapsed_ns);
+}
+
+int __init knacs_pulse_stream_init(void)
+{
+    for (unsigned int i = 0; i < KNACS_MAX_INSTANCES; i++) {
+        struct knacs_pulse_stream *ps = &knacs_instance_get(i)->stream;
+        spin_lock_init(&ps->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+        hrtimer_setup(&ps->timer, stream_timer_func, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+#else
+        hrtimer_init(&ps->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        ps->timer.function = stream_timer_func;
+#endif
+    }
+    if (pulse_stream_sim)
+        pr_info("Using simulated FIFO of %u words\n", pulse_stream_sim_depth);
+    return 0;
+}
+
+void knacs_pulse_stream_exit(void)
+{
+    for (unsigned int i = 0; i < KNACS_MAX_INSTANCES; i++)
+        knacs_pulse_stream_stop(knacs_instance_get(i));
+}
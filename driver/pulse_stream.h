@@ -0,0 +1,62 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_PULSE_STREAM_H__
+#define __KNACS_PULSE_STREAM_H__
+
+#include "knacs.h"
+
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+struct knacs_file;
+struct knacs_instance;
+struct vm_buf;
+
+struct knacs_pulse_stream {
+    spinlock_t lock;
+    struct hrtimer timer;
+    bool running;
+    struct knacs_file *owner;
+    struct vm_buf *buf;
+    // Position of the next word to send.
+    unsigned int seg;
+    size_t seg_offset;
+    size_t remaining; // Number of bytes left
+    void __iomem *regs; // `NULL` for the simulated FIFO
+    u32 depth;
+    // State of the simulated FIFO.
+    u64 sim_level;
+    u64 sim_time;
+    knacs_stream_stats_t stats;
+    u64 start_time;
+};
+
+int knacs_pulse_stream_init(void);
+void knacs_pulse_stream_exit(void);
+
+// Start streaming on the instance of the file.
+int knacs_pulse_stream_start(struct knacs_file*, u64 addr, u64 len);
+// Abort the running stream, if any.
+void knacs_pulse_stream_stop(struct knacs_instance*);
+void knacs_pulse_stream_get_stats(struct knacs_instance*, knacs_stream_stats_t *stats);
+// Called from the pulse controller interrupt handler to refill the FIFO.
+void knacs_pulse_stream_irq(struct knacs_instance*);
+
+#endif
@@ -0,0 +1,257 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (result-ring): " fmt
+
+/**
+ * Drain the result FIFO of the pulse controller (photon counts, clock-out events, etc.)
+ * into a ring mapped to the user.
+ *
+ * The FIFO is read when the pulse controller interrupts (in the completion thread, not in
+ * the interrupt handler) so the user thread being delayed doesn't make the hardware FIFO
+ * overflow. The entries are stamped with the time taken in the interrupt handler. The
+ * ring is a single producer (the completion work, serialized by the instance lock) and
+ * single consumer (the user) ring with the counters in the mapped header so the user can
+ * consume it without any syscall.
+ * The register layout depends on the pulse controller configuration and must be
+ * set with the module parameters.
+ */
+
+#include "result_ring.h"
+
+#include "event.h"
+#include "instance.h"
+#include "pulse_ctrl.h"
+
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+
+static int result_fifo_data_reg = -1;
+module_param(result_fifo_data_reg, int, 0444);
+MODULE_PARM_DESC(result_fifo_data_reg, "Offset of the result FIFO read register");
+
+static int result_fifo_count_reg = -1;
+module_param(result_fifo_count_reg, int, 0444);
+MODULE_PARM_DESC(result_fifo_count_reg, "Offset of the register for the number of words in the result FIFO");
+
+static unsigned int result_ring_entries = 4096;
+module_param(result_ring_entries, uint, 0444);
+MODULE_PARM_DESC(result_ring_entries, "Number of entries in the result ring (power of 2)");
+
+static void knacs_result_ring_release(struct kref *ref)
+{
+    struct knacs_result_ring *ring = container_of(ref, struct knacs_result_ring, ref);
+    vfree(ring->hdr);
+    kfree(ring);
+}
+
+static void knacs_result_ring_put(struct knacs_result_ring *ring)
+{
+    kref_put(&ring->ref, knacs_result_ring_release);
+}
+
+int knacs_result_ring_setup(struct knacs_instance *inst)
+{
+    if (result_fifo_data_reg < 0 || result_fifo_count_reg < 0)
+        return 0;
+    size_t regs_size;
+    void __iomem *base = knacs_pulse_ctl_regs(inst, &regs_size);
+    if (!base || result_fifo_data_reg + 4 > regs_size || result_fifo_count_reg + 4 > regs_size ||
+        result_fifo_data_reg % 4 != 0 || result_fifo_count_reg % 4 != 0) {
+        pr_alert("Invalid result FIFO registers\n");
+        return -EINVAL;
+    }
+    if (!is_power_of_2(result_ring_entries)) {
+        pr_alert("Invalid result ring size %u\n", result_ring_entries);
+        return -EINVAL;
+    }
+    struct knacs_result_ring *ring = kzalloc(sizeof(struct knacs_result_ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+    kref_init(&ring->ref);
+    ring->nentries = result_ring_entries;
+    ring->size = PAGE_SIZE + PAGE_ALIGN(ring->nentries * sizeof(knacs_result_entry_t));
+    // Zeroed and suitable for `remap_vmalloc_range`.
+    ring->hdr = vmalloc_user(ring->size);
+    if (!ring->hdr) {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    ring->entries = (void*)ring->hdr + PAGE_SIZE;
+    ring->hdr->nentries = ring->nentries;
+    ring->hdr->entry_offset = PAGE_SIZE;
+    ring->data_reg = base + result_fifo_data_reg;
+    ring->count_reg = base + result_fifo_count_reg;
+
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    inst->result_ring = ring;
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    pr_info("result ring %u with %u entries\n", inst->idx, ring->nentries);
+    return 0;
+}
+
+void knacs_result_ring_teardown(struct knacs_instance *inst)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_result_ring *ring = inst->result_ring;
+    inst->result_ring = NULL;
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    // The memory stays around until the user unmaps it.
+    if (ring)
+        knacs_result_ring_put(ring);
+    wake_up_interruptible_all(&inst->result_wait);
+}
+
+static u32 result_ring_level(struct knacs_result_ring *ring)
+{
+    u32 tail = smp_load_acquire(&ring->hdr->tail);
+    return min(ring->head - tail, ring->nentries);
+}
+
+static u32 result_ring_threshold(struct knacs_result_ring *ring)
+{
+    u32 threshold = READ_ONCE(ring->hdr->wake_threshold);
+    return clamp(threshold, 1u, ring->nentries);
+}
+
+// Called with the instance lock held.
+static void result_ring_drain(struct knacs_instance *inst, struct knacs_result_ring *ring,
+                              u64 irq_ns)
+{
+    // Don't let a misbehaving count register keep us here forever.
+    u32 budget = ring->nentries;
+    // Loading the tail with acquire makes sure the user is done with the entries
+    // before we overwrite them.
+    u32 tail = smp_load_acquire(&ring->hdr->tail);
+    u32 head = ring->head;
+    u32 overflow = ring->overflow;
+    u32 avail;
+    // The accesses to the same device are in order, no need for the barriers.
+    while (budget > 0 && (avail = readl_relaxed(ring->count_reg)) > 0) {
+        avail = min(avail, budget);
+        budget -= avail;
+        for (u32 i = 0; i < avail; i++) {
+            u32 value = readl_relaxed(ring->data_reg);
+            if (head - tail >= ring->nentries) {
+                overflow++;
+                continue;
+            }
+            knacs_result_entry_t *entry = &ring->entries[head & (ring->nentries - 1)];
+            entry->timestamp = irq_ns;
+            entry->value = value;
+            head++;
+        }
+    }
+    if (head == ring->head && overflow == ring->overflow)
+        return;
+    if (overflow != ring->overflow) {
+        ring->overflow = overflow;
+        WRITE_ONCE(ring->hdr->overflow, overflow);
+    }
+    u32 old_level = ring->head - tail;
+    ring->head = head;
+    // Publish the entries before the new head.
+    smp_store_release(&ring->hdr->head, head);
+    u32 threshold = result_ring_threshold(ring);
+    if (old_level < threshold && head - tail >= threshold)
+        wake_up_interruptible_poll(&inst->result_wait, EPOLLPRI);
+}
+
+void knacs_result_ring_process(struct knacs_instance *inst, u64 irq_ns)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_result_ring *ring = inst->result_ring;
+    if (ring)
+        result_ring_drain(inst, ring, irq_ns);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+}
+
+__poll_t knacs_result_ring_poll(struct knacs_instance *inst, struct file *filp, poll_table *wait)
+{
+    poll_wait(filp, &inst->result_wait, wait);
+    __poll_t mask = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_result_ring *ring = inst->result_ring;
+    if (ring && result_ring_level(ring) >= result_ring_threshold(ring))
+        mask = EPOLLPRI;
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    return mask;
+}
+
+static void result_vm_open(struct vm_area_struct *vma)
+{
+    struct knacs_result_ring *ring = vma->vm_private_data;
+    kref_get(&ring->ref);
+}
+
+static void result_vm_close(struct vm_area_struct *vma)
+{
+    knacs_result_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct result_vm_ops = {
+    .open = result_vm_open,
+    .close = result_vm_close,
+};
+
+int knacs_result_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if ((vma->vm_flags & (VM_SHARED | VM_MAYSHARE)) == 0)
+        return -EINVAL;
+
+    struct knacs_file *kfile = filp->private_data;
+    struct knacs_instance *inst = kfile->inst;
+    unsigned long flags;
+    spin_lock_irqsave(&inst->dma_lock, flags);
+    struct knacs_result_ring *ring = inst->result_ring;
+    if (ring)
+        kref_get(&ring->ref);
+    spin_unlock_irqrestore(&inst->dma_lock, flags);
+    if (!ring)
+        return -ENODEV;
+
+    int err = -EINVAL;
+    if (vma->vm_end - vma->vm_start != ring->size) {
+        pr_debug("Result ring must be mapped as a whole\n");
+        goto failed;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+    if ((err = remap_vmalloc_range(vma, ring->hdr, 0)))
+        goto failed;
+    vma->vm_private_data = ring;
+    vma->vm_ops = &result_vm_ops;
+    pr_debug("Mapped result ring\n");
+    return 0;
+
+failed:
+    knacs_result_ring_put(ring);
+    return err;
+}
@@ -0,0 +1,56 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_RESULT_RING_H__
+#define __KNACS_RESULT_RING_H__
+
+#include "knacs.h"
+
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+
+struct knacs_instance;
+
+struct knacs_result_ring {
+    struct kref ref;
+    knacs_result_ring_t *hdr; // The mapped memory, followed by the entries
+    knacs_result_entry_t *entries;
+    size_t size;
+    u32 nentries;
+    // Our copy of the counters, the user could write anything to the shared ones.
+    u32 head;
+    u32 overflow;
+    void __iomem *data_reg;
+    void __iomem *count_reg;
+};
+
+// Create the ring for the pulse controller of the instance if the FIFO registers
+// are configured. Called after the registers are mapped.
+int knacs_result_ring_setup(struct knacs_instance*);
+// Called before the registers are unmapped.
+void knacs_result_ring_teardown(struct knacs_instance*);
+// Drain the FIFO, called from the completion work of the pulse controller interrupt.
+// The entries are stamped with `irq_ns`, the time the interrupt arrived.
+void knacs_result_ring_process(struct knacs_instance*, u64 irq_ns);
+int knacs_result_ring_mmap(struct file*, struct vm_area_struct*);
+__poll_t knacs_result_ring_poll(struct knacs_instance*, struct file*, poll_table*);
+
+#endif
@@ -0,0 +1,302 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (seq-cache): " fmt
+
+/**
+ * Cache of the sequences uploaded by the user, keyed by a user supplied content key.
+ *
+ * A scan runs the same few sequences many times. Keeping them in kernel owned buffers
+ * means each repetition is only a lookup and a DMA submission instead of allocating,
+ * zeroing and filling a new buffer. The buffers are never mapped to the user and are
+ * only written once when uploaded, so the cache is cleaned right after the copy and
+ * nothing has to be synced before each transfer.
+ *
+ * The entries are in a hash table for the lookup and in a list in the order they were
+ * last used for the LRU eviction. The transfers hold their own reference to the buffer
+ * so evicting an entry never waits for the hardware.
+ */
+
+#include "seq_cache.h"
+
+#include "buff_alloc.h"
+#include "dma_buff.h"
+#include "dma_engine.h"
+#include "event.h"
+
+#include <linux/hashtable.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+static unsigned long seq_cache_size = 16 * 1024 * 1024;
+module_param(seq_cache_size, ulong, 0644);
+MODULE_PARM_DESC(seq_cache_size, "Maximum total size of the sequences in the sequence cache");
+
+struct seq_cache_entry {
+    struct hlist_node hnode;
+    struct list_head lru; // Most recently used first
+    struct knacs_instance *inst;
+    u64 key;
+    struct vm_buf *buf;
+    size_t len;
+};
+
+static DEFINE_HASHTABLE(seq_cache_table, 8);
+static LIST_HEAD(seq_cache_lru);
+static DEFINE_MUTEX(seq_cache_lock);
+static knacs_seq_cache_stats_t seq_cache_stats;
+// The owner of the cached memory, so that the pages reused for the cache
+// don't need to be zeroed before being overwritten.
+static u64 seq_cache_owner;
+
+// Called with the lock held.
+static struct seq_cache_entry *seq_cache_find(struct knacs_instance *inst, u64 key)
+{
+    struct seq_cache_entry *entry;
+    hash_for_each_possible(seq_cache_table, entry, hnode, key) {
+        if (entry->key == key && entry->inst == inst)
+            return entry;
+    }
+    return NULL;
+}
+
+// Remove the entry from the cache and move it to `evicted` to be freed without the lock.
+// Called with the lock held.
+static void seq_cache_remove(struct seq_cache_entry *entry, struct list_head *evicted)
+{
+    hash_del(&entry->hnode);
+    list_move_tail(&entry->lru, evicted);
+    seq_cache_stats.entries--;
+    seq_cache_stats.bytes -= entry->buf->sz;
+}
+
+// Called with the lock held.
+static bool seq_cache_evict_lru(struct list_head *evicted)
+{
+    if (list_empty(&seq_cache_lru))
+        return false;
+    seq_cache_remove(list_last_entry(&seq_cache_lru, struct seq_cache_entry, lru), evicted);
+    seq_cache_stats.evictions++;
+    return true;
+}
+
+static void seq_cache_free(struct list_head *evicted)
+{
+    struct seq_cache_entry *entry, *next;
+    list_for_each_entry_safe(entry, next, evicted, lru) {
+        knacs_buff_put(entry->buf);
+        kfree(entry);
+    }
+}
+
+// Allocate the memory for a new entry, evicting the least recently used ones
+// if there isn't enough memory left.
+static struct vm_buf *seq_cache_alloc(size_t size, struct gen_pool *pool)
+{
+    for (;;) {
+        // The whole buffer is overwritten, no need to zero it. Nothing is written
+        // through the cached kernel mapping after the upload, so no sync is needed
+        // before the transfers either, which is what the non-cached mode means for us.
+        struct vm_buf *buf = knacs_buff_alloc(size, seq_cache_owner,
+                                              KNACS_ALLOC_NO_ZERO | KNACS_ALLOC_UNCACHED, pool);
+        if (buf)
+            return buf;
+        LIST_HEAD(evicted);
+        mutex_lock(&seq_cache_lock);
+        bool more = seq_cache_evict_lru(&evicted);
+        mutex_unlock(&seq_cache_lock);
+        if (!more)
+            return NULL;
+        seq_cache_free(&evicted);
+    }
+}
+
+static int seq_cache_copy(struct vm_buf *buf, const char __user *src, size_t len)
+{
+    size_t offset = 0;
+    for (unsigned int i = 0; i < buf->nsegs && offset < len; i++) {
+        size_t sz = min(buf->segs[i].len, len - offset);
+        if (copy_from_user(buf->segs[i].virt_addr, src + offset, sz))
+            return -EFAULT;
+        offset += sz;
+    }
+    return 0;
+}
+
+// The key of a PUT is already in the cache. The upload is skipped if it's for the same
+// length, otherwise this is a collision (or a reused key) and the old content can't be
+// what the user meant. Called with the lock held.
+static int seq_cache_put_hit(struct seq_cache_entry *entry, knacs_seq_put_t *put)
+{
+    if (entry->len != put->len) {
+        pr_debug("Key 0x%llx already cached with length %zu instead of %llu\n",
+                 (unsigned long long)entry->key, entry->len, (unsigned long long)put->len);
+        return -EEXIST;
+    }
+    list_move(&entry->lru, &seq_cache_lru);
+    put->location = entry->buf->pool ? KNACS_BUFF_LOC_OCM : KNACS_BUFF_LOC_DRAM;
+    seq_cache_stats.put_hits++;
+    return 0;
+}
+
+int knacs_seq_cache_put(struct knacs_file *kfile, knacs_seq_put_t __user *arg)
+{
+    knacs_seq_put_t put;
+    if (copy_from_user(&put, arg, sizeof(put)))
+        return -EFAULT;
+    u32 tier = put.flags & KNACS_ALLOC_TIER_MASK;
+    if (put.len == 0 || put.len != (size_t)put.len || put.addr != (unsigned long)put.addr ||
+        (put.flags & ~KNACS_ALLOC_TIER_MASK) || tier > KNACS_ALLOC_TIER_BULK)
+        return -EINVAL;
+    size_t size = PAGE_ALIGN(put.len);
+    if (!size || size > READ_ONCE(seq_cache_size))
+        return -ENOSPC;
+    struct knacs_instance *inst = kfile->inst;
+    struct device *dev = knacs_dma_device(inst);
+    if (!dev)
+        return -ENODEV;
+
+    mutex_lock(&seq_cache_lock);
+    struct seq_cache_entry *entry = seq_cache_find(inst, put.key);
+    int err = entry ? seq_cache_put_hit(entry, &put) : 0;
+    mutex_unlock(&seq_cache_lock);
+    if (err)
+        return err;
+    if (entry)
+        goto out;
+
+    struct vm_buf *buf = seq_cache_alloc(size, knacs_dma_buff_tier_pool(size, tier));
+    if (!buf)
+        return -ENOMEM;
+    err = seq_cache_copy(buf, u64_to_user_ptr(put.addr), put.len);
+    if (!err)
+        err = knacs_buff_sync(buf, dev, 0, put.len, true, DMA_TO_DEVICE);
+    if (err) {
+        knacs_buff_put(buf);
+        return err;
+    }
+    entry = kzalloc(sizeof(struct seq_cache_entry), GFP_KERNEL);
+    if (!entry) {
+        knacs_buff_put(buf);
+        return -ENOMEM;
+    }
+    entry->inst = inst;
+    entry->key = put.key;
+    entry->buf = buf;
+    entry->len = put.len;
+    put.location = buf->pool ? KNACS_BUFF_LOC_OCM : KNACS_BUFF_LOC_DRAM;
+
+    LIST_HEAD(evicted);
+    mutex_lock(&seq_cache_lock);
+    // Someone else may have uploaded the same key in the mean time, keep theirs.
+    struct seq_cache_entry *old = seq_cache_find(inst, put.key);
+    if (old) {
+        err = seq_cache_put_hit(old, &put);
+        list_add(&entry->lru, &evicted);
+    } else {
+        unsigned long capacity = READ_ONCE(seq_cache_size);
+        while (seq_cache_stats.bytes + size > capacity) {
+            if (!seq_cache_evict_lru(&evicted))
+                break;
+        }
+        hash_add(seq_cache_table, &entry->hnode, entry->key);
+        list_add(&entry->lru, &seq_cache_lru);
+        seq_cache_stats.entries++;
+        seq_cache_stats.bytes += size;
+        seq_cache_stats.puts++;
+    }
+    mutex_unlock(&seq_cache_lock);
+    seq_cache_free(&evicted);
+    if (err)
+        return err;
+out:
+    if (copy_to_user(&arg->location, &put.location, sizeof(put.location)))
+        return -EFAULT;
+    return 0;
+}
+
+int knacs_seq_cache_submit(struct knacs_file *kfile, knacs_seq_submit_t __user *arg)
+{
+    knacs_seq_submit_t submit;
+    if (copy_from_user(&submit, arg, sizeof(submit)))
+        return -EFAULT;
+    mutex_lock(&seq_cache_lock);
+    struct seq_cache_entry *entry = seq_cache_find(kfile->inst, submit.key);
+    struct vm_buf *buf = NULL;
+    size_t len = 0;
+    if (entry) {
+        list_move(&entry->lru, &seq_cache_lru);
+        buf = knacs_buff_ref(entry->buf);
+        len = entry->len;
+        seq_cache_stats.hits++;
+    } else {
+        seq_cache_stats.misses++;
+    }
+    mutex_unlock(&seq_cache_lock);
+    if (!buf)
+        return -ENOENT;
+    int err = knacs_dma_submit_buf(kfile, buf, 0, len, NULL, &submit.token);
+    knacs_buff_put(buf);
+    if (err)
+        return err;
+    if (copy_to_user(&arg->token, &submit.token, sizeof(submit.token)))
+        return -EFAULT;
+    return 0;
+}
+
+int knacs_seq_cache_evict(struct knacs_file *kfile, u64 key)
+{
+    LIST_HEAD(evicted);
+    mutex_lock(&seq_cache_lock);
+    struct seq_cache_entry *entry = seq_cache_find(kfile->inst, key);
+    if (entry)
+        seq_cache_remove(entry, &evicted);
+    mutex_unlock(&seq_cache_lock);
+    if (!entry)
+        return -ENOENT;
+    seq_cache_free(&evicted);
+    return 0;
+}
+
+void knacs_seq_cache_get_stats(knacs_seq_cache_stats_t *stats)
+{
+    mutex_lock(&seq_cache_lock);
+    *stats = seq_cache_stats;
+    mutex_unlock(&seq_cache_lock);
+    stats->capacity = READ_ONCE(seq_cache_size);
+}
+
+void __init knacs_seq_cache_init(void)
+{
+    seq_cache_owner = knacs_owner_id_alloc();
+}
+
+void knacs_seq_cache_exit(void)
+{
+    LIST_HEAD(evicted);
+    mutex_lock(&seq_cache_lock);
+    list_splice_init(&seq_cache_lru, &evicted);
+    hash_init(seq_cache_table);
+    seq_cache_stats.entries = 0;
+    seq_cache_stats.bytes = 0;
+    mutex_unlock(&seq_cache_lock);
+    seq_cache_free(&evicted);
+}
@@ -0,0 +1,36 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_SEQ_CACHE_H__
+#define __KNACS_SEQ_CACHE_H__
+
+#include "knacs.h"
+
+struct knacs_file;
+
+void knacs_seq_cache_init(void);
+int knacs_seq_cache_put(struct knacs_file*, knacs_seq_put_t __user *arg);
+int knacs_seq_cache_submit(struct knacs_file*, knacs_seq_submit_t __user *arg);
+int knacs_seq_cache_evict(struct knacs_file*, u64 key);
+void knacs_seq_cache_get_stats(knacs_seq_cache_stats_t *stats);
+// Free all the cached sequences, called when unloading the module
+// after the DMA engines are gone.
+void knacs_seq_cache_exit(void);
+
+#endif
@@ -0,0 +1,220 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (stats): " fmt
+
+/**
+ * Instrumentation for the allocator and the device hot paths.
+ *
+ * The tracepoints (`knacs:*`, see `knacs_trace.h`) are for use with ftrace/perf.
+ * The debugfs directory `knacs` has the live statistics:
+ *
+ * * `pools`: usage of the DMA page cache, the DMA pool and the OCM pool.
+ * * `latency`: log2 histograms (in ns) of the latency of the operations.
+ *   Writing to it resets the histograms.
+ * * `dma`: statistics of the DMA channel.
+ */
+
+#include "stats.h"
+
+#include "dma_engine.h"
+#include "dma_page.h"
+#include "instance.h"
+#include "ocm.h"
+
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#define CREATE_TRACE_POINTS
+#include "knacs_trace.h"
+
+#define LAT_BUCKETS 32
+
+struct knacs_lat_hist {
+    atomic64_t count;
+    atomic64_t total_ns;
+    atomic64_t max_ns;
+    atomic64_t buckets[LAT_BUCKETS];
+};
+
+static const char *const lat_names[KNACS_LAT_NUM] = {
+    [KNACS_LAT_OCM_MMAP] = "ocm_mmap",
+    [KNACS_LAT_DMA_MMAP] = "dma_buff_mmap",
+    [KNACS_LAT_PULSE_CTL_MMAP] = "pulse_ctl_mmap",
+    [KNACS_LAT_DMA_SUBMIT] = "dma_submit",
+    [KNACS_LAT_DMA_XFER] = "dma_xfer",
+};
+
+static struct knacs_lat_hist lat_hists[KNACS_LAT_NUM];
+static struct dentry *debugfs_dir = NULL;
+
+void knacs_lat_record(unsigned int op, u64 ns)
+{
+    struct knacs_lat_hist *hist = &lat_hists[op];
+    // Bucket `i` is `[2^i, 2^(i + 1))` ns, except that the first one also includes 0.
+    unsigned int bucket = ns ? min_t(unsigned int, fls64(ns) - 1, LAT_BUCKETS - 1) : 0;
+    atomic64_inc(&hist->buckets[bucket]);
+    atomic64_inc(&hist->count);
+    atomic64_add(ns, &hist->total_ns);
+    s64 max = atomic64_read(&hist->max_ns);
+    while ((s64)ns > max) {
+        if (atomic64_try_cmpxchg(&hist->max_ns, &max, ns))
+            break;
+    }
+}
+
+struct pool_extent {
+    size_t largest;
+};
+
+static void pool_chunk_extent(struct gen_pool *pool, struct gen_pool_chunk *chunk, void *data)
+{
+    struct pool_extent *extent = data;
+    int order = pool->min_alloc_order;
+    unsigned long nbits = (chunk->end_addr - chunk->start_addr + 1) >> order;
+    unsigned long start = find_next_zero_bit(chunk->bits, nbits, 0);
+    while (start < nbits) {
+        unsigned long end = find_next_bit(chunk->bits, nbits, start);
+        extent->largest = max_t(size_t, extent->largest, (end - start) << order);
+        start = find_next_zero_bit(chunk->bits, nbits, end);
+    }
+}
+
+void knacs_gen_pool_get_stats(struct gen_pool *pool, knacs_pool_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!pool)
+        return;
+    // This is not atomic with respect to the allocations but good enough for statistics.
+    struct pool_extent extent = { 0 };
+    gen_pool_for_each_chunk(pool, pool_chunk_extent, &extent);
+    stats->size = gen_pool_size(pool);
+    stats->free = gen_pool_avail(pool);
+    stats->largest_free = extent.largest;
+    if (stats->free && extent.largest < stats->free)
+        stats->frag_ppm = div64_u64((stats->free - extent.largest) * 1000000, stats->free);
+}
+
+void knacs_gen_pool_show(struct seq_file *m, const char *name, struct gen_pool *pool)
+{
+    if (!pool) {
+        seq_printf(m, "%s: not available\n", name);
+        return;
+    }
+    knacs_pool_stats_t stats;
+    knacs_gen_pool_get_stats(pool, &stats);
+    seq_printf(m, "%s: size %llu, free %llu, largest free extent %llu, fragmentation %u ppm\n",
+               name, (unsigned long long)stats.size, (unsigned long long)stats.free,
+               (unsigned long long)stats.largest_free, stats.frag_ppm);
+}
+
+static int pools_show(struct seq_file *m, void *v)
+{
+    knacs_dma_page_show(m);
+    knacs_ocm_show(m);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pools);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+    for (unsigned int op = 0; op < KNACS_LAT_NUM; op++) {
+        struct knacs_lat_hist *hist = &lat_hists[op];
+        u64 count = atomic64_read(&hist->count);
+        seq_printf(m, "%s: count %llu, total %llu ns, max %lld ns\n", lat_names[op],
+                   count, (u64)atomic64_read(&hist->total_ns), atomic64_read(&hist->max_ns));
+        if (!count)
+            continue;
+        for (unsigned int i = 0; i < LAT_BUCKETS; i++) {
+            u64 n = atomic64_read(&hist->buckets[i]);
+            if (n)
+                seq_printf(m, "    < %llu ns: %llu\n", 2ull << i, n);
+        }
+    }
+    return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_show, inode->i_private);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *buf,
+                             size_t len, loff_t *ppos)
+{
+    for (unsigned int op = 0; op < KNACS_LAT_NUM; op++) {
+        struct knacs_lat_hist *hist = &lat_hists[op];
+        atomic64_set(&hist->count, 0);
+        atomic64_set(&hist->total_ns, 0);
+        atomic64_set(&hist->max_ns, 0);
+        for (unsigned int i = 0; i < LAT_BUCKETS; i++)
+            atomic64_set(&hist->buckets[i], 0);
+    }
+    return len;
+}
+
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .write = latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void dma_show_instance(struct seq_file *m, struct knacs_instance *inst)
+{
+    knacs_dma_stats_t stats;
+    if (knacs_dma_get_stats(inst, &stats))
+        return;
+    seq_printf(m, "instance %u:\n", inst->idx);
+    seq_printf(m, "submitted: %llu\ncompleted: %llu\nerrors: %llu\nbytes: %llu\n"
+               "busy_ns: %llu\nqueued: %u\nmax_queued: %u\n",
+               stats.submitted, stats.completed, stats.errors, stats.bytes,
+               stats.busy_ns, stats.queued, stats.max_queued);
+    seq_printf(m, "desc_total: %u\ndesc_used: %u\ndesc_max_used: %u\ndesc_splits: %u\n",
+               stats.desc_total, stats.desc_used, stats.desc_max_used, stats.desc_splits);
+    seq_printf(m, "chained: %llu\ngaps: %llu\ngap_ns: %llu\nmax_gap_ns: %llu\n",
+               stats.chained, stats.gaps, stats.gap_ns, stats.max_gap_ns);
+}
+
+static int dma_show(struct seq_file *m, void *v)
+{
+    for (unsigned int i = 0; i < KNACS_MAX_INSTANCES; i++)
+        dma_show_instance(m, knacs_instance_get(i));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dma);
+
+void knacs_debugfs_init(void)
+{
+    debugfs_dir = debugfs_create_dir("knacs", NULL);
+    debugfs_create_file("pools", 0444, debugfs_dir, NULL, &pools_fops);
+    debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+    debugfs_create_file("dma", 0444, debugfs_dir, NULL, &dma_fops);
+}
+
+void knacs_debugfs_exit(void)
+{
+    debugfs_remove_recursive(debugfs_dir);
+    debugfs_dir = NULL;
+}
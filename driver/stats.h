@@ -0,0 +1,50 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_STATS_H__
+#define __KNACS_STATS_H__
+
+#include "knacs.h"
+
+#include <linux/genalloc.h>
+#include <linux/seq_file.h>
+
+// Operations we keep latency histograms for.
+enum {
+    KNACS_LAT_OCM_MMAP,
+    KNACS_LAT_DMA_MMAP,
+    KNACS_LAT_PULSE_CTL_MMAP,
+    KNACS_LAT_DMA_SUBMIT,
+    KNACS_LAT_DMA_XFER, // From the submission to the completion of a transfer
+    KNACS_LAT_NUM,
+};
+
+// Safe to be called from interrupt context.
+void knacs_lat_record(unsigned int op, u64 ns);
+
+// Usage of the pool, all zero if `pool` is `NULL`.
+void knacs_gen_pool_get_stats(struct gen_pool*, knacs_pool_stats_t *stats);
+// Print the usage of the pool, including the largest free extent.
+void knacs_gen_pool_show(struct seq_file*, const char *name, struct gen_pool*);
+
+// Failing to create the debugfs files is not fatal.
+void knacs_debugfs_init(void);
+void knacs_debugfs_exit(void);
+
+#endif
@@ -0,0 +1,134 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#define pr_fmt(fmt) "KNaCs (uring): " fmt
+
+#include "uring.h"
+
+#include "dma_engine.h"
+#include "event.h"
+#include "instance.h"
+#include "knacs.h"
+#include "pulse_ctrl.h"
+
+#include <linux/bug.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#ifdef KNACS_HAS_URING_CMD
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#    include <linux/io_uring/cmd.h>
+#  else
+#    include <linux/io_uring.h>
+#  endif
+#endif
+
+#ifdef KNACS_HAS_URING_CMD
+
+static inline struct io_uring_cmd *knacs_uring_cmd_of(struct knacs_dma_waiter *waiter)
+{
+    return container_of((void*)waiter, struct io_uring_cmd, pdu);
+}
+
+// The task work callback takes a token instead of the issue flags in newer kernels.
+#ifdef IO_URING_CMD_TASK_WORK_ISSUE_FLAGS
+static void knacs_uring_task_done(struct io_uring_cmd *ucmd, io_tw_token_t tw)
+{
+    const unsigned int issue_flags = IO_URING_CMD_TASK_WORK_ISSUE_FLAGS;
+#else
+static void knacs_uring_task_done(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+#endif
+    struct knacs_dma_waiter *waiter = (void*)ucmd->pdu;
+    io_uring_cmd_done(ucmd, waiter->status, waiter->token, issue_flags);
+}
+
+void knacs_uring_complete(struct knacs_dma_waiter *waiter)
+{
+    // The CQE can only be posted from the task context.
+    io_uring_cmd_complete_in_task(knacs_uring_cmd_of(waiter), knacs_uring_task_done);
+}
+
+// The transfers and the waits may never finish if the engine is stuck.
+// Let the ring teardown (and the exit of the task) cancel them instead of waiting forever.
+// Only called when the command is queued, a command that fails synchronously
+// must not be on the cancelable list.
+static int knacs_uring_queued(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+#ifdef KNACS_HAS_URING_CANCEL
+    io_uring_cmd_mark_cancelable(ucmd, issue_flags);
+#endif
+    return -EIOCBQUEUED;
+}
+
+// Only the commands that are worth batching are supported.
+// The transfer submission and the register batch may sleep briefly
+// (on the allocation or the mmap lock) even with `IO_URING_F_NONBLOCK`.
+// Punting them to the io-wq threads instead would cost a context switch per command,
+// which is exactly what we'd like to avoid.
+int knacs_uring_cmd(struct io_uring_cmd *ucmd, unsigned int issue_flags)
+{
+    struct knacs_file *kfile = ucmd->file->private_data;
+    struct knacs_dma_waiter *waiter = (void*)ucmd->pdu;
+    const void *cmd = io_uring_sqe_cmd(ucmd->sqe);
+    BUILD_BUG_ON(sizeof(struct knacs_dma_waiter) > sizeof(ucmd->pdu));
+#ifdef KNACS_HAS_URING_CANCEL
+    // Only the pending transfers and waits are marked as cancelable.
+    // If the waiter isn't pending anymore the completion is already queued.
+    if (issue_flags & IO_URING_F_CANCEL) {
+        if (knacs_dma_cancel_waiter(kfile->inst, waiter))
+            io_uring_cmd_done(ucmd, -ECANCELED, 0, issue_flags);
+        return 0;
+    }
+#endif
+    // The arguments are read from the SQE which is shared with the user.
+    switch (ucmd->cmd_op) {
+    case KNACS_DMA_SUBMIT: {
+        const knacs_uring_dma_submit_t *arg = cmd;
+        u64 token;
+        int err = knacs_dma_submit(kfile, READ_ONCE(arg->addr), READ_ONCE(arg->len),
+                                   waiter, &token);
+        // The transfer might be done already, in which case the completion
+        // is queued as task work and runs after we return.
+        return err ? err : knacs_uring_queued(ucmd, issue_flags);
+    }
+    case KNACS_DMA_WAIT: {
+        const knacs_dma_wait_t *arg = cmd;
+        int ret = knacs_dma_wait_async(kfile->inst, READ_ONCE(*arg), waiter);
+        if (ret < 0)
+            return ret;
+        return ret ? 0 : knacs_uring_queued(ucmd, issue_flags);
+    }
+    case KNACS_REG_BATCH: {
+        const knacs_uring_reg_batch_t *arg = cmd;
+        return knacs_pulse_ctl_batch(kfile->inst, u64_to_user_ptr(READ_ONCE(arg->batch)));
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+#else
+
+void knacs_uring_complete(struct knacs_dma_waiter *waiter)
+{
+    // Waiters are only created by io_uring commands.
+    WARN_ON(1);
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*************************************************************************
+ *   Copyright (c) 2021 - 2021 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This program is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU General Public License         *
+ *   as published by the Free Software Foundation; either version 2      *
+ *   of the License, or (at your option) any later version.              *
+ *                                                                       *
+ *   This program is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the       *
+ *   GNU General Public License for more details.                        *
+ *                                                                       *
+ *   You should have received a copy of the GNU General Public License   *
+ *   along with this program; if not, write to the Free Software         *
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA       *
+ *   02110-1301, USA.                                                    *
+ *************************************************************************/
+
+#ifndef __KNACS_URING_H__
+#define __KNACS_URING_H__
+
+#include <linux/version.h>
+
+struct knacs_dma_waiter;
+
+// `io_uring_sqe_cmd` (and the whole SQE in the command) is only available since 6.5.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#  define KNACS_HAS_URING_CMD 1
+// Commands can be marked as cancelable since 6.7.
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#    define KNACS_HAS_URING_CANCEL 1
+#  endif
+struct io_uring_cmd;
+int knacs_uring_cmd(struct io_uring_cmd*, unsigned int issue_flags);
+#endif
+
+// Post the CQE for the command the waiter belongs to.
+// Safe to be called from interrupt context.
+void knacs_uring_complete(struct knacs_dma_waiter*);
+
+#endif